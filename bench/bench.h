@@ -0,0 +1,85 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A minimal microbenchmark harness. Each benchmark is run with a growing
+// number of iterations until a run takes long enough to time reliably, and
+// its result is printed as a JSON line.
+namespace bench {
+
+// The shortest run whose timing is reported.
+const auto kMinRunTime = std::chrono::milliseconds{200};
+
+// Parameters of a benchmark, printed along with its result.
+typedef std::vector<std::pair<std::string, double>> Params;
+
+// Passed to a benchmark to tell it how many iterations to run, and to let it
+// exclude per-iteration setup from the timing.
+class State {
+ public:
+  explicit State(size_t iterations)
+      : iterations_(iterations),
+        elapsed_(0),
+        start_(std::chrono::steady_clock::now()) {}
+
+  inline size_t iterations() const { return iterations_; }
+
+  // Stops and restarts the timer around work that should not be measured.
+  inline void PauseTiming() {
+    elapsed_ += std::chrono::steady_clock::now() - start_;
+  }
+  inline void ResumeTiming() { start_ = std::chrono::steady_clock::now(); }
+
+  // Returns the measured time. Only valid once the timer is paused.
+  inline std::chrono::nanoseconds Elapsed() const { return elapsed_; }
+
+ private:
+  const size_t iterations_;
+  std::chrono::nanoseconds elapsed_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Prevents the compiler from optimizing away the computation of v.
+template <class T>
+inline void DoNotOptimize(const T& v) {
+  asm volatile("" : : "g"(&v) : "memory");
+}
+
+// Runs the benchmark and prints its time per iteration, in nanoseconds.
+inline void Run(const std::string& name, const Params& params,
+                std::function<void(State&)> fn) {
+  size_t iterations = 1;
+  while (true) {
+    State state(iterations);
+    fn(state);
+    state.PauseTiming();
+    auto elapsed = state.Elapsed();
+    if (elapsed >= kMinRunTime || iterations >= (size_t{1} << 40)) {
+      std::cout << "{\"bench\": \"" << name << "\"";
+      for (auto const& p : params) {
+        std::cout << ", \"" << p.first << "\": " << p.second;
+      }
+      std::cout << ", \"iterations\": " << iterations << ", \"ns_per_op\": "
+                << (double)elapsed.count() / iterations << "}" << std::endl;
+      return;
+    }
+    // Aim past the minimum run time, growing by at most 10x per step.
+    double scale = elapsed.count() > 0
+                       ? 1.5 * std::chrono::nanoseconds(kMinRunTime).count() /
+                             elapsed.count()
+                       : 10;
+    iterations = std::max(iterations + 1,
+                          (size_t)(iterations * std::min(scale, 10.0)));
+  }
+}
+
+}  // namespace bench
+
+#endif
@@ -0,0 +1,346 @@
+// Runs real clusters of bin/general processes on the loopback interface and
+// reports how long the lieutenants take to decide and how much traffic each
+// run generates.
+//
+// Usage: cluster_bench [--runs R] [--binary path] [n:f[:mix] ...]
+//
+// A mix is a comma-separated list of malicious behaviors. Each is given to
+// its own process: "wrong_order" to the commander, and every other behavior
+// to the next lieutenant, starting from the highest id. The default sweep is
+// 4:1, 4:1:silent, 7:2 and 7:2:silent with 3 runs each.
+//
+// Every run writes a hostfile of unused ports on the current host, launches the
+// lieutenants and then the commander with --report, and collects each
+// process's report. Decision latency is measured from the commander's launch
+// to each loyal lieutenant's decision, using the steady_clock shared by all
+// processes on the host.
+
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+const char* kDefaultBinary = "bin/general";
+const char* kDefaultSweep[] = {"4:1", "4:1:silent", "7:2", "7:2:silent"};
+const unsigned int kDefaultRuns = 3;
+
+// How long lieutenants get to start listening before the commander starts.
+const auto kLieutenantHeadStart = std::chrono::milliseconds{200};
+// How long a run may take before its processes are killed.
+const auto kRunTimeout = std::chrono::seconds{30};
+
+// A cluster configuration in the sweep.
+struct Shape {
+  unsigned int process_num;
+  unsigned int faulty;
+  std::string mix;
+  // The malicious behaviors of each process, indexed by id.
+  std::vector<std::vector<std::string>> behaviors;
+};
+
+// The report a process printed with --report.
+struct Report {
+  bool present;
+  std::string decision;
+  int64_t decided_ns;
+  uint64_t messages;
+  uint64_t acks;
+  uint64_t bytes;
+};
+
+// Parses a shape of the form n:f[:mix].
+Shape ParseShape(const std::string& str) {
+  Shape shape;
+  std::istringstream in(str);
+  std::string field;
+  std::vector<std::string> fields;
+  while (std::getline(in, field, ':')) fields.push_back(field);
+  if (fields.size() < 2 || fields.size() > 3) {
+    throw std::invalid_argument("shapes must be given as n:f[:mix]");
+  }
+  shape.process_num = std::stoul(fields[0]);
+  shape.faulty = std::stoul(fields[1]);
+  shape.mix = fields.size() == 3 ? fields[2] : "none";
+  if (shape.process_num < shape.faulty + 2) {
+    throw std::invalid_argument(
+        "the total number of processes must be no less than (faulty + 2)");
+  }
+
+  shape.behaviors.resize(shape.process_num);
+  unsigned int next_lieutenant = shape.process_num - 1;
+  std::istringstream mix(fields.size() == 3 ? fields[2] : "");
+  std::string behavior;
+  while (std::getline(mix, behavior, ',')) {
+    if (behavior == "wrong_order") {
+      shape.behaviors[0].push_back(behavior);
+      continue;
+    }
+    if (next_lieutenant == 0) {
+      throw std::invalid_argument("more malicious lieutenants than exist");
+    }
+    shape.behaviors[next_lieutenant--].push_back(behavior);
+  }
+  return shape;
+}
+
+// Returns a UDP port that is not in use.
+unsigned short UnusedPort() {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) throw std::runtime_error("could not create socket");
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  socklen_t len = sizeof(addr);
+  if (bind(fd, (struct sockaddr*)&addr, len) < 0 ||
+      getsockname(fd, (struct sockaddr*)&addr, &len) < 0) {
+    close(fd);
+    throw std::runtime_error("could not find an unused port");
+  }
+  close(fd);
+  return ntohs(addr.sin_port);
+}
+
+// Starts the binary with the provided arguments, with its stdout written to
+// the output file. Returns the child's pid.
+pid_t Launch(const std::string& binary, const std::vector<std::string>& args,
+             const std::string& output) {
+  pid_t pid = fork();
+  if (pid < 0) throw std::runtime_error("could not fork");
+  if (pid == 0) {
+    int fd = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) _exit(127);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+    std::vector<char*> argv;
+    argv.push_back(const_cast<char*>(binary.c_str()));
+    for (auto const& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+    execv(binary.c_str(), argv.data());
+    _exit(127);
+  }
+  return pid;
+}
+
+// Returns the number following "key": in the JSON line.
+std::string Field(const std::string& line, const std::string& key) {
+  auto pos = line.find("\"" + key + "\": ");
+  if (pos == std::string::npos) return "";
+  pos += key.size() + 4;
+  auto end = line.find_first_of(",}", pos);
+  std::string value = line.substr(pos, end - pos);
+  value.erase(std::remove(value.begin(), value.end(), '"'), value.end());
+  return value;
+}
+
+// Reads the report a process wrote to its output file.
+Report ReadReport(const std::string& output) {
+  Report report = {};
+  std::ifstream file(output);
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.compare(0, 7, "{\"id\": ") != 0) continue;
+    report.present = true;
+    report.decision = Field(line, "decision");
+    report.decided_ns = std::stoll(Field(line, "decided_ns"));
+    report.messages = std::stoull(Field(line, "messages_received"));
+    report.acks = std::stoull(Field(line, "acks_received"));
+    report.bytes = std::stoull(Field(line, "bytes_received"));
+  }
+  return report;
+}
+
+// Waits for every process to exit, killing those still running at the
+// deadline.
+void WaitAll(std::vector<pid_t>* pids,
+             std::chrono::steady_clock::time_point deadline) {
+  while (!pids->empty()) {
+    for (auto it = pids->begin(); it != pids->end();) {
+      if (waitpid(*it, nullptr, WNOHANG) == *it) {
+        it = pids->erase(it);
+      } else {
+        ++it;
+      }
+    }
+    if (std::chrono::steady_clock::now() > deadline) {
+      for (auto pid : *pids) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+      }
+      pids->clear();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds{5});
+  }
+}
+
+// The outcome of one run of a cluster.
+struct RunResult {
+  bool agreed;
+  // Decision latencies of the loyal lieutenants, in milliseconds.
+  std::vector<double> latencies_ms;
+  uint64_t messages;
+  uint64_t acks;
+  uint64_t bytes;
+};
+
+RunResult RunCluster(const std::string& binary, const Shape& shape,
+                     const std::string& dir) {
+  // Processes only accept ids whose host is the current hostname, so the
+  // hostfile lists it with a unique port per process.
+  char hostname[HOST_NAME_MAX + 1] = {};
+  gethostname(hostname, sizeof(hostname) - 1);
+  const std::string hostfile = dir + "/hostfile";
+  {
+    std::ofstream file(hostfile);
+    for (unsigned int i = 0; i < shape.process_num; ++i) {
+      file << hostname << ":" << UnusedPort() << "\n";
+    }
+  }
+
+  auto args_for = [&](unsigned int id) {
+    std::vector<std::string> args = {"-h", hostfile,
+                                      "-f", std::to_string(shape.faulty),
+                                      "-C", "0",
+                                      "-i", std::to_string(id),
+                                      "--report"};
+    if (id == 0) {
+      args.push_back("-o");
+      args.push_back("attack");
+    }
+    for (auto const& behavior : shape.behaviors[id]) {
+      args.push_back("-m");
+      args.push_back(behavior);
+    }
+    return args;
+  };
+  auto output_for = [&](unsigned int id) {
+    return dir + "/out." + std::to_string(id);
+  };
+
+  std::vector<pid_t> pids;
+  for (unsigned int id = 1; id < shape.process_num; ++id) {
+    pids.push_back(Launch(binary, args_for(id), output_for(id)));
+  }
+  std::this_thread::sleep_for(kLieutenantHeadStart);
+  const auto start = std::chrono::steady_clock::now();
+  pids.push_back(Launch(binary, args_for(0), output_for(0)));
+  WaitAll(&pids, start + kRunTimeout);
+
+  RunResult result = {};
+  result.agreed = true;
+  const bool loyal_commander = shape.behaviors[0].empty();
+  for (unsigned int id = 0; id < shape.process_num; ++id) {
+    auto report = ReadReport(output_for(id));
+    result.messages += report.messages;
+    result.acks += report.acks;
+    result.bytes += report.bytes;
+    if (id == 0 || !shape.behaviors[id].empty()) continue;
+
+    // Every loyal lieutenant must decide, and decide attack if the commander
+    // is loyal.
+    if (!report.present ||
+        (loyal_commander && report.decision != "attack")) {
+      result.agreed = false;
+      continue;
+    }
+    result.latencies_ms.push_back(
+        (report.decided_ns -
+         std::chrono::duration_cast<std::chrono::nanoseconds>(
+             start.time_since_epoch())
+             .count()) /
+        1e6);
+  }
+  return result;
+}
+
+// Returns the pth percentile of the sorted values.
+double Percentile(const std::vector<double>& sorted, double p) {
+  if (sorted.empty()) return 0;
+  size_t i = std::min(sorted.size() - 1, (size_t)(p / 100 * sorted.size()));
+  return sorted[i];
+}
+
+int main(int argc, const char** argv) {
+  std::string binary = kDefaultBinary;
+  unsigned int runs = kDefaultRuns;
+  std::vector<std::string> sweep;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--runs" && i + 1 < argc) {
+      runs = std::stoul(argv[++i]);
+    } else if (arg == "--binary" && i + 1 < argc) {
+      binary = argv[++i];
+    } else {
+      sweep.push_back(arg);
+    }
+  }
+  if (sweep.empty()) {
+    sweep.assign(std::begin(kDefaultSweep), std::end(kDefaultSweep));
+  }
+  if (access(binary.c_str(), X_OK) != 0) {
+    std::cerr << binary << " is not an executable, run make first"
+              << std::endl;
+    return 1;
+  }
+
+  char dir_template[] = "/tmp/cluster_bench.XXXXXX";
+  if (mkdtemp(dir_template) == nullptr) {
+    std::cerr << "could not create a temporary directory" << std::endl;
+    return 1;
+  }
+  const std::string dir = dir_template;
+
+  unsigned int max_processes = 0;
+  for (auto const& str : sweep) {
+    Shape shape = ParseShape(str);
+    max_processes = std::max(max_processes, shape.process_num);
+    std::vector<double> latencies;
+    unsigned int agreed = 0;
+    uint64_t messages = 0, acks = 0, bytes = 0;
+    for (unsigned int r = 0; r < runs; ++r) {
+      auto result = RunCluster(binary, shape, dir);
+      if (result.agreed) agreed++;
+      latencies.insert(latencies.end(), result.latencies_ms.begin(),
+                       result.latencies_ms.end());
+      messages += result.messages;
+      acks += result.acks;
+      bytes += result.bytes;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    std::cout << "{\"bench\": \"cluster/agreement\", \"processes\": "
+              << shape.process_num << ", \"faulty\": " << shape.faulty
+              << ", \"mix\": \"" << shape.mix << "\", \"runs\": " << runs
+              << ", \"agreed\": " << agreed
+              << ", \"p50_ms\": " << Percentile(latencies, 50)
+              << ", \"p90_ms\": " << Percentile(latencies, 90)
+              << ", \"p99_ms\": " << Percentile(latencies, 99)
+              << ", \"max_ms\": " << Percentile(latencies, 100)
+              << ", \"messages_per_run\": " << (double)messages / runs
+              << ", \"acks_per_run\": " << (double)acks / runs
+              << ", \"bytes_per_run\": " << (double)bytes / runs << "}"
+              << std::endl;
+  }
+
+  // Clean up the hostfile and outputs.
+  unlink((dir + "/hostfile").c_str());
+  for (unsigned int id = 0; id < max_processes; ++id) {
+    unlink((dir + "/out." + std::to_string(id)).c_str());
+  }
+  rmdir(dir.c_str());
+  return 0;
+}
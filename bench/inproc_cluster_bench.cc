@@ -0,0 +1,281 @@
+// Runs entire clusters inside one process over the in-process transport, so
+// that agreement latency reflects the protocol alone with no kernel involved.
+//
+// Usage: inproc_cluster_bench [processes] [faulty] [runs]
+//
+// Each run starts a fresh Commander and set of Lieutenants on their own
+// threads, and measures the time from the Commander starting to every
+// General having decided. A final set of runs decides many instances at once
+// and reports decisions per second at each in-flight limit, and a last one
+// compares interactive consistency, where every process broadcasts at once,
+// against running each process's broadcast in turn. The last runs agreements
+// one at a time on warm Daemons, with the commander rotating, to show the
+// cost of an agreement without the startup of a fresh cluster. The very last
+// starts a Lieutenant only after the others have decided without it, and
+// measures how long it takes to catch up and agree with them.
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "general.h"
+#include "inproc_conn.h"
+#include "thread.h"
+
+const unsigned int kDefaultProcesses = 7;
+const unsigned int kDefaultFaulty = 2;
+const unsigned int kDefaultRuns = 10;
+const unsigned short kBasePort = 40000;
+const unsigned int kThroughputInstances = 256;
+const unsigned int kInFlight[] = {1, 16, 64};
+const unsigned int kDaemonInstances = 100;
+
+// Runs the provided number of agreement instances and returns how long they
+// took in microseconds.
+double RunCluster(const generals::ProcessList& processes, unsigned int faulty,
+                  unsigned int instances = 1, unsigned int in_flight = 1) {
+  auto resolved = udp::ResolveAll(processes);
+  auto network = std::make_shared<inproc::Network>(resolved);
+  std::vector<std::shared_ptr<transport::Server>> servers;
+  for (auto const& addr : resolved) {
+    servers.push_back(std::make_shared<inproc::Server>(
+        network, addr, generals::SeqOfAck, generals::kRoundTimeout));
+  }
+
+  const auto order = msg::Order::ATTACK;
+  std::vector<std::unique_ptr<generals::General>> generals;
+  generals.push_back(std::make_unique<generals::Commander>(
+      processes, servers[0], faulty, order, generals::MaliciousBehavior::NONE));
+  for (unsigned int pid = 1; pid < processes.size(); ++pid) {
+    generals.push_back(std::make_unique<generals::Lieutenant>(
+        processes, pid, servers[pid], faulty,
+        generals::MaliciousBehavior::NONE));
+  }
+
+  // Start the Lieutenants first so they are listening when the Commander
+  // sends its order.
+  std::vector<std::vector<msg::Orders>> decisions(processes.size());
+  threadutil::ThreadGroup threads;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t pid = processes.size(); pid-- > 0;) {
+    threads.AddThread([&, pid] {
+      decisions[pid] = generals[pid]->DecideInstances(instances, in_flight);
+    });
+  }
+  threads.JoinAll();
+  auto end = std::chrono::steady_clock::now();
+
+  for (auto const& general : decisions) {
+    for (auto const& decision : general) {
+      if (decision.At(0) != order) {
+        throw std::logic_error("generals did not agree on the order");
+      }
+    }
+  }
+  return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+// Runs an agreement with the last Lieutenant starting late: once the Commander
+// has given up waiting for it and has stopped resending it the order, while the
+// others are still resending it their last rounds. Returns how long the late
+// Lieutenant took to decide once it started, in microseconds.
+double RunLateLieutenant(const generals::ProcessList& processes,
+                         unsigned int faulty) {
+  auto resolved = udp::ResolveAll(processes);
+  auto network = std::make_shared<inproc::Network>(resolved);
+  const unsigned int late = processes.size() - 1;
+  std::vector<std::shared_ptr<transport::Server>> servers;
+  for (unsigned int pid = 0; pid < late; ++pid) {
+    servers.push_back(std::make_shared<inproc::Server>(
+        network, resolved[pid], generals::SeqOfAck, generals::kRoundTimeout));
+  }
+
+  const auto order = msg::Order::ATTACK;
+  std::vector<std::unique_ptr<generals::General>> generals;
+  generals.push_back(std::make_unique<generals::Commander>(
+      processes, servers[0], faulty, order, generals::MaliciousBehavior::NONE));
+  for (unsigned int pid = 1; pid < late; ++pid) {
+    generals.push_back(std::make_unique<generals::Lieutenant>(
+        processes, pid, servers[pid], faulty,
+        generals::MaliciousBehavior::NONE));
+  }
+
+  std::vector<std::vector<msg::Orders>> decisions(processes.size());
+  threadutil::ThreadGroup threads;
+  for (size_t pid = late; pid-- > 1;) {
+    threads.AddThread([&, pid] {
+      decisions[pid] = generals[pid]->DecideInstances(1, 1);
+    });
+  }
+  decisions[0] = generals[0]->DecideInstances(1, 1);
+
+  // The late Lieutenant's server does not exist until it starts, so every
+  // datagram sent to it before then was dropped, as if it were not running.
+  auto start = std::chrono::steady_clock::now();
+  auto server = std::make_shared<inproc::Server>(
+      network, resolved[late], generals::SeqOfAck, generals::kRoundTimeout);
+  generals::Lieutenant lieutenant(processes, late, server, faulty,
+                                  generals::MaliciousBehavior::NONE);
+  decisions[late] = lieutenant.DecideInstances(1, 1);
+  auto end = std::chrono::steady_clock::now();
+  threads.JoinAll();
+
+  for (auto const& general : decisions) {
+    if (general.at(0).At(0) != order) {
+      throw std::logic_error("the late lieutenant did not agree");
+    }
+  }
+  return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+// Runs interactive consistency, with every process broadcasting attack, and
+// returns how long it took in microseconds.
+double RunInteractive(const generals::ProcessList& processes,
+                      unsigned int faulty) {
+  auto resolved = udp::ResolveAll(processes);
+  auto network = std::make_shared<inproc::Network>(resolved);
+  std::vector<std::unique_ptr<generals::General>> generals;
+  for (unsigned int pid = 0; pid < processes.size(); ++pid) {
+    auto server = std::make_shared<inproc::Server>(
+        network, resolved[pid], generals::SeqOfAck, generals::kRoundTimeout);
+    generals.push_back(std::make_unique<generals::Participant>(
+        processes, pid, server, faulty, msg::Order::ATTACK,
+        generals::MaliciousBehavior::NONE));
+  }
+
+  std::vector<std::vector<msg::Orders>> decisions(processes.size());
+  threadutil::ThreadGroup threads;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t pid = 0; pid < processes.size(); ++pid) {
+    threads.AddThread([&, pid] {
+      decisions[pid] = generals[pid]->DecideInstances(processes.size(), 1);
+    });
+  }
+  threads.JoinAll();
+  auto end = std::chrono::steady_clock::now();
+
+  for (auto const& vector : decisions) {
+    for (auto const& decision : vector) {
+      if (decision.At(0) != msg::Order::ATTACK) {
+        throw std::logic_error("generals did not agree on the vector");
+      }
+    }
+  }
+  return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+// Runs agreements one after another on a cluster of Daemons, each commanded
+// by the next process, and returns their sorted latencies in microseconds.
+std::vector<double> RunDaemons(const generals::ProcessList& processes, unsigned int faulty,
+                  unsigned int instances) {
+  auto resolved = udp::ResolveAll(processes);
+  auto network = std::make_shared<inproc::Network>(resolved);
+  std::mutex mu;
+  std::condition_variable cv;
+  std::vector<unsigned int> decided(instances, 0);
+  std::vector<std::unique_ptr<generals::Daemon>> daemons;
+  for (unsigned int pid = 0; pid < processes.size(); ++pid) {
+    auto server = std::make_shared<inproc::Server>(
+        network, resolved[pid], generals::SeqOfAck, generals::kRoundTimeout);
+    daemons.push_back(std::make_unique<generals::Daemon>(
+        processes, pid, server, faulty, generals::MaliciousBehavior::NONE));
+    daemons.back()->SetOnDecision(
+        [&](unsigned int instance, const msg::Orders& decision) {
+          if (decision.At(0) != msg::Order::ATTACK) {
+            throw std::logic_error("generals did not agree on the order");
+          }
+          std::lock_guard<std::mutex> lock(mu);
+          if (++decided[instance] == processes.size()) cv.notify_all();
+        });
+  }
+  threadutil::ThreadGroup threads;
+  for (auto& daemon : daemons) {
+    threads.AddThread([&daemon] { daemon->Run(); });
+  }
+
+  std::vector<double> durations;
+  for (unsigned int i = 0; i < instances; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    daemons[i % daemons.size()]->Propose(i, msg::Order::ATTACK);
+    std::unique_lock<std::mutex> lock(mu);
+    cv.wait(lock, [&] { return decided[i] == processes.size(); });
+    durations.push_back(std::chrono::duration<double, std::micro>(
+                            std::chrono::steady_clock::now() - start)
+                            .count());
+  }
+
+  for (auto& daemon : daemons) daemon->Stop();
+  threads.JoinAll();
+  std::sort(durations.begin(), durations.end());
+  return durations;
+}
+
+int main(int argc, const char** argv) {
+  unsigned int process_num = kDefaultProcesses;
+  unsigned int faulty = kDefaultFaulty;
+  unsigned int runs = kDefaultRuns;
+  if (argc > 1) process_num = std::stoi(argv[1]);
+  if (argc > 2) faulty = std::stoi(argv[2]);
+  if (argc > 3) runs = std::stoi(argv[3]);
+
+  generals::ProcessList processes;
+  for (unsigned int i = 0; i < process_num; ++i) {
+    processes.emplace_back("localhost", kBasePort + i);
+  }
+
+  std::vector<double> durations;
+  for (unsigned int r = 0; r < runs; ++r) {
+    durations.push_back(RunCluster(processes, faulty));
+  }
+  std::sort(durations.begin(), durations.end());
+
+  double sum = 0;
+  for (auto d : durations) sum += d;
+  std::cout << "{\"bench\": \"inproc/agreement\", \"processes\": "
+            << process_num << ", \"faulty\": " << faulty
+            << ", \"runs\": " << runs << ", \"mean_us\": " << sum / runs
+            << ", \"p50_us\": " << durations[runs / 2]
+            << ", \"max_us\": " << durations.back() << "}" << std::endl;
+
+  for (auto in_flight : kInFlight) {
+    double us = RunCluster(processes, faulty, kThroughputInstances, in_flight);
+    std::cout << "{\"bench\": \"inproc/instances\", \"processes\": "
+              << process_num << ", \"faulty\": " << faulty
+              << ", \"instances\": " << kThroughputInstances
+              << ", \"in_flight\": " << in_flight
+              << ", \"decisions_per_sec\": " << kThroughputInstances * 1e6 / us
+              << "}" << std::endl;
+  }
+
+  double sequential_us = 0;
+  for (unsigned int pid = 0; pid < process_num; ++pid) {
+    sequential_us += RunCluster(processes, faulty);
+  }
+  double interactive_us = RunInteractive(processes, faulty);
+  std::cout << "{\"bench\": \"inproc/interactive\", \"processes\": "
+            << process_num << ", \"faulty\": " << faulty
+            << ", \"interactive_us\": " << interactive_us
+            << ", \"sequential_us\": " << sequential_us << "}" << std::endl;
+
+  auto daemon_durations = RunDaemons(processes, faulty, kDaemonInstances);
+  double daemon_sum = 0;
+  for (auto d : daemon_durations) daemon_sum += d;
+  std::cout << "{\"bench\": \"inproc/daemon\", \"processes\": "
+            << process_num << ", \"faulty\": " << faulty
+            << ", \"instances\": " << kDaemonInstances
+            << ", \"mean_us\": " << daemon_sum / kDaemonInstances
+            << ", \"p50_us\": " << daemon_durations[kDaemonInstances / 2]
+            << ", \"max_us\": " << daemon_durations.back() << "}"
+            << std::endl;
+
+  double late_us = RunLateLieutenant(processes, faulty);
+  std::cout << "{\"bench\": \"inproc/late_lieutenant\", \"processes\": "
+            << process_num << ", \"faulty\": " << faulty
+            << ", \"catch_up_us\": " << late_us << "}" << std::endl;
+  return 0;
+}
@@ -0,0 +1,268 @@
+// Microbenchmarks of the protocol's hot paths: message encoding and decoding,
+// validation, round bookkeeping, receiving a message, the fanout of a new
+// round, and MessagesForRound. Every benchmark runs on the messages of the
+// last round, which has the longest paths and the most messages. Decoding is
+// also timed for batches of orders, to show the cost per slot. Path insertion
+// is timed for both the generic and the specialized PathSet, which the
+// default shapes always have. The other benchmarks use the PathSet of the
+// build, so build with and without FIXED_SHAPES to compare them.
+//
+// Usage: protocol_bench [n:f ...]
+//
+// Cluster shapes default to 4:1 7:2 10:3. Results are printed as one JSON line
+// per benchmark and shape.
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "general.h"
+#include "lieutenant_machine.h"
+#include "path_set.h"
+
+const char* kDefaultShapes[] = {"4:1", "7:2", "10:3"};
+
+// The batch sizes that decoding is timed for.
+const size_t kBatchSlots[] = {64, 1024};
+
+// Appends every valid round message for the Lieutenant self to msgs: paths
+// starting at the commander, followed by distinct relays that are neither the
+// commander nor self.
+void AppendPaths(size_t process_num, unsigned int self, unsigned int round,
+                 std::vector<unsigned int>* ids,
+                 std::vector<msg::Message>* msgs) {
+  if (ids->size() == round + 1) {
+    msgs->push_back(msg::Message{round, msg::Order::ATTACK, *ids});
+    return;
+  }
+  for (unsigned int pid = 1; pid < process_num; ++pid) {
+    bool used = pid == self;
+    for (auto const& id : *ids) used = used || id == pid;
+    if (used) continue;
+    ids->push_back(pid);
+    AppendPaths(process_num, self, round, ids, msgs);
+    ids->pop_back();
+  }
+}
+
+// Returns every valid message that the Lieutenant self can receive in the
+// round.
+std::vector<msg::Message> RoundMessages(size_t process_num, unsigned int self,
+                                        unsigned int round) {
+  std::vector<msg::Message> msgs;
+  std::vector<unsigned int> ids{0};
+  AppendPaths(process_num, self, round, &ids, &msgs);
+  return msgs;
+}
+
+// Creates the specialized PathSet for the default shapes, or null for the
+// others.
+std::unique_ptr<generals::PathSet> MakeFixedPathSet(size_t process_num,
+                                                    unsigned int faulty,
+                                                    unsigned int self) {
+  if (process_num == 4 && faulty == 1) {
+    return std::make_unique<generals::FixedPathSet<4, 1>>(self);
+  }
+  if (process_num == 7 && faulty == 2) {
+    return std::make_unique<generals::FixedPathSet<7, 2>>(self);
+  }
+  if (process_num == 10 && faulty == 3) {
+    return std::make_unique<generals::FixedPathSet<10, 3>>(self);
+  }
+  return nullptr;
+}
+
+// Creates a Lieutenant state machine that has received every message of the
+// rounds before round, and the first count messages of round.
+std::unique_ptr<generals::LieutenantMachine> MachineInRound(
+    size_t process_num, unsigned int faulty, unsigned int self,
+    unsigned int round, size_t count) {
+  auto machine = std::make_unique<generals::LieutenantMachine>(
+      process_num, self, faulty, generals::kRoundTimeout);
+  const auto now = std::chrono::steady_clock::now();
+  for (unsigned int r = 0; r <= round; ++r) {
+    auto msgs = RoundMessages(process_num, self, r);
+    if (r == round) msgs.resize(std::min(count, msgs.size()));
+    for (auto const& msg : msgs) {
+      machine->Receive(msg.ids.back(), msg, now);
+    }
+  }
+  if (machine->Round() != round) {
+    throw std::logic_error("lieutenant did not reach the requested round");
+  }
+  return machine;
+}
+
+void BenchShape(size_t process_num, unsigned int faulty) {
+  const unsigned int self = process_num - 1;
+  const unsigned int round = faulty + 1;
+  const auto msgs = RoundMessages(process_num, self, round);
+  const bench::Params params = {
+      {"processes", process_num}, {"faulty", faulty}, {"round", round}};
+  if (msgs.empty()) {
+    return;
+  }
+
+  bench::Run("encode", params, [&](bench::State& state) {
+    char buf[BUFSIZE];
+    for (size_t i = 0; i < state.iterations(); ++i) {
+      generals::EncodeMessage(msgs[i % msgs.size()], i, buf);
+      bench::DoNotOptimize(buf);
+    }
+  });
+
+  std::vector<std::vector<char>> encoded;
+  for (auto const& msg : msgs) {
+    std::vector<char> buf(generals::EncodedSize(msg));
+    generals::EncodeMessage(msg, 0, buf.data());
+    encoded.push_back(buf);
+  }
+  bench::Run("decode", params, [&](bench::State& state) {
+    for (size_t i = 0; i < state.iterations(); ++i) {
+      auto& buf = encoded[i % encoded.size()];
+      auto msg = generals::ByzantineMsgFromBuf(buf.data(), buf.size());
+      bench::DoNotOptimize(msg);
+    }
+  });
+
+  for (size_t slots : kBatchSlots) {
+    msg::Message batch = msgs.front();
+    batch.orders = msg::Orders(slots, msg::Order::ATTACK);
+    std::vector<char> buf(generals::EncodedSize(batch));
+    generals::EncodeMessage(batch, 0, buf.data());
+    bench::Params batch_params = params;
+    batch_params.push_back({"slots", slots});
+    bench::Run("decode_batch", batch_params, [&](bench::State& state) {
+      for (size_t i = 0; i < state.iterations(); ++i) {
+        auto msg = generals::ByzantineMsgFromBuf(buf.data(), buf.size());
+        bench::DoNotOptimize(msg);
+      }
+    });
+  }
+
+  auto machine = MachineInRound(process_num, faulty, self, round, 0);
+  bench::Run("valid_message", params, [&](bench::State& state) {
+    for (size_t i = 0; i < state.iterations(); ++i) {
+      auto const& msg = msgs[i % msgs.size()];
+      bool valid = machine->ValidMessage(msg, msg.ids.back());
+      bench::DoNotOptimize(valid);
+    }
+  });
+
+  // Checks and inserts every message of the round, then starts over with an
+  // empty container outside of the timing.
+  std::unique_ptr<generals::PathSet> path_sets[] = {
+      std::make_unique<generals::DynamicPathSet>(process_num, self),
+      MakeFixedPathSet(process_num, faulty, self)};
+  for (size_t fixed = 0; fixed < 2; ++fixed) {
+    auto const& paths = path_sets[fixed];
+    if (!paths) continue;
+    bench::Params path_params = params;
+    path_params.push_back({"fixed", fixed});
+    paths->Reset(round);
+    bench::Run("path_insert", path_params, [&](bench::State& state) {
+      for (size_t i = 0; i < state.iterations(); ++i) {
+        if (i % msgs.size() == 0 && i > 0) {
+          state.PauseTiming();
+          paths->Reset(round);
+          state.ResumeTiming();
+        }
+        auto const& ids = msgs[i % msgs.size()].ids;
+        bool inserted = paths->ValidPath(ids) && paths->Insert(ids);
+        bench::DoNotOptimize(inserted);
+      }
+    });
+  }
+
+  std::vector<msg::Message> msgs_this_round;
+  bench::Run("msgs_insert", params, [&](bench::State& state) {
+    for (size_t i = 0; i < state.iterations(); ++i) {
+      if (i % msgs.size() == 0 && i > 0) {
+        state.PauseTiming();
+        msgs_this_round.clear();
+        state.ResumeTiming();
+      }
+      msgs_this_round.push_back(msgs[i % msgs.size()]);
+      bench::DoNotOptimize(msgs_this_round);
+    }
+  });
+
+  // Receives every message of the round but the last, which would end it,
+  // then starts over with a new machine outside of the timing.
+  const size_t receivable = msgs.size() - 1;
+  if (receivable > 0) {
+    auto receiver = MachineInRound(process_num, faulty, self, round, 0);
+    const auto now = std::chrono::steady_clock::now();
+    bench::Run("receive", params, [&](bench::State& state) {
+      for (size_t i = 0; i < state.iterations(); ++i) {
+        if (i % receivable == 0 && i > 0) {
+          state.PauseTiming();
+          receiver = MachineInRound(process_num, faulty, self, round, 0);
+          state.ResumeTiming();
+        }
+        auto const& msg = msgs[i % receivable];
+        auto reaction = receiver->Receive(msg.ids.back(), msg, now);
+        bench::DoNotOptimize(reaction);
+      }
+    });
+  }
+
+  // Times the last message of the previous round, which completes it and
+  // builds the fanout of the last round.
+  const auto prev_msgs = RoundMessages(process_num, self, round - 1);
+  const auto& last = prev_msgs.back();
+  bench::Run("fanout", params, [&](bench::State& state) {
+    for (size_t i = 0; i < state.iterations(); ++i) {
+      state.PauseTiming();
+      auto m = MachineInRound(process_num, faulty, self, round - 1,
+                              prev_msgs.size() - 1);
+      const auto now = std::chrono::steady_clock::now();
+      state.ResumeTiming();
+      auto reaction = m->Receive(last.ids.back(), last, now);
+      bench::DoNotOptimize(reaction);
+      state.PauseTiming();
+      m.reset();
+      state.ResumeTiming();
+    }
+  });
+
+  bench::Run("messages_for_round", params, [&](bench::State& state) {
+    size_t n = process_num;
+    unsigned int r = round;
+    for (size_t i = 0; i < state.iterations(); ++i) {
+      bench::DoNotOptimize(n);
+      bench::DoNotOptimize(r);
+      size_t count = generals::MessagesForRound(n, r);
+      bench::DoNotOptimize(count);
+    }
+  });
+}
+
+int main(int argc, const char** argv) {
+  std::vector<std::string> shapes(argv + 1, argv + argc);
+  if (shapes.empty()) {
+    shapes.assign(std::begin(kDefaultShapes), std::end(kDefaultShapes));
+  }
+
+  for (auto const& shape : shapes) {
+    auto sep = shape.find(':');
+    if (sep == std::string::npos) {
+      std::cerr << "cluster shapes must be given as n:f" << std::endl;
+      return 1;
+    }
+    size_t process_num = std::stoul(shape.substr(0, sep));
+    unsigned int faulty = std::stoul(shape.substr(sep + 1));
+    if (process_num < faulty + 2) {
+      std::cerr << "the total number of processes must be no less than "
+                   "(faulty + 2)"
+                << std::endl;
+      return 1;
+    }
+    BenchShape(process_num, faulty);
+  }
+  return 0;
+}
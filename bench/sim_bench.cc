@@ -0,0 +1,45 @@
+// Measures how many agreements per second the discrete-event simulator runs,
+// and the virtual agreement latency it reports, for a few f=3 clusters.
+//
+// Usage: sim_bench [runs]
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "sim.h"
+
+const unsigned int kDefaultRuns = 1000;
+const uint64_t kSeed = 1;
+
+// Simulates runs agreements and prints the summary as a JSON line.
+void Bench(size_t process_num, unsigned int faulty, double loss, size_t runs) {
+  sim::Config config;
+  config.process_num = process_num;
+  config.faulty = faulty;
+  config.order = msg::Order::ATTACK;
+  config.network.latency = std::chrono::microseconds{100};
+  config.network.jitter = std::chrono::microseconds{50};
+  config.network.loss = loss;
+
+  auto s = sim::SimulateMany(config, kSeed, runs);
+  std::cout << "{\"bench\": \"sim/agreement\", \"processes\": " << process_num
+            << ", \"faulty\": " << faulty << ", \"loss\": " << loss
+            << ", \"runs\": " << s.runs << ", \"agreed\": " << s.agreements
+            << ", \"per_sec\": " << s.runs / s.wall_secs
+            << ", \"p50_virtual_us\": " << s.p50.count()
+            << ", \"p99_virtual_us\": " << s.p99.count()
+            << ", \"datagrams\": " << s.mean_messages + s.mean_acks << "}"
+            << std::endl;
+}
+
+int main(int argc, const char** argv) {
+  size_t runs = kDefaultRuns;
+  if (argc > 1) runs = std::stoul(argv[1]);
+
+  Bench(5, 3, 0, runs);
+  Bench(5, 3, 0.01, runs);
+  Bench(7, 3, 0, runs / 10);
+  Bench(7, 3, 0.01, runs / 10);
+  return 0;
+}
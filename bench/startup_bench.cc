@@ -0,0 +1,59 @@
+// Measures the startup cost of a General: resolving every process in the
+// hostfile and creating its UDP clients.
+//
+// Usage: startup_bench [processes] [hostname...]
+//
+// Process entries are spread round-robin across the provided hostnames (by
+// default the current hostname and localhost), each with a unique port. The
+// first run is measured with a cold resolver cache, later runs with a warm one.
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "general.h"
+#include "net.h"
+#include "udp_conn.h"
+
+const unsigned int kDefaultProcesses = 64;
+const unsigned int kWarmIterations = 20;
+const unsigned short kBasePort = 40000;
+
+// Returns the duration of one call to ClientsForProcessList in microseconds.
+double TimeClientsForProcessList(const generals::ProcessList& processes,
+                                 std::shared_ptr<transport::Server> server) {
+  auto start = std::chrono::steady_clock::now();
+  auto clients = generals::ClientsForProcessList(processes, server);
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+int main(int argc, const char** argv) {
+  unsigned int process_num = kDefaultProcesses;
+  if (argc > 1) process_num = std::stoi(argv[1]);
+  std::vector<std::string> hosts;
+  for (int i = 2; i < argc; ++i) hosts.push_back(argv[i]);
+  if (hosts.empty()) hosts = {net::GetHostname(), "localhost"};
+
+  generals::ProcessList processes;
+  for (unsigned int i = 0; i < process_num; ++i) {
+    processes.emplace_back(hosts[i % hosts.size()], kBasePort + i);
+  }
+
+  // Bind to an ephemeral port. The server is never used to send.
+  auto server = std::make_shared<udp::Server>(0, generals::SeqOfAck);
+
+  double cold_us = TimeClientsForProcessList(processes, server);
+  double warm_us = 0;
+  for (unsigned int i = 0; i < kWarmIterations; ++i) {
+    warm_us += TimeClientsForProcessList(processes, server);
+  }
+  warm_us /= kWarmIterations;
+
+  std::cout << "{\"bench\": \"startup/clients_for_process_list\", "
+            << "\"processes\": " << process_num
+            << ", \"hosts\": " << hosts.size() << ", \"cold_us\": " << cold_us
+            << ", \"warm_us\": " << warm_us << "}" << std::endl;
+  return 0;
+}
@@ -0,0 +1,227 @@
+#include "byzantine.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+namespace byzantine {
+
+namespace {
+
+// Checks the fields of the config that every General depends on, throwing an
+// exception if any is invalid.
+void Validate(const Config& config) {
+  const size_t process_num = config.processes.size();
+  if (config.id >= process_num) {
+    throw std::invalid_argument("id does not reference a process");
+  }
+  if (config.faulty + 2 > process_num) {
+    throw std::invalid_argument(
+        "the total number of processes must be no less than (faulty + 2)");
+  }
+  if (!config.interactive && config.commander >= process_num) {
+    throw std::invalid_argument("commander does not reference a process");
+  }
+}
+
+// Returns the process list in the order the Generals of the config expect it,
+// with the commander first, along with the position of this process in it.
+std::pair<generals::ProcessList, unsigned int> Arrange(const Config& config) {
+  Validate(config);
+  if (config.interactive) {
+    return {config.processes, config.id};
+  }
+  generals::ProcessList processes = config.processes;
+  std::iter_swap(processes.begin(), processes.begin() + config.commander);
+  unsigned int id = config.id;
+  if (id == config.commander) {
+    id = 0;
+  } else if (id == 0) {
+    id = config.commander;
+  }
+  return {processes, id};
+}
+
+}  // namespace
+
+std::shared_ptr<transport::Server> NewServer(const Config& config) {
+  auto arranged = Arrange(config);
+  return generals::ServerForProcess(config.transport, arranged.first,
+                                    arranged.second);
+}
+
+std::shared_ptr<generals::General> NewGeneral(
+    const Config& config, std::shared_ptr<transport::Server> server) {
+  auto arranged = Arrange(config);
+  auto const& processes = arranged.first;
+  const unsigned int id = arranged.second;
+  if (config.interactive) {
+    return std::make_shared<generals::Participant>(
+        processes, id, server, config.faulty, config.order, config.behavior);
+  }
+  const bool is_commander = id == 0;
+  if (is_commander && config.decides_value) {
+    return std::make_shared<generals::Commander>(
+        processes, server, config.faulty, config.value, config.behavior);
+  }
+  if (config.decides_value) {
+    return std::make_shared<generals::Lieutenant>(
+        processes, id, server, config.faulty, config.behavior,
+        msg::kValueSlots);
+  }
+  if (is_commander) {
+    return std::make_shared<generals::Commander>(
+        processes, server, config.faulty, config.order, config.behavior,
+        config.batch);
+  }
+  return std::make_shared<generals::Lieutenant>(
+      processes, id, server, config.faulty, config.behavior, config.batch);
+}
+
+std::future<std::vector<msg::Orders>> DecideAsync(
+    std::shared_ptr<generals::General> general, unsigned int instances,
+    unsigned int in_flight) {
+  auto promise = std::make_shared<std::promise<std::vector<msg::Orders>>>();
+  auto future = promise->get_future();
+  DecideAsync(general, instances, in_flight,
+              [promise](std::vector<msg::Orders> decisions,
+                        std::exception_ptr err) {
+                if (err) {
+                  promise->set_exception(err);
+                } else {
+                  promise->set_value(std::move(decisions));
+                }
+              });
+  return future;
+}
+
+void DecideAsync(std::shared_ptr<generals::General> general,
+                 unsigned int instances, unsigned int in_flight,
+                 OnDecided done) {
+  // The thread holds the General, so it outlives the caller's reference, but
+  // lets go of it before handing back the decisions. The caller may then
+  // return and destroy the General, and its server with it, while the
+  // detached thread is still finishing.
+  std::thread([general, instances, in_flight, done]() mutable {
+    std::vector<msg::Orders> decisions;
+    std::exception_ptr err;
+    try {
+      decisions = general->DecideInstances(instances, in_flight);
+    } catch (...) {
+      err = std::current_exception();
+    }
+    general.reset();
+    done(std::move(decisions), err);
+  }).detach();
+}
+
+std::future<std::experimental::optional<std::string>> DecideValueAsync(
+    std::shared_ptr<generals::General> general) {
+  auto promise = std::make_shared<
+      std::promise<std::experimental::optional<std::string>>>();
+  auto future = promise->get_future();
+  // Lets go of the General before fulfilling the promise, like DecideAsync.
+  std::thread([general, promise]() mutable {
+    std::experimental::optional<std::string> value;
+    std::exception_ptr err;
+    try {
+      value = general->DecideValue();
+    } catch (...) {
+      err = std::current_exception();
+    }
+    general.reset();
+    if (err) {
+      promise->set_exception(err);
+    } else {
+      promise->set_value(std::move(value));
+    }
+  }).detach();
+  return future;
+}
+
+Node::Node(const Config& config, std::shared_ptr<transport::Server> server)
+    : daemon_((Validate(config),
+               std::make_unique<generals::Daemon>(
+                   config.processes, config.id, server, config.faulty,
+                   config.behavior))),
+      next_subscription_(0) {
+  daemon_->SetOnDecision(
+      [this](unsigned int instance, const msg::Orders& decision) {
+        Decided(instance, decision.At(0));
+      });
+  runner_ = std::thread([this] { daemon_->Run(); });
+}
+
+Node::~Node() {
+  Stop();
+  Wait();
+}
+
+std::future<msg::Order> Node::Propose(unsigned int instance,
+                                      msg::Order order) {
+  std::promise<msg::Order> promise;
+  if (daemon_->Propose(instance, order)) {
+    promise.set_value(order);
+  } else {
+    promise.set_exception(std::make_exception_ptr(std::invalid_argument(
+        "instance " + std::to_string(instance) +
+        " has already been decided")));
+  }
+  return promise.get_future();
+}
+
+std::future<msg::Order> Node::Decision(unsigned int instance) {
+  // The Daemon records a decision before reporting it, so checking for it
+  // with the lock held cannot miss one.
+  std::lock_guard<std::mutex> lock(mu_);
+  std::promise<msg::Order> promise;
+  auto future = promise.get_future();
+  if (auto decision = daemon_->DecisionOf(instance)) {
+    promise.set_value(*decision);
+  } else {
+    waiters_[instance].push_back(std::move(promise));
+  }
+  return future;
+}
+
+std::experimental::optional<msg::Order> Node::DecisionOf(
+    unsigned int instance) const {
+  return daemon_->DecisionOf(instance);
+}
+
+Node::Subscription Node::Subscribe(OnDecision on_decision) {
+  std::lock_guard<std::mutex> lock(subscribers_mu_);
+  const Subscription subscription = next_subscription_++;
+  subscribers_.emplace(subscription, std::move(on_decision));
+  return subscription;
+}
+
+void Node::Unsubscribe(Subscription subscription) {
+  std::lock_guard<std::mutex> lock(subscribers_mu_);
+  subscribers_.erase(subscription);
+}
+
+void Node::Stop() { daemon_->Stop(); }
+
+void Node::Wait() {
+  if (runner_.joinable()) runner_.join();
+}
+
+void Node::Decided(unsigned int instance, msg::Order order) {
+  std::vector<std::promise<msg::Order>> waiters;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = waiters_.find(instance);
+    if (it != waiters_.end()) {
+      waiters = std::move(it->second);
+      waiters_.erase(it);
+    }
+  }
+  for (auto& waiter : waiters) waiter.set_value(order);
+  std::lock_guard<std::mutex> lock(subscribers_mu_);
+  for (auto const& subscriber : subscribers_) {
+    subscriber.second(instance, order);
+  }
+}
+
+}  // namespace byzantine
@@ -0,0 +1,161 @@
+#ifndef BYZANTINE_H_
+#define BYZANTINE_H_
+
+#include <condition_variable>
+#include <exception>
+#include <experimental/optional>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "general.h"
+#include "message.h"
+#include "transport.h"
+
+// The embeddable API of libbyzantine, through which a service runs agreement
+// in its own process instead of launching bin/general. A General is built
+// from a Config and decided on a thread of its own, with the decisions handed
+// back through a future or a completion callback, so no caller thread blocks
+// in Decide. A Node keeps a Daemon running to decide instances on demand.
+//
+//   byzantine::Config config;
+//   config.processes = {{"host0", 5000}, {"host1", 5000}, ...};
+//   config.id = 1;
+//   config.faulty = 1;
+//   auto general = byzantine::NewGeneral(config, byzantine::NewServer(config));
+//   auto decisions = byzantine::DecideAsync(general);
+//   ...
+//   msg::Order order = decisions.get().front().At(0);
+//
+// bin/general is a client of the same API.
+namespace byzantine {
+
+// Describes the General of one process.
+struct Config {
+  // Every process in the cluster, in the same order at every process.
+  generals::ProcessList processes;
+  // The position of this process in processes.
+  unsigned int id = 0;
+  // The number of faulty processes tolerated.
+  unsigned int faulty = 0;
+  // The position of the commander in processes. The process at it proposes.
+  unsigned int commander = 0;
+  // Runs interactive consistency instead, where every process proposes (see
+  // generals::Participant). commander is ignored.
+  bool interactive = false;
+  // The order proposed by the commander, or by every process if interactive.
+  msg::Order order = msg::Order::NO_ORDER;
+  // Decides a value instead of orders. The commander proposes value.
+  bool decides_value = false;
+  std::string value;
+  // The number of orders each instance decides at once.
+  size_t batch = 1;
+  generals::Transport transport = generals::Transport::UDP;
+  generals::MaliciousBehavior behavior = generals::MaliciousBehavior::NONE;
+};
+
+// Called with the decisions of a General, or with the exception it failed
+// with.
+typedef std::function<void(std::vector<msg::Orders>, std::exception_ptr)>
+    OnDecided;
+
+// Creates the server through which the process described by the config sends
+// and receives. Throws an exception if the config is invalid.
+std::shared_ptr<transport::Server> NewServer(const Config& config);
+
+// Creates the General described by the config, communicating through the
+// server, which may be any transport::Server, like a replay::Server. Throws an
+// exception if the config is invalid.
+std::shared_ptr<generals::General> NewGeneral(
+    const Config& config, std::shared_ptr<transport::Server> server);
+
+// Runs the General's instances (see generals::General::DecideInstances) on a
+// new thread, and returns a future of their decisions. An interactive
+// General must be given one instance per process.
+std::future<std::vector<msg::Orders>> DecideAsync(
+    std::shared_ptr<generals::General> general, unsigned int instances = 1,
+    unsigned int in_flight = 1);
+// Like DecideAsync, but calls done on the deciding thread instead.
+void DecideAsync(std::shared_ptr<generals::General> general,
+                 unsigned int instances, unsigned int in_flight,
+                 OnDecided done);
+
+// Runs the General's agreement on a value (see
+// generals::General::DecideValue) on a new thread, and returns a future of the
+// payload decided on.
+std::future<std::experimental::optional<std::string>> DecideValueAsync(
+    std::shared_ptr<generals::General> general);
+
+// A process that decides instances on demand for as long as it lives, with
+// its server, clients and threads kept warm. Runs a generals::Daemon on a
+// thread of its own. Any Node may command any instance, so the commander,
+// order and interactive fields of the Config are ignored.
+class Node {
+ public:
+  // Called with the id and decided order of every instance.
+  typedef std::function<void(unsigned int, msg::Order)> OnDecision;
+  // Identifies a function added by Subscribe.
+  typedef unsigned int Subscription;
+
+  Node(const Config& config, std::shared_ptr<transport::Server> server);
+  // Stops the Node and waits for it.
+  ~Node();
+
+  // Proposes the order in the instance as its commander. A commander decides
+  // its own order at once, so the future is ready when returned. It holds an
+  // std::invalid_argument if the instance has already been decided. Instance
+  // ids must be unique across the cluster, which is up to the callers.
+  std::future<msg::Order> Propose(unsigned int instance, msg::Order order);
+
+  // Returns a future of the decision of the instance, commanded by any Node.
+  // Futures of instances that never decide are never ready.
+  std::future<msg::Order> Decision(unsigned int instance);
+
+  // Returns the decision of the instance, if it has been made and is still
+  // remembered.
+  std::experimental::optional<msg::Order> DecisionOf(
+      unsigned int instance) const;
+
+  // Adds a function called with every decision from now on, on the thread
+  // that made it, and returns a handle to remove it with. Functions are called
+  // one decision at a time.
+  Subscription Subscribe(OnDecision on_decision);
+  // Removes the function, waiting for any call of it in progress, so that it
+  // is never called once this returns. Must not be called from a subscribed
+  // function.
+  void Unsubscribe(Subscription subscription);
+
+  // Makes the Node stop deciding. Thread-safe.
+  void Stop();
+  // Blocks until the Node has stopped, after Stop is called from elsewhere.
+  void Wait();
+
+  // Prints a table of the quality of the link to every other process.
+  inline void PrintLinks(std::ostream& o) const { daemon_->PrintLinks(o); }
+
+ private:
+  const std::unique_ptr<generals::Daemon> daemon_;
+  std::thread runner_;
+
+  mutable std::mutex mu_;
+  // The futures waiting on the decision of each instance.
+  std::map<unsigned int, std::vector<std::promise<msg::Order>>> waiters_;
+  // Guards the subscribers, and is held while they are called so that
+  // Unsubscribe can wait for a call in progress.
+  std::mutex subscribers_mu_;
+  std::map<Subscription, OnDecision> subscribers_;
+  Subscription next_subscription_;
+
+  // Hands a decision of the Daemon to its waiters and subscribers.
+  void Decided(unsigned int instance, msg::Order order);
+};
+
+}  // namespace byzantine
+
+#endif
@@ -0,0 +1,161 @@
+#include "capacity.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+#include "general.h"
+#include "message.h"
+#include "path_set.h"
+#include "udp_conn.h"
+
+namespace generals {
+
+namespace {
+
+// Multiplies two counts, saturating at kMessageCountOverflow.
+size_t SatMul(size_t a, size_t b) {
+  if (a == kMessageCountOverflow || b == kMessageCountOverflow) {
+    return a == 0 || b == 0 ? 0 : kMessageCountOverflow;
+  }
+  size_t res;
+  if (__builtin_mul_overflow(a, b, &res)) return kMessageCountOverflow;
+  return res;
+}
+
+// Adds two counts, saturating at kMessageCountOverflow.
+size_t SatAdd(size_t a, size_t b) {
+  size_t res;
+  if (__builtin_add_overflow(a, b, &res)) return kMessageCountOverflow;
+  return res;
+}
+
+// Streams a count, or "overflow" if it saturated.
+std::string CountString(size_t n) {
+  if (n == kMessageCountOverflow) return "overflow";
+  return std::to_string(n);
+}
+
+}  // namespace
+
+CapacityPlan PlanCapacity(size_t process_num, unsigned int faulty,
+                          double link_rate_mbps) {
+  if (link_rate_mbps <= 0) {
+    throw std::invalid_argument("link rate must be positive");
+  }
+
+  CapacityPlan plan = {};
+  plan.process_num = process_num;
+  plan.faulty = faulty;
+  plan.link_rate_mbps = link_rate_mbps;
+  plan.feasible = true;
+
+  if (process_num < (size_t)faulty + 2) {
+    plan.feasible = false;
+    plan.reason =
+        "the total number of processes must be no less than (faulty + 2)";
+    return plan;
+  }
+
+  const size_t ack_bytes = sizeof(msg::Ack) + kDatagramOverhead;
+  const double link_bytes_per_sec = link_rate_mbps * 1e6 / 8;
+  for (unsigned int r = 0; r <= faulty + 1; ++r) {
+    RoundLoad load = {};
+    load.round = r;
+    load.msgs_received = MessagesForRound(process_num, r);
+    load.msgs_sent = r == 0 ? 0 : SatMul(MessagesForRound(process_num, r - 1),
+                                         process_num - 1 - r);
+
+    const size_t payload = sizeof(msg::ByzantineMessage) +
+                           sizeof(uint32_t) * (r + 1) +
+                           2 * sizeof(uint32_t) * msg::OrderWords(1);
+    load.msg_bytes = payload + kDatagramOverhead;
+    load.bytes_in = SatAdd(SatMul(load.msgs_received, load.msg_bytes),
+                           SatMul(load.msgs_sent, ack_bytes));
+    load.bytes_out = SatAdd(SatMul(load.msgs_sent, load.msg_bytes),
+                            SatMul(load.msgs_received, ack_bytes));
+    load.msgs_memory =
+        SatMul(load.msgs_received,
+               sizeof(msg::Message) + sizeof(unsigned int) * (r + 1));
+    load.min_round_secs =
+        std::max(load.bytes_in, load.bytes_out) / link_bytes_per_sec;
+
+    // Every datagram crosses exactly one Lieutenant's inbound link.
+    plan.total_msgs =
+        SatAdd(plan.total_msgs, SatMul(process_num - 1, load.msgs_received));
+    plan.total_bytes = SatAdd(
+        plan.total_bytes,
+        SatMul(SatMul(process_num - 1, load.msgs_received),
+               load.msg_bytes + ack_bytes));
+    plan.peak_msgs_memory = std::max(plan.peak_msgs_memory, load.msgs_memory);
+
+    if (plan.feasible) {
+      const auto round_timeout_secs =
+          std::chrono::duration<double>(kRoundTimeout).count();
+      std::ostringstream reason;
+      if (load.msgs_received == kMessageCountOverflow ||
+          load.msgs_sent == kMessageCountOverflow ||
+          load.bytes_in == kMessageCountOverflow ||
+          load.bytes_out == kMessageCountOverflow) {
+        reason << "message count in round " << r << " overflows";
+      } else if (payload > BUFSIZE) {
+        reason << "messages in round " << r << " are " << payload
+               << " bytes, larger than the " << BUFSIZE
+               << " byte receive buffer";
+      } else if (load.min_round_secs > round_timeout_secs) {
+        reason << "round " << r << " needs at least " << load.min_round_secs
+               << "s on a " << link_rate_mbps << " Mbit/s link, longer than "
+               << "the " << round_timeout_secs << "s round timeout";
+      }
+      if (!reason.str().empty()) {
+        plan.feasible = false;
+        plan.reason = reason.str();
+      }
+    }
+    plan.rounds.push_back(load);
+  }
+  return plan;
+}
+
+void ValidateClusterShape(size_t process_num, unsigned int faulty,
+                          double link_rate_mbps) {
+  auto plan = PlanCapacity(process_num, faulty, link_rate_mbps);
+  if (!plan.feasible) {
+    throw std::invalid_argument("infeasible configuration: " + plan.reason);
+  }
+}
+
+std::ostream& operator<<(std::ostream& o, const CapacityPlan& p) {
+  o << "Capacity plan for n=" << p.process_num << ", f=" << p.faulty << " on "
+    << p.link_rate_mbps << " Mbit/s links\n\n";
+  o << "Per lieutenant:\n";
+  o << std::setw(6) << "round" << std::setw(14) << "msgs in"
+    << std::setw(14) << "msgs out" << std::setw(10) << "msg size"
+    << std::setw(16) << "bytes in" << std::setw(16) << "bytes out"
+    << std::setw(16) << "msgs memory" << std::setw(14) << "min time (s)"
+    << "\n";
+  for (auto const& r : p.rounds) {
+    o << std::setw(6) << r.round << std::setw(14)
+      << CountString(r.msgs_received) << std::setw(14)
+      << CountString(r.msgs_sent) << std::setw(10) << r.msg_bytes
+      << std::setw(16) << CountString(r.bytes_in) << std::setw(16)
+      << CountString(r.bytes_out) << std::setw(16)
+      << CountString(r.msgs_memory) << std::setw(14) << r.min_round_secs
+      << "\n";
+  }
+  o << "\nPer run, whole cluster:\n";
+  o << "  messages: " << CountString(p.total_msgs) << "\n";
+  o << "  bytes on the wire (with acks): " << CountString(p.total_bytes)
+    << "\n";
+  o << "  peak msgs_this_round_ memory per lieutenant: "
+    << CountString(p.peak_msgs_memory) << " bytes\n\n";
+  if (p.feasible) {
+    o << "Feasible\n";
+  } else {
+    o << "Infeasible: " << p.reason << "\n";
+  }
+  return o;
+}
+
+}  // namespace generals
@@ -0,0 +1,72 @@
+#ifndef CAPACITY_H_
+#define CAPACITY_H_
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace generals {
+
+// The link rate assumed when validating a cluster shape, in megabits per
+// second.
+const double kDefaultLinkRateMbps = 1000;
+
+// Bytes of IPv4 and UDP headers carried by every datagram on the wire.
+const size_t kDatagramOverhead = 28;
+
+// The load placed on a single Lieutenant during one round of the algorithm.
+// Counts that do not fit in a size_t are reported as kMessageCountOverflow.
+struct RoundLoad {
+  unsigned int round;
+  // Messages the Lieutenant receives (and acknowledges) during the round.
+  size_t msgs_received;
+  // Messages the Lieutenant sends (and receives acknowledgements for) during
+  // the round.
+  size_t msgs_sent;
+  // Size of a single message in this round, including datagram headers.
+  size_t msg_bytes;
+  // Bytes received and sent on the Lieutenant's link, including acks.
+  size_t bytes_in;
+  size_t bytes_out;
+  // Approximate heap usage of msgs_this_round_ once the round is complete.
+  size_t msgs_memory;
+  // The shortest time in which the round's traffic fits on the link.
+  double min_round_secs;
+};
+
+// A capacity plan for a cluster of a given shape.
+struct CapacityPlan {
+  size_t process_num;
+  unsigned int faulty;
+  double link_rate_mbps;
+  std::vector<RoundLoad> rounds;
+
+  // Traffic of the whole cluster over the whole run.
+  size_t total_msgs;
+  size_t total_bytes;
+  // Peak approximate heap usage of msgs_this_round_ over all rounds.
+  size_t peak_msgs_memory;
+
+  // Determines if the plan can run: all counts are representable, every
+  // message fits in a datagram buffer, and every round's traffic fits within
+  // the round timeout. If not, reason describes why.
+  bool feasible;
+  std::string reason;
+};
+
+// Computes the capacity plan for a cluster of process_num processes
+// tolerating faulty faults, on links of the provided rate.
+CapacityPlan PlanCapacity(size_t process_num, unsigned int faulty,
+                          double link_rate_mbps = kDefaultLinkRateMbps);
+
+// Throws an std::invalid_argument exception describing why the cluster shape
+// is infeasible, if it is.
+void ValidateClusterShape(size_t process_num, unsigned int faulty,
+                          double link_rate_mbps = kDefaultLinkRateMbps);
+
+// Allow streaming of CapacityPlan on ostreams as a human readable report.
+std::ostream& operator<<(std::ostream& o, const CapacityPlan& p);
+
+}  // namespace generals
+
+#endif
@@ -0,0 +1,227 @@
+#include "control.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include "log.h"
+#include "transport.h"
+
+namespace control {
+
+namespace {
+
+// The longest command line accepted. Longer lines close the connection.
+const size_t kMaxLineSize = 256;
+
+// Creates a Unix domain stream socket listening at the path, or throws an
+// exception on error.
+int Listen(const std::string& path) {
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    throw std::invalid_argument("control socket path is too long: " + path);
+  }
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    throw std::runtime_error("could not create control socket: " +
+                             std::string(strerror(errno)));
+  }
+  // Replace the socket of a daemon that did not shut down cleanly.
+  unlink(path.c_str());
+  if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 ||
+      listen(fd, SOMAXCONN) < 0) {
+    const std::string err = strerror(errno);
+    close(fd);
+    throw std::runtime_error("could not listen on control socket " + path +
+                             ": " + err);
+  }
+  return fd;
+}
+
+// Waits for the descriptor to become readable, waking up periodically so that
+// the caller can check if it should stop. Returns whether it is readable.
+bool WaitReadable(int fd) {
+  struct pollfd pfd = {};
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  const auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+      transport::kReceivePollInterval);
+  return poll(&pfd, 1, timeout.count()) > 0;
+}
+
+// Formats the decision of an instance as a reply line.
+std::string DecidedLine(unsigned int instance, msg::Order order) {
+  return "decided " + std::to_string(instance) + " " + msg::OrderString(order);
+}
+
+}  // namespace
+
+Server::Server(const std::string& path, byzantine::Node& node)
+    : path_(path),
+      node_(node),
+      listenfd_(Listen(path)),
+      stopped_(false),
+      next_connection_(0) {
+  subscription_ =
+      node_.Subscribe([this](unsigned int instance, msg::Order order) {
+        Publish(instance, order);
+      });
+  acceptor_ = std::thread([this] { Accept(); });
+}
+
+Server::~Server() {
+  // The Node may outlive the Server, so it must not call back into it.
+  node_.Unsubscribe(subscription_);
+  stopped_ = true;
+  acceptor_.join();
+  // No connections are added once the acceptor is done.
+  for (auto& connection : connections_) connection.second.join();
+  close(listenfd_);
+  unlink(path_.c_str());
+}
+
+void Server::Accept() {
+  while (!stopped_) {
+    Reap();
+    if (!WaitReadable(listenfd_)) {
+      continue;
+    }
+    int fd = accept(listenfd_, nullptr, nullptr);
+    if (fd < 0) {
+      continue;
+    }
+    // The connection cannot report itself closed before it is added, since
+    // that takes the lock.
+    std::lock_guard<std::mutex> lock(mu_);
+    const unsigned int id = next_connection_++;
+    connections_.emplace(id, std::thread([this, fd, id] { Serve(fd, id); }));
+  }
+}
+
+void Server::Reap() {
+  std::vector<std::thread> closed;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    for (unsigned int id : closed_) {
+      auto it = connections_.find(id);
+      closed.push_back(std::move(it->second));
+      connections_.erase(it);
+    }
+    closed_.clear();
+  }
+  // Join without the lock, which the threads may still be releasing.
+  for (auto& connection : closed) connection.join();
+}
+
+void Server::Serve(int fd, unsigned int id) {
+  std::string buffered;
+  char buf[kMaxLineSize];
+  while (!stopped_) {
+    if (!WaitReadable(fd)) {
+      continue;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0) {
+      break;
+    }
+    buffered.append(buf, n);
+
+    // Answer every complete line.
+    size_t end;
+    while ((end = buffered.find('\n')) != std::string::npos) {
+      std::string line = buffered.substr(0, end);
+      buffered.erase(0, end + 1);
+      std::string reply = Handle(line, fd);
+      std::lock_guard<std::mutex> lock(mu_);
+      WriteLine(fd, reply);
+    }
+    if (buffered.size() > kMaxLineSize) {
+      break;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mu_);
+  watchers_.erase(fd);
+  close(fd);
+  closed_.push_back(id);
+}
+
+std::string Server::Handle(const std::string& line, int fd) {
+  std::istringstream in(line);
+  std::string command;
+  in >> command;
+  if (command == "propose") {
+    unsigned int instance;
+    std::string order;
+    if (!(in >> instance >> order)) {
+      return "error usage: propose <instance> <order>";
+    }
+    msg::Order order_val;
+    try {
+      order_val = msg::StringToOrder(order);
+    } catch (const std::invalid_argument& e) {
+      return "error " + std::string(e.what());
+    }
+    try {
+      node_.Propose(instance, order_val).get();
+    } catch (const std::invalid_argument& e) {
+      return "error " + std::string(e.what());
+    }
+    return "ok";
+  }
+  if (command == "get") {
+    unsigned int instance;
+    if (!(in >> instance)) {
+      return "error usage: get <instance>";
+    }
+    auto decision = node_.DecisionOf(instance);
+    if (!decision) {
+      return "pending " + std::to_string(instance);
+    }
+    return DecidedLine(instance, *decision);
+  }
+  if (command == "watch") {
+    std::lock_guard<std::mutex> lock(mu_);
+    watchers_.insert(fd);
+    return "ok";
+  }
+  if (command == "shutdown") {
+    LOG(Info, "Shutting down on request of the control socket");
+    node_.Stop();
+    return "ok";
+  }
+  return "error unknown command \"" + command + "\"";
+}
+
+void Server::WriteLine(int fd, const std::string& line) {
+  // Clients that stop reading lose their output rather than blocking the
+  // daemon, and those that disconnect must not raise SIGPIPE.
+  const std::string out = line + "\n";
+  size_t written = 0;
+  while (written < out.size()) {
+    ssize_t n = send(fd, out.data() + written, out.size() - written,
+                     MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n <= 0) {
+      return;
+    }
+    written += n;
+  }
+}
+
+void Server::Publish(unsigned int instance, msg::Order order) {
+  const std::string line = DecidedLine(instance, order);
+  std::lock_guard<std::mutex> lock(mu_);
+  for (int fd : watchers_) {
+    WriteLine(fd, line);
+  }
+}
+
+}  // namespace control
@@ -0,0 +1,76 @@
+#ifndef CONTROL_H_
+#define CONTROL_H_
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "byzantine.h"
+#include "message.h"
+
+// The control socket of a byzantine::Node. Local clients connect to a Unix
+// domain stream socket and send commands, one per line:
+//
+//   propose <instance> <order>   propose the order as commander of the instance
+//   get <instance>               reply with the decision of the instance
+//   watch                        stream every decision made from now on
+//   shutdown                     stop the daemon
+//
+// Every command is answered with a line: "ok", "decided <instance> <order>",
+// "pending <instance>" or "error <reason>". Watching clients also receive a
+// "decided" line for each decision, in the order they are made.
+namespace control {
+
+class Server {
+ public:
+  // Listens on a socket at the provided path, replacing any stale socket
+  // there, and hands the Node's decisions to watching clients. Throws an
+  // exception if the socket cannot be created.
+  Server(const std::string& path, byzantine::Node& node);
+
+  // Stops handing decisions to clients, closes every connection and removes
+  // the socket.
+  ~Server();
+
+ private:
+  const std::string path_;
+  byzantine::Node& node_;
+  const int listenfd_;
+
+  std::atomic<bool> stopped_;
+  std::thread acceptor_;
+  // Guards the connections and serializes writes to them, so that streamed
+  // decisions never split a reply.
+  std::mutex mu_;
+  // The thread of every connection by id, the ids of those that have closed
+  // and wait to be joined, and the id of the next one.
+  std::map<unsigned int, std::thread> connections_;
+  std::vector<unsigned int> closed_;
+  unsigned int next_connection_;
+  std::set<int> watchers_;
+  // The subscription to the Node's decisions.
+  byzantine::Node::Subscription subscription_;
+
+  // Accepts connections until the Server is destroyed.
+  void Accept();
+  // Joins the threads of the connections that have closed, so that a
+  // long-running daemon does not keep one for every client it has served.
+  void Reap();
+  // Reads and answers the commands of the connection with the provided id
+  // until it closes.
+  void Serve(int fd, unsigned int id);
+  // Returns the reply to the command line received on the connection.
+  std::string Handle(const std::string& line, int fd);
+  // Writes the line to the connection. Must be called with mu_ held.
+  void WriteLine(int fd, const std::string& line);
+  // Sends the decision to every watching client.
+  void Publish(unsigned int instance, msg::Order order);
+};
+
+}  // namespace control
+
+#endif
@@ -0,0 +1,50 @@
+#include "evidence.h"
+
+#include <sstream>
+#include <string>
+
+#include "log.h"
+#include "metrics.h"
+
+namespace evidence {
+
+namespace {
+
+// Returns the counter of processes convicted of the offense.
+metrics::Counter& Convictions(Offense offense) {
+  std::ostringstream label;
+  label << offense;
+  return metrics::Default().GetCounter(
+      "byzantine_convictions_total",
+      "Processes proven faulty, by the first offense they were caught in.",
+      {{"offense", label.str()}});
+}
+
+}  // namespace
+
+std::ostream& operator<<(std::ostream& o, Offense offense) {
+  switch (offense) {
+    case Offense::NONE:
+      return o << "none";
+    case Offense::MALFORMED:
+      return o << "malformed";
+    case Offense::EQUIVOCATION:
+      return o << "equivocation";
+  }
+  return o;
+}
+
+bool Ledger::Record(unsigned int pid, Offense offense) {
+  if (offense == Offense::NONE || pid >= convicted_.size() ||
+      convicted_[pid]) {
+    return false;
+  }
+  static metrics::Counter& malformed = Convictions(Offense::MALFORMED);
+  static metrics::Counter& equivocation = Convictions(Offense::EQUIVOCATION);
+  (offense == Offense::MALFORMED ? malformed : equivocation).Add();
+  LOG(Warning, "Convicted p", pid, " of ", offense);
+  convicted_[pid] = true;
+  return true;
+}
+
+}  // namespace evidence
@@ -0,0 +1,46 @@
+#ifndef EVIDENCE_H_
+#define EVIDENCE_H_
+
+#include <cstddef>
+#include <iostream>
+#include <vector>
+
+// Records the processes caught misbehaving in ways no correct process can,
+// so that a General can stop relaying to them. Only provable offenses count:
+// a slow, silent or lagging process is never convicted, since a correct one
+// can look the same (see LieutenantMachine::Suspect instead).
+namespace evidence {
+
+// The ways a process can prove itself faulty.
+enum class Offense {
+  NONE,
+  // Sent a message that no correct process would, like one with a path it is
+  // not the last relay of, or one that runs through its recipient.
+  MALFORMED,
+  // Signed two different orders or values as the commander of an instance.
+  EQUIVOCATION,
+};
+
+std::ostream& operator<<(std::ostream& o, Offense offense);
+
+// The convictions of a General, indexed by process id. Not thread-safe.
+class Ledger {
+ public:
+  explicit Ledger(size_t process_num)
+      : convicted_(process_num) {}
+
+  // Records the offense of the process, which is convicted by any one.
+  // Returns whether it was not convicted before.
+  bool Record(unsigned int pid, Offense offense);
+
+  inline bool Convicted(unsigned int pid) const { return convicted_[pid]; }
+  // Returns whether each process has been convicted, indexed by id.
+  inline const std::vector<bool>& Convicts() const { return convicted_; }
+
+ private:
+  std::vector<bool> convicted_;
+};
+
+}  // namespace evidence
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef FUTEX_H_
+#define FUTEX_H_
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace futex {
+
+// Waits on the futex until its value differs from val, it is woken, or the
+// timeout passes. Futexes shared between processes (in shared memory) must not
+// be private.
+inline void Wait(std::atomic<uint32_t>* addr, uint32_t val,
+                 std::chrono::microseconds timeout, bool priv) {
+  const auto secs = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+  struct timespec ts;
+  ts.tv_sec = secs.count();
+  ts.tv_nsec = std::chrono::nanoseconds(timeout - secs).count();
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr),
+          priv ? FUTEX_WAIT_PRIVATE : FUTEX_WAIT, val, &ts, nullptr, 0);
+}
+
+// Wakes a single thread waiting on the futex.
+inline void Wake(std::atomic<uint32_t>* addr, bool priv) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr),
+          priv ? FUTEX_WAKE_PRIVATE : FUTEX_WAKE, 1, nullptr, nullptr, 0);
+}
+
+}  // namespace futex
+
+#endif
@@ -2,13 +2,18 @@
 
 namespace generals {
 
-size_t MessagesForRound(size_t process_num, unsigned int round) {
-  if (round == 0) return 1;
-  return (process_num - 1 - round) * MessagesForRound(process_num, round - 1);
+namespace {
+
+// Returns the 32 bit wire word i of a 64 bit mask, which holds slots 32 * i
+// through 32 * i + 31.
+inline uint32_t WireWord(const uint64_t mask_word, size_t i) {
+  return static_cast<uint32_t>(mask_word >> (32 * (i % 2)));
 }
 
-std::experimental::optional<msg::Message> ByzantineMsgFromBuf(char* buf,
-                                                              size_t n) {
+// Decodes a message with the layout of a msg::ByzantineMessage and the
+// provided type from the buffer.
+std::experimental::optional<msg::Message> MessageFromBuf(char* buf, size_t n,
+                                                         uint32_t type) {
   // Check to make sure the size of the buffer is correct.
   if (n < sizeof(msg::ByzantineMessage)) {
     return {};
@@ -17,40 +22,157 @@ std::experimental::optional<msg::Message> ByzantineMsgFromBuf(char* buf,
   // Copy out the message part.
   msg::Message msg;
   msg::ByzantineMessage* c_msg = reinterpret_cast<msg::ByzantineMessage*>(buf);
+  if (ntohl(c_msg->type) != type) {
+    return {};
+  }
+  msg.instance = ntohl(c_msg->instance);
   msg.round = ntohl(c_msg->round);
-  msg.order = static_cast<msg::Order>(ntohl(c_msg->order));
+  msg.value = msg::kNoValue;
+
+  // The ids and either the two masks of orders or the digest of a value must
+  // fill the rest of the buffer exactly.
+  const size_t id_num = size_t{msg.round} + 1;
+  const size_t slots = ntohl(c_msg->slots);
+  const size_t words = msg::OrderWords(slots);
+  const size_t body = slots == msg::kValueSlots ? sizeof(msg::Digest)
+                                                : 2 * sizeof(uint32_t) * words;
+  if ((n - sizeof(*c_msg)) / sizeof(uint32_t) < id_num ||
+      n - sizeof(*c_msg) - sizeof(uint32_t) * id_num != body) {
+    return {};
+  }
 
-  msg.ids.resize((n - sizeof(*c_msg)) / sizeof(uint32_t));
+  msg.ids.resize(id_num);
   uint32_t* id_buf = reinterpret_cast<uint32_t*>(buf + sizeof(*c_msg));
   for (size_t i = 0; i < msg.ids.size(); ++i) {
     msg.ids[i] = ntohl(id_buf[i]);
   }
 
+  msg.orders = msg::Orders(slots, msg::Order::NO_ORDER);
+  if (slots == msg::kValueSlots) {
+    auto digest = reinterpret_cast<const uint8_t*>(id_buf + id_num);
+    std::copy(digest, digest + msg.value.size(), msg.value.begin());
+    return msg;
+  }
+  uint32_t* retreat_buf = id_buf + id_num;
+  uint32_t* attack_buf = retreat_buf + words;
+  for (size_t i = 0; i < words; ++i) {
+    const unsigned int shift = 32 * (i % 2);
+    msg.orders.Retreat(i / 2) |= uint64_t{ntohl(retreat_buf[i])} << shift;
+    msg.orders.Attack(i / 2) |= uint64_t{ntohl(attack_buf[i])} << shift;
+  }
+  // Ignore any bits past the last slot.
+  if (slots % 64 != 0) {
+    const size_t last = msg.orders.Words() - 1;
+    msg.orders.Retreat(last) &= msg.orders.Mask(last);
+    msg.orders.Attack(last) &= msg.orders.Mask(last);
+  }
+
   return msg;
 }
 
-std::experimental::optional<unsigned int> RoundOfAck(char* buf, size_t n) {
-  // Check to make sure the size of the buffer is correct.
+}  // namespace
+
+std::experimental::optional<msg::Message> ByzantineMsgFromBuf(char* buf,
+                                                              size_t n) {
+  return MessageFromBuf(buf, n, kByzantineMessageType);
+}
+
+std::experimental::optional<msg::Message> ProofFromBuf(char* buf, size_t n) {
+  return MessageFromBuf(buf, n, kProofType);
+}
+
+uint32_t SeqOfMessage(const char* buf) {
+  auto c_msg = reinterpret_cast<const msg::ByzantineMessage*>(buf);
+  return ntohl(c_msg->seq);
+}
+
+std::experimental::optional<uint32_t> SeqOfAck(const char* buf, size_t n) {
+  // Check to make sure the size and type of the buffer are correct.
   if (n != sizeof(msg::Ack)) {
     return {};
   }
+  auto ack = reinterpret_cast<const msg::Ack*>(buf);
+  if (ntohl(ack->type) != kAckType) {
+    return {};
+  }
+  return ntohl(ack->seq);
+}
 
-  msg::Ack* ack = reinterpret_cast<msg::Ack*>(buf);
-  return ntohl(ack->round);
+std::experimental::optional<uint32_t> SeqOfHello(const char* buf, size_t n) {
+  // Check to make sure the size and type of the buffer are correct.
+  if (n != sizeof(msg::Hello)) {
+    return {};
+  }
+  auto hello = reinterpret_cast<const msg::Hello*>(buf);
+  if (ntohl(hello->type) != kHelloType) {
+    return {};
+  }
+  return ntohl(hello->seq);
 }
 
-void SendMessage(udp::ClientPtr client, const msg::Message& msg) {
-  size_t size =
-      sizeof(msg::ByzantineMessage) + sizeof(uint32_t) * msg.ids.size();
-  char buf[size];
+bool IsHeartbeat(const char* buf, size_t n) {
+  return n == sizeof(msg::Heartbeat) &&
+         ntohl(reinterpret_cast<const msg::Heartbeat*>(buf)->type) ==
+             kHeartbeatType;
+}
+
+std::experimental::optional<unsigned int> InstanceOfCatchUp(const char* buf,
+                                                            size_t n) {
+  // Check to make sure the size and type of the buffer are correct.
+  if (n != sizeof(msg::CatchUp)) {
+    return {};
+  }
+  auto catch_up = reinterpret_cast<const msg::CatchUp*>(buf);
+  if (ntohl(catch_up->type) != kCatchUpType) {
+    return {};
+  }
+  return ntohl(catch_up->instance);
+}
+
+std::experimental::optional<std::pair<unsigned int, unsigned int>>
+RoundReportFromBuf(const char* buf, size_t n) {
+  // Check to make sure the size and type of the buffer are correct.
+  if (n != sizeof(msg::RoundReport)) {
+    return {};
+  }
+  auto report = reinterpret_cast<const msg::RoundReport*>(buf);
+  if (ntohl(report->type) != kRoundReportType) {
+    return {};
+  }
+  return std::make_pair(ntohl(report->instance), ntohl(report->round));
+}
+
+size_t EncodedSize(const msg::Message& msg) {
+  const size_t body =
+      msg.orders.Slots() == msg::kValueSlots
+          ? sizeof(msg::Digest)
+          : 2 * sizeof(uint32_t) * msg::OrderWords(msg.orders.Slots());
+  return sizeof(msg::ByzantineMessage) + sizeof(uint32_t) * msg.ids.size() +
+         body;
+}
+
+size_t MaxSlots(unsigned int faulty) {
+  // The longest message is sent in the last round, with faulty + 2 ids.
+  const size_t fixed =
+      sizeof(msg::ByzantineMessage) + sizeof(uint32_t) * (faulty + 2);
+  if (fixed >= BUFSIZE) return 0;
+  return 32 * ((BUFSIZE - fixed) / (2 * sizeof(uint32_t)));
+}
+
+void EncodeMessage(const msg::Message& msg, uint32_t seq, char* buf,
+                   uint32_t type) {
+  size_t size = EncodedSize(msg);
   bzero(buf, size);
 
-  // Copy the message part.
+  // Copy the message part. The sequence number lets the receive thread match
+  // the acknowledgement to this send.
   msg::ByzantineMessage* c_msg = reinterpret_cast<msg::ByzantineMessage*>(buf);
-  c_msg->type = htonl(kByzantineMessageType);
+  c_msg->type = htonl(type);
   c_msg->size = htonl(size);
+  c_msg->seq = htonl(seq);
+  c_msg->instance = htonl(msg.instance);
   c_msg->round = htonl(msg.round);
-  c_msg->order = htonl(static_cast<int>(msg.order));
+  c_msg->slots = htonl(msg.orders.Slots());
 
   // C++ does not support flexible arrays, so we need to be a little tricky
   // here. We already made sure the buffer was the correct size by adding space
@@ -61,35 +183,251 @@ void SendMessage(udp::ClientPtr client, const msg::Message& msg) {
     id_buf[i] = htonl(msg.ids[i]);
   }
 
-  // Passed to SendWithAck to verify that any acknowledgement we hear is valid.
-  auto isValidAck = [msg](udp::ClientPtr _, char* buf, size_t n) {
-    auto ackRound = RoundOfAck(buf, n);
-    bool valid = ackRound && *ackRound == msg.round;
-    if (!valid) return udp::ServerAction::Continue;
-    return udp::ServerAction::Stop;
-  };
+  // The orders follow the ids, as a retreat mask and then an attack mask, or
+  // the digest of the value does.
+  if (msg.orders.Slots() == msg::kValueSlots) {
+    std::copy(msg.value.begin(), msg.value.end(),
+              reinterpret_cast<uint8_t*>(id_buf + msg.ids.size()));
+    return;
+  }
+  const size_t words = msg::OrderWords(msg.orders.Slots());
+  uint32_t* retreat_buf = id_buf + msg.ids.size();
+  uint32_t* attack_buf = retreat_buf + words;
+  for (size_t i = 0; i < words; ++i) {
+    retreat_buf[i] = htonl(WireWord(msg.orders.Retreat(i / 2), i));
+    attack_buf[i] = htonl(WireWord(msg.orders.Attack(i / 2), i));
+  }
+}
+
+namespace {
+
+// Rounds beyond this share one counter, as only the first faulty + 2 rounds
+// are valid in any cluster.
+const size_t kMaxCountedRound = 32;
 
-  client->SendWithAck(buf, size, kSendAttempts, isValidAck);
+metrics::CounterVec& SentMessages() {
+  static metrics::CounterVec counters(
+      "byzantine_messages_sent_total",
+      "Messages sent by every process, by the round of the message.", "round",
+      kMaxCountedRound);
+  return counters;
 }
 
-void SendAckForRound(udp::ClientPtr client, unsigned int round) {
+metrics::Counter& CatchUpRequestsSent() {
+  static metrics::Counter& counter = metrics::Default().GetCounter(
+      "byzantine_catch_up_requests_sent_total",
+      "Requests of lagging lieutenants for the round of an instance.");
+  return counter;
+}
+
+metrics::Counter& FetchesSent() {
+  static metrics::Counter& counter = metrics::Default().GetCounter(
+      "byzantine_payload_fetches_sent_total",
+      "Requests for missing chunks of value payloads.");
+  return counter;
+}
+
+// Returns the histogram of how long Decide takes for the provided role.
+metrics::Histogram& DecideLatency(const std::string& role) {
+  return metrics::Default().GetHistogram(
+      "byzantine_decide_duration_seconds",
+      "Time taken by General::Decide, from its call to its decision.",
+      {{"role", role}});
+}
+
+// How often a lieutenant that missed the first round of an instance asks the
+// other processes where it is.
+const auto kCatchUpInterval = std::chrono::milliseconds{500};
+
+}  // namespace
+
+void SendMessage(transport::ClientPtr client, const msg::Message& msg) {
+  SentMessages().At(msg.round).Add();
+  size_t size = EncodedSize(msg);
+  char buf[size];
+  uint32_t seq = client->NextSeq();
+  EncodeMessage(msg, seq, buf);
+  client->SendWithAck(buf, size, seq, kSendAttempts);
+}
+
+void SendProof(transport::ClientPtr client, const msg::Message& msg) {
+  size_t size = EncodedSize(msg);
+  char buf[size];
+  uint32_t seq = client->NextSeq();
+  EncodeMessage(msg, seq, buf, kProofType);
+  client->SendWithAck(buf, size, seq, kSendAttempts);
+}
+
+std::vector<std::vector<char>> EncodeBundles(
+    const std::vector<msg::Message>& msgs, unsigned int round) {
+  std::vector<std::vector<char>> bundles;
+  for (auto const& msg : msgs) {
+    const size_t size = EncodedSize(msg);
+    if (sizeof(msg::Bundle) + size > BUFSIZE) {
+      throw std::logic_error("message does not fit in a bundle");
+    }
+    if (bundles.empty() || bundles.back().size() + size > BUFSIZE) {
+      std::vector<char> bundle(sizeof(msg::Bundle));
+      msg::Bundle* c_bundle = reinterpret_cast<msg::Bundle*>(bundle.data());
+      c_bundle->type = htonl(kBundleType);
+      c_bundle->round = htonl(round);
+      bundles.push_back(std::move(bundle));
+    }
+
+    // Append the message and count it.
+    auto& bundle = bundles.back();
+    const size_t offset = bundle.size();
+    bundle.resize(offset + size);
+    EncodeMessage(msg, 0, bundle.data() + offset);
+    msg::Bundle* c_bundle = reinterpret_cast<msg::Bundle*>(bundle.data());
+    c_bundle->size = htonl(bundle.size());
+    c_bundle->count = htonl(ntohl(c_bundle->count) + 1);
+  }
+  return bundles;
+}
+
+std::experimental::optional<std::vector<msg::Message>> BundleFromBuf(char* buf,
+                                                                     size_t n) {
+  // Check to make sure the size and type of the buffer are correct.
+  if (n < sizeof(msg::Bundle)) {
+    return {};
+  }
+  auto c_bundle = reinterpret_cast<const msg::Bundle*>(buf);
+  if (ntohl(c_bundle->type) != kBundleType) {
+    return {};
+  }
+
+  // Each message gives its own size, and together they must fill the rest of
+  // the buffer exactly.
+  std::vector<msg::Message> msgs;
+  size_t offset = sizeof(msg::Bundle);
+  for (uint32_t i = 0; i < ntohl(c_bundle->count); ++i) {
+    if (n - offset < sizeof(msg::ByzantineMessage)) {
+      return {};
+    }
+    auto c_msg = reinterpret_cast<const msg::ByzantineMessage*>(buf + offset);
+    const size_t size = ntohl(c_msg->size);
+    if (size > n - offset) {
+      return {};
+    }
+    auto msg = ByzantineMsgFromBuf(buf + offset, size);
+    if (!msg) {
+      return {};
+    }
+    msgs.push_back(std::move(*msg));
+    offset += size;
+  }
+  if (offset != n) {
+    return {};
+  }
+  return msgs;
+}
+
+void SendBundle(transport::ClientPtr client, std::vector<char>& bundle) {
+  msg::Bundle* c_bundle = reinterpret_cast<msg::Bundle*>(bundle.data());
+  SentMessages().At(ntohl(c_bundle->round)).Add(ntohl(c_bundle->count));
+  uint32_t seq = client->NextSeq();
+  c_bundle->seq = htonl(seq);
+  client->SendWithAck(bundle.data(), bundle.size(), seq, kSendAttempts);
+}
+
+msg::Message SwapIds(msg::Message msg, unsigned int commander) {
+  for (auto& id : msg.ids) id = ForInstance(commander, id);
+  return msg;
+}
+
+std::vector<bool> ConvictsForInstance(const evidence::Ledger& ledger,
+                                      unsigned int commander) {
+  std::vector<bool> convicted = ledger.Convicts();
+  for (unsigned int pid = 0; pid < convicted.size(); ++pid) {
+    convicted[pid] = ledger.Convicted(ForInstance(commander, pid));
+  }
+  return convicted;
+}
+
+namespace {
+
+// Encodes the acknowledgement of the message with the provided instance, round
+// and sequence number.
+msg::Ack MakeAck(unsigned int instance, unsigned int round, uint32_t seq) {
   msg::Ack ack = {};
   ack.type = htonl(kAckType);
   ack.size = htonl(sizeof(ack));
+  ack.instance = htonl(instance);
   ack.round = htonl(round);
+  ack.seq = htonl(seq);
+  return ack;
+}
+
+}  // namespace
 
+void SendAck(transport::Server& server, const transport::Address& to,
+             unsigned int instance, unsigned int round, uint32_t seq) {
+  msg::Ack ack = MakeAck(instance, round, seq);
   char* buf = reinterpret_cast<char*>(&ack);
-  client->Send(buf, sizeof(ack));
+  server.Send(to, buf, sizeof(ack));
 }
 
-UdpClientMap ClientsForProcessList(const ProcessList& processes) {
-  UdpClientMap clients(processes.size());
-  for (auto const& addr : processes) {
-    clients.emplace(addr, std::make_shared<udp::Client>(addr, kAckTimeout));
+std::experimental::optional<std::vector<char>> AckForMessage(const char* buf,
+                                                             size_t n) {
+  // Check to make sure the size and type of the buffer are correct.
+  msg::Ack ack;
+  auto c_msg = reinterpret_cast<const msg::ByzantineMessage*>(buf);
+  auto c_bundle = reinterpret_cast<const msg::Bundle*>(buf);
+  if (n >= sizeof(msg::ByzantineMessage) &&
+      (ntohl(c_msg->type) == kByzantineMessageType ||
+       ntohl(c_msg->type) == kProofType)) {
+    ack = MakeAck(ntohl(c_msg->instance), ntohl(c_msg->round),
+                  ntohl(c_msg->seq));
+  } else if (n >= sizeof(msg::Bundle) &&
+             ntohl(c_bundle->type) == kBundleType) {
+    ack = MakeAck(0, ntohl(c_bundle->round), ntohl(c_bundle->seq));
+  } else if (auto seq = SeqOfHello(buf, n)) {
+    ack = MakeAck(0, 0, *seq);
+  } else {
+    return {};
+  }
+  char* ack_buf = reinterpret_cast<char*>(&ack);
+  return std::vector<char>(ack_buf, ack_buf + sizeof(ack));
+}
+
+ClientMap ClientsForProcessList(const ProcessList& processes,
+                                std::shared_ptr<transport::Server> server) {
+  auto resolved = udp::ResolveAll(processes);
+  ClientMap clients(processes.size());
+  for (size_t i = 0; i < processes.size(); ++i) {
+    clients.emplace(processes[i], std::make_shared<transport::Client>(
+                                      server, resolved[i], kAckTimeout));
   }
   return clients;
 }
 
+Transport StringToTransport(std::string str) {
+  if (str == "udp") return Transport::UDP;
+  if (str == "shm") return Transport::SHM;
+  throw std::invalid_argument("transport can either be \"udp\" or \"shm\"");
+}
+
+std::shared_ptr<transport::Server> ServerForProcess(
+    Transport transport, const ProcessList& processes, unsigned int id) {
+  switch (transport) {
+    case Transport::UDP:
+      return std::make_shared<udp::Server>(processes.at(id).port(), SeqOfAck,
+                                           kRoundTimeout);
+    case Transport::SHM:
+      return std::make_shared<shm::Server>(udp::ResolveAll(processes), id,
+                                           SeqOfAck, kRoundTimeout);
+    default:
+      throw std::invalid_argument("unexpected Transport value");
+  }
+}
+
+std::shared_ptr<replay::Server> ReplayServer(const std::string& path,
+                                             double speed) {
+  return std::make_shared<replay::Server>(path, speed, SeqOfAck, AckForMessage,
+                                          kRoundTimeout);
+}
+
 MaliciousBehavior StringToMaliciousBehavior(std::string str) {
   if (str == "silent") return MaliciousBehavior::SILENT;
   if (str == "delay_send") return MaliciousBehavior::DELAY_SEND;
@@ -154,243 +492,1433 @@ void General::MaybeDelaySend() {
   return;
 }
 
-msg::Order Commander::Decide() {
+msg::Order General::OrderForMsg(msg::Order order) const {
+  if (ExhibitsBehavior(MaliciousBehavior::WRONG_ORDER)) {
+    // Send wrong order 30% of the time.
+    static thread_local std::default_random_engine random_engine(
+        std::chrono::system_clock::now().time_since_epoch().count());
+
+    std::uniform_real_distribution<double> distribution(0.0, 1.0);
+    if (distribution(random_engine) < 0.30) {
+      return order == msg::Order::ATTACK ? msg::Order::RETREAT
+                                         : msg::Order::ATTACK;
+    }
+  }
+  return order;
+}
+
+std::experimental::optional<std::string> General::DecideValue() {
+  if (!DecidesValue()) {
+    throw std::logic_error("the General was not constructed to decide a value");
+  }
+  DecideInstances(1, 1);
+  const msg::Digest value = DecidedValue(0);
+  if (value == msg::kNoValue) {
+    return {};
+  }
+  // Values are only accepted once their payload is complete, so the payload
+  // of the decision is always known.
+  return *payloads_.Get(value);
+}
+
+void General::PushPayload(transport::ClientPtr client,
+                          const msg::Digest& digest) {
+  const std::string* payload = payloads_.Get(digest);
+  char buf[BUFSIZE];
+  for (size_t i = 0; i < payload::ChunkCount(payload->size()); ++i) {
+    size_t size = payload::EncodeChunk(digest, *payload, i, buf);
+    client->Send(buf, size);
+  }
+}
+
+void General::ServeFetch(const transport::Address& to,
+                         const payload::FetchRequest& fetch) {
+  const std::string* payload = payloads_.Get(fetch.digest);
+  if (payload == nullptr) {
+    return;
+  }
+  char buf[BUFSIZE];
+  const size_t end = std::min(fetch.first + fetch.count,
+                              payload::ChunkCount(payload->size()));
+  for (size_t i = fetch.first; i < end; ++i) {
+    size_t size = payload::EncodeChunk(fetch.digest, *payload, i, buf);
+    server_->Send(to, buf, size);
+  }
+}
+
+void General::Rendezvous(size_t quorum) {
+  timeline::Span span("Rendezvous");
+  const auto start = std::chrono::steady_clock::now();
+  const size_t peers = processes_.size() - 1;
+
+  // Greet every process on a thread of its own, one attempt at a time so that
+  // the greeters notice when the wait is over.
+  std::mutex mu;
+  std::condition_variable cv;
+  size_t ready = 0;
+  std::atomic<bool> done{false};
+  threadutil::ThreadGroup greeters;
+  for (unsigned int pid = 0; pid < processes_.size(); ++pid) {
+    if (pid == id_) continue;
+    transport::ClientPtr client = ClientForId(pid);
+    greeters.AddThread([&, client, pid] {
+      timeline::NameThread("greeter p" + std::to_string(pid));
+      while (!done) {
+        msg::Hello hello = {};
+        const uint32_t seq = client->NextSeq();
+        hello.type = htonl(kHelloType);
+        hello.size = htonl(sizeof(hello));
+        hello.seq = htonl(seq);
+        if (client->SendWithAck(reinterpret_cast<char*>(&hello),
+                                sizeof(hello), seq, 1)) {
+          LOG(Debug, "p", pid, " is ready");
+          std::lock_guard<std::mutex> lock(mu);
+          ready++;
+          cv.notify_one();
+          return;
+        }
+      }
+    });
+  }
+
+  size_t reached = 0;
+  {
+    std::unique_lock<std::mutex> lock(mu);
+    if (!cv.wait_until(lock, start + kRendezvousTimeout,
+                       [&] { return ready == peers; })) {
+      cv.wait_until(lock, start + kQuorumTimeout,
+                    [&] { return ready >= quorum; });
+    }
+    reached = ready;
+    done = true;
+  }
+  greeters.JoinAll();
+  if (reached < quorum) {
+    throw std::runtime_error("only " + std::to_string(reached) + " of " +
+                             std::to_string(peers) +
+                             " processes are ready, " +
+                             std::to_string(quorum) + " are needed");
+  }
+  if (reached < peers) {
+    LOG(Warning, "Starting with ", reached, " of ", peers,
+        " processes ready");
+  }
+}
+
+void General::PrintLinks(std::ostream& o) const {
+  const auto links = server_->Links();
+  const auto now = std::chrono::steady_clock::now();
+  auto ms = [](std::chrono::steady_clock::duration d) {
+    return std::chrono::duration<double, std::milli>(d).count();
+  };
+
+  std::ostringstream table;
+  table << std::fixed << std::setprecision(2);
+  table << std::left << std::setw(5) << "peer" << std::setw(22) << "address"
+        << std::right << std::setw(9) << "rtt_ms" << std::setw(10)
+        << "rttvar_ms" << std::setw(7) << "loss%" << std::setw(9) << "msgs_out"
+        << std::setw(10) << "bytes_out" << std::setw(8) << "msgs_in"
+        << std::setw(10) << "bytes_in" << std::setw(8) << "invalid"
+        << std::setw(8) << "unacked" << std::setw(13) << "heard_ms_ago"
+        << "\n";
+  for (unsigned int pid = 0; pid < processes_.size(); ++pid) {
+    if (pid == id_) continue;
+    std::ostringstream peer, address;
+    peer << "p" << pid;
+    address << processes_[pid];
+
+    transport::LinkStats link = {};
+    auto it = links.find(ClientForId(pid)->RemoteAddress());
+    if (it != links.end()) link = it->second;
+    table << std::left << std::setw(5) << peer.str() << std::setw(22)
+          << address.str() << std::right << std::setw(9)
+          << ms(link.srtt) << std::setw(10) << ms(link.rttvar) << std::setw(7)
+          << 100 * link.LossRate() << std::setw(9) << link.messages_out
+          << std::setw(10) << link.bytes_out << std::setw(8)
+          << link.messages_in << std::setw(10) << link.bytes_in
+          << std::setw(8) << link.invalid << std::setw(8) << link.unacked
+          << std::setw(13);
+    if (link.messages_in > 0) {
+      table << ms(now - link.last_heard);
+    } else {
+      table << "-";
+    }
+    table << "\n";
+  }
+  o << table.str() << std::flush;
+}
+
+namespace {
+
+// Returns a payload that differs from the provided one, for a traitorous
+// commander to send in its place.
+std::string WrongPayload(std::string payload) {
+  if (payload.empty()) return "\n";
+  payload.back() ^= 1;
+  return payload;
+}
+
+}  // namespace
+
+Commander::Commander(const ProcessList& processes,
+                     std::shared_ptr<transport::Server> server,
+                     unsigned int faulty, const std::string& value,
+                     MaliciousBehavior behavior)
+    : General(processes, 0, server, faulty, behavior, msg::kValueSlots),
+      order_(msg::Order::NO_ORDER),
+      value_(payloads_.Add(value)),
+      wrong_value_(payloads_.Add(WrongPayload(value))) {}
+
+std::vector<msg::Orders> Commander::DecideInstances(unsigned int instances,
+                                                    unsigned int in_flight) {
+  static metrics::Histogram& latency = DecideLatency("commander");
+  const auto start = std::chrono::steady_clock::now();
+  timeline::Span span("Decide", {{"instances", instances}});
+
+  // Make sure the lieutenants can hear the first round before sending it,
+  // since a lieutenant that misses it waits in round 0 for good. Every honest
+  // lieutenant is needed to decide, so wait for at least that many.
+  Rendezvous(processes_.size() - 1 - faulty_);
+
+  // Each worker proposes one instance at a time, taking the next instance
+  // that has not been proposed, so that up to in_flight are running at once.
+  std::atomic<unsigned int> next{0};
+  std::atomic<unsigned int> proposing{std::min(instances, in_flight)};
+  threadutil::ThreadGroup workers;
+  for (unsigned int w = 0; w < std::min(instances, in_flight); ++w) {
+    workers.AddThread([this, &next, &proposing, instances] {
+      for (unsigned int i = next++; i < instances; i = next++) {
+        Propose(i);
+      }
+      proposing--;
+    });
+  }
+  if (DecidesValue()) {
+    // Lieutenants only acknowledge a value once they hold its payload, so
+    // serve their fetches of missing chunks until every proposal is done.
+    server_->Listen(
+        [this, &proposing](const transport::Address& from, char* buf,
+                           size_t n) {
+          if (auto fetch = payload::FetchFromBuf(buf, n)) {
+            ServeFetch(from, *fetch);
+          }
+          return proposing == 0 ? transport::ServerAction::Stop
+                                : transport::ServerAction::Continue;
+        },
+        [&proposing]() {
+          return proposing == 0 ? transport::ServerAction::Stop
+                                : transport::ServerAction::Continue;
+        });
+  }
+  workers.JoinAll();
+  latency.Record(std::chrono::steady_clock::now() - start);
+  return std::vector<msg::Orders>(instances, msg::Orders(slots_, order_));
+}
+
+void Commander::Propose(unsigned int instance) {
   // Send in parallel so that some Lieutenants don't end up far ahead of
   // others.
   threadutil::ThreadGroup senders;
   auto ids = std::vector<unsigned int>{0};
   for (unsigned int pid = 1; pid < processes_.size(); ++pid) {
     if (ShouldSendMsg()) {
-      msg::Message msg{round_, OrderForMsg(), ids};
-      logging::out << "Sending  " << msg << " to p" << pid << "\n";
+      msg::Orders orders(slots_, order_);
+      for (size_t slot = 0; slot < slots_; ++slot) {
+        orders.Set(slot, OrderForMsg(order_));
+      }
+      msg::Message msg{0, orders, ids, instance};
+      if (DecidesValue()) msg.value = ValueForMsg();
+      LOG(Debug, "Sending  ", msg, " to p", pid);
 
-      udp::ClientPtr client = ClientForId(pid);
-      senders.AddThread([this, client, msg] {
+      transport::ClientPtr client = ClientForId(pid);
+      senders.AddThread([this, client, msg, pid] {
+        timeline::NameThread("sender p" + std::to_string(pid));
         MaybeDelaySend();
+        // Push the payload ahead of the value, so that it is usually complete
+        // by the time the value arrives.
+        if (DecidesValue()) PushPayload(client, msg.value);
         SendMessage(client, msg);
       });
     }
   }
   senders.JoinAll();
-  return order_;
 }
 
-msg::Order Commander::OrderForMsg() const {
+msg::Digest Commander::ValueForMsg() const {
   if (ExhibitsBehavior(MaliciousBehavior::WRONG_ORDER)) {
-    // Send wrong order 30% of the time.
+    // Send the wrong value 30% of the time, like OrderForMsg.
     static thread_local std::default_random_engine random_engine(
         std::chrono::system_clock::now().time_since_epoch().count());
 
     std::uniform_real_distribution<double> distribution(0.0, 1.0);
     if (distribution(random_engine) < 0.30) {
-      return order_ == msg::Order::ATTACK ? msg::Order::RETREAT
-                                          : msg::Order::ATTACK;
+      return wrong_value_;
     }
   }
-  return order_;
+  return value_;
 }
 
-msg::Order Lieutenant::Decide() {
-  server_.Listen(
-      // Called on all incoming Byzantine Messages.
-      [this](udp::ClientPtr client, char* buf, size_t n) {
-        auto from = client->RemoteAddress();
-        auto msg = ByzantineMsgFromBuf(buf, n);
-        if (!msg || !ValidMessage(*msg, from)) {
-          // If the message was not valid, return without trying to use it.
-          return ContinueUnlessTimeout();
-        }
+std::vector<msg::Orders> Lieutenant::DecideInstances(unsigned int instances,
+                                                     unsigned int in_flight) {
+  static metrics::Histogram& latency = DecideLatency("lieutenant");
+  const auto start = std::chrono::steady_clock::now();
+  timeline::Span span("Decide", {{"instances", instances}});
+
+  instances_.clear();
+  fetching_.clear();
+  decisions_.assign(instances, {});
+  value_decisions_.assign(instances, msg::kNoValue);
+  undecided_ = instances;
+  heard_ = 1;
+  last_sent_.clear();
+  last_proofs_.clear();
+  reported_rounds_.clear();
+  last_catch_up_ = start - kCatchUpInterval;
+  last_heard_.assign(processes_.size(), start);
+  suspected_.assign(processes_.size(), false);
+  RequestCatchUps(start);
+
+  // Tell the other lieutenants that we are running until we decide, so that
+  // their rounds do not wait on us if we fail.
+  std::mutex heartbeat_mu;
+  std::condition_variable heartbeat_cv;
+  bool decided = false;
+  std::thread heartbeats([&] {
+    timeline::NameThread("heartbeats");
+    std::unique_lock<std::mutex> lock(heartbeat_mu);
+    do {
+      try {
+        SendHeartbeats();
+      } catch (const net::SendException& e) {
+        // Heartbeats are not retried, so the next one simply goes out on
+        // time.
+        LOG(Warning, "Could not send heartbeats: ", std::string(e.what()));
+      }
+    } while (!heartbeat_cv.wait_for(lock, kHeartbeatInterval,
+                                    [&] { return decided; }));
+  });
+  {
+    // Stop the heartbeats once Listen returns or throws.
+    threadutil::OnExit stop_heartbeats([&] {
+      {
+        std::lock_guard<std::mutex> lock(heartbeat_mu);
+        decided = true;
+      }
+      heartbeat_cv.notify_one();
+      heartbeats.join();
+    });
 
-        logging::out << "Received " << *msg << " from p" << msg->ids.back()
-                     << "\n";
-        SendAckForRound(client, round_);
-
-        bool newRound = false;
-        if (FirstRound()) {
-          // Only handle the first real order.
-          if (msg->order != msg::Order::NO_ORDER && orders_seen_.size() == 0) {
-            orders_seen_.insert(msg->order);
-            msgs_this_round_.insert(*msg);
-            newRound = true;
+    server_->Listen(
+        // Called on all incoming Byzantine Messages.
+        [this](const transport::Address& from, char* buf, size_t n) {
+          const auto now = std::chrono::steady_clock::now();
+          auto pid = ids_.find(from);
+          if (pid != ids_.end()) {
+            // Any datagram shows the process is running, including relays
+            // that are being retransmitted.
+            last_heard_[pid->second] = now;
           }
-        } else {
-          // Handle if not a replay of a previous message (msg with same ids).
-          if (ids_this_round_.count(msg->ids) == 0) {
-            ids_this_round_.insert(msg->ids);
-
-            // Handle the order in the message based on if we've seen the same
-            // order or not.
-            if (msg->order != msg::Order::NO_ORDER &&
-                orders_seen_.count(msg->order) == 0) {
-              // We have not seen this order yet, so we add it to the
-              // orders_seen set and forward it in the next round.
-              orders_seen_.insert(msg->order);
-            } else {
-              // We have already seen this order, so we forward a no_order
-              // instead next round.
-              msg->order = msg::Order::NO_ORDER;
+          if (DecidesValue() && pid != ids_.end()) {
+            // Chunks and fetches of payloads travel alongside the messages.
+            if (auto chunk = payload::ChunkFromBuf(buf, n)) {
+              if (AddChunk(*chunk, now) == transport::ServerAction::Stop) {
+                return transport::ServerAction::Stop;
+              }
+              return PollAll(now);
+            }
+            if (auto fetch = payload::FetchFromBuf(buf, n)) {
+              ServeFetch(from, *fetch);
+              return PollAll(now);
             }
+          }
 
-            // Record the message so we can forward it next round.
-            msgs_this_round_.insert(*msg);
+          if (auto seq = SeqOfHello(buf, n)) {
+            // The commander is checking that we are listening.
+            SendAck(*server_, from, 0, 0, *seq);
+            return PollAll(now);
+          }
+          if (pid != ids_.end() && IsHeartbeat(buf, n)) {
+            return PollAll(now);
+          }
+          if (pid != ids_.end()) {
+            // Lagging lieutenants ask where the instances are.
+            if (auto instance = InstanceOfCatchUp(buf, n)) {
+              AnswerCatchUp(from, pid->second, *instance);
+              return PollAll(now);
+            }
+            if (auto report = RoundReportFromBuf(buf, n)) {
+              if (AddRoundReport(pid->second, report->first, report->second,
+                                 now) == transport::ServerAction::Stop) {
+                return transport::ServerAction::Stop;
+              }
+              return PollAll(now);
+            }
+            if (auto proof = ProofFromBuf(buf, n)) {
+              DeliverProof(from, pid->second, *proof, SeqOfMessage(buf), now);
+              return PollAll(now);
+            }
+          }
 
-            // Determine if this is the last message needed for the round.
-            newRound = RoundComplete();
+          auto msg = ByzantineMsgFromBuf(buf, n);
+          if (!msg || pid == ids_.end()) {
+            // If the message was not usable, only check for round timeouts.
+            if (pid != ids_.end()) server_->NoteInvalid(from);
+            return PollAll(now);
           }
-        }
+          if (Deliver(from, pid->second, *msg, SeqOfMessage(buf), now) ==
+              transport::ServerAction::Stop) {
+            return transport::ServerAction::Stop;
+          }
+          return PollAll(now);
+        },
+        // Called on socket timeout.
+        [this]() {
+          const auto now = std::chrono::steady_clock::now();
+          RetryFetches(now);
+          RequestCatchUps(now);
+          if (UpdateSuspects(now) == transport::ServerAction::Stop) {
+            return transport::ServerAction::Stop;
+          }
+          std::vector<unsigned int> ids;
+          for (auto const& entry : instances_) ids.push_back(entry.first);
+          auto action = transport::ServerAction::Continue;
+          for (auto id : ids) {
+            action = Apply(id, instances_.at(id)->machine.Timeout(now));
+          }
+          return action;
+        });
+  }
 
-        if (newRound) {
-          return MoveToNewRoundOrStop();
-        }
-        return ContinueUnlessTimeout();
-      },
-      // Called on socket timeout.
-      [this]() { return HandleRoundTimeout(); });
+  // Wait for the last acknowledgements of every instance.
+  {
+    std::unique_lock<std::mutex> lock(senders_mu_);
+    senders_cv_.wait(lock, [this] { return running_senders_ == 0; });
+  }
 
-  return DecideOrder();
+  latency.Record(std::chrono::steady_clock::now() - start);
+  std::vector<msg::Orders> decisions;
+  for (auto const& decision : decisions_) decisions.push_back(*decision);
+  return decisions;
 }
 
-inline msg::Order Lieutenant::DecideOrder() const {
-  if (orders_seen_.size() == 1 && orders_seen_.count(msg::Order::ATTACK) == 1) {
-    return msg::Order::ATTACK;
+std::map<transport::Address, unsigned int> General::IdsForClients(
+    const ProcessList& processes, const ClientMap& clients) {
+  std::map<transport::Address, unsigned int> ids;
+  for (unsigned int pid = 0; pid < processes.size(); ++pid) {
+    ids.emplace(clients.at(processes[pid])->RemoteAddress(), pid);
   }
-  return msg::Order::RETREAT;
+  return ids;
 }
 
-inline bool Lieutenant::RoundComplete() const {
-  return ids_this_round_.size() == MessagesForRound(processes_.size(), round_);
+Lieutenant::Instance* Lieutenant::InstanceFor(unsigned int instance,
+                                              TimePoint now) {
+  // Instance ids come from the network, so only those this run is deciding
+  // are allowed to allocate state.
+  if (instance >= decisions_.size() || decisions_[instance]) {
+    return nullptr;
+  }
+  heard_ = std::max(heard_, instance + 1);
+  auto& entry = instances_[instance];
+  if (!entry) {
+    entry =
+        std::make_unique<Instance>(processes_.size(), id_, faulty_, slots_);
+    // A new instance is in its first round, which neither of these ends.
+    entry->machine.Suspect(suspected_, now);
+    entry->machine.Convict(evidence_.Convicts(), now);
+  }
+  return entry.get();
 }
 
-udp::ServerAction Lieutenant::ContinueUnlessTimeout() {
-  // Compute the duration between the start of the round and now.
-  const auto now = std::chrono::steady_clock::now();
-  const auto round_dur = std::chrono::duration_cast<std::chrono::microseconds>(
-      now - round_start_ts_);
+transport::ServerAction Lieutenant::Deliver(const transport::Address& from,
+                                            unsigned int pid,
+                                            const msg::Message& msg,
+                                            uint32_t seq, TimePoint now) {
+  if (msg.instance < decisions_.size() && decisions_[msg.instance]) {
+    // The instance has decided, so the message is no longer needed.
+    // Acknowledge it anyway so that its sender stops retrying.
+    SendAck(*server_, from, msg.instance, msg.round, seq);
+    return transport::ServerAction::Continue;
+  }
+  Instance* instance = InstanceFor(msg.instance, now);
+  if (instance == nullptr) {
+    server_->NoteInvalid(from);
+    return transport::ServerAction::Continue;
+  }
+
+  auto& machine = instance->machine;
+  if (machine.DecidesValue() && msg.value != msg::kNoValue &&
+      !payloads_.Has(msg.value) && machine.ValidMessage(msg, pid)) {
+    Hold(from, pid, msg, seq, false, now);
+    return transport::ServerAction::Continue;
+  }
 
-  // If this duration is more than the round timeout, handle the timeout.
-  if (round_dur > kRoundTimeout) {
-    HandleRoundTimeout();
+  auto reaction = machine.Receive(pid, msg, now);
+  if (reaction.ack) {
+    SendAck(*server_, from, msg.instance, msg.round, seq);
+  } else {
+    server_->NoteInvalid(from);
+  }
+  if (Apply(msg.instance, reaction.step) == transport::ServerAction::Stop) {
+    return transport::ServerAction::Stop;
   }
-  return udp::ServerAction::Continue;
+  return Convict(reaction.offender, reaction.offense, now);
 }
 
-udp::ServerAction Lieutenant::HandleRoundTimeout() {
-  if (FirstRound()) {
-    // We can't timeout in the first round. Just continue to wait.
-    return udp::ServerAction::Continue;
+void Lieutenant::DeliverProof(const transport::Address& from,
+                              unsigned int pid, const msg::Message& proof,
+                              uint32_t seq, TimePoint now) {
+  if (proof.instance < decisions_.size() && decisions_[proof.instance]) {
+    SendAck(*server_, from, proof.instance, proof.round, seq);
+    return;
+  }
+  Instance* instance = InstanceFor(proof.instance, now);
+  if (instance == nullptr) {
+    server_->NoteInvalid(from);
+    return;
   }
 
-  logging::out << "Timeout in round " << round_ << "\n";
-  return MoveToNewRoundOrStop();
+  auto& machine = instance->machine;
+  if (machine.DecidesValue() && proof.value != msg::kNoValue &&
+      !payloads_.Has(proof.value) && !proof.ids.empty() &&
+      !machine.Malformed(proof, proof.ids.back())) {
+    Hold(from, pid, proof, seq, true, now);
+    return;
+  }
+  if (machine.AddProof(proof)) {
+    SendAck(*server_, from, proof.instance, proof.round, seq);
+  } else {
+    server_->NoteInvalid(from);
+  }
 }
 
-udp::ServerAction Lieutenant::MoveToNewRoundOrStop() {
-  if (LastRound()) {
-    ClearSenders();
-    return udp::ServerAction::Stop;
+void Lieutenant::Hold(const transport::Address& from, unsigned int pid,
+                      const msg::Message& msg, uint32_t seq, bool proof,
+                      TimePoint now) {
+  LOG(Debug, "Holding ", msg, " until its payload arrives");
+  Fetching& fetching = fetching_[msg.value];
+  // Retransmissions replace the sequence number to acknowledge.
+  auto held = fetching.held.emplace(std::make_pair(pid, msg),
+                                    Held{from, pid, seq, proof});
+  held.first->second.seq = seq;
+  // The sender of a proof holds the payload, though it is not on its path.
+  std::vector<unsigned int> peers = msg.ids;
+  peers.push_back(pid);
+  for (auto it = peers.rbegin(); it != peers.rend(); ++it) {
+    if (std::find(fetching.peers.begin(), fetching.peers.end(), *it) ==
+        fetching.peers.end()) {
+      fetching.peers.push_back(*it);
+    }
+  }
+  if (fetching.last_fetch == TimePoint{}) {
+    Fetch(msg.value, fetching, now);
   }
-  InitNewRound();
-  return udp::ServerAction::Continue;
 }
 
-void Lieutenant::ClearSenders() {
-  sender_threads_this_round_.JoinAll();
-  sender_threads_this_round_.Clear();
+void Lieutenant::Fetch(const msg::Digest& digest, Fetching& fetching,
+                       TimePoint now) {
+  const auto missing = payloads_.Missing(digest);
+  const unsigned int pid =
+      fetching.peers[fetching.next_peer++ % fetching.peers.size()];
+  LOG(Debug, "Fetching ", missing.second, " chunks of ",
+      msg::DigestString(digest), " from p", pid);
+  msg::Fetch fetch = payload::MakeFetch(digest, missing.first, missing.second);
+  server_->Send(ClientForId(pid)->RemoteAddress(),
+                reinterpret_cast<char*>(&fetch), sizeof(fetch));
+  FetchesSent().Add();
+  fetching.requested_end = missing.first + missing.second;
+  fetching.last_fetch = now;
 }
 
-void Lieutenant::InitNewRound() {
-  ClearSenders();
-  IncrementRound();
+transport::ServerAction Lieutenant::AddChunk(const payload::ChunkView& chunk,
+                                             TimePoint now) {
+  const bool complete = payloads_.AddChunk(chunk);
+  auto it = fetching_.find(chunk.digest);
+  if (it == fetching_.end()) {
+    return transport::ServerAction::Continue;
+  }
+  if (!complete) {
+    // Ask the same peer for the next chunks as soon as the last ones
+    // requested arrive, so that large payloads are fetched in a pipeline.
+    if (chunk.index + 1 == it->second.requested_end) {
+      it->second.next_peer--;
+      Fetch(chunk.digest, it->second, now);
+    }
+    return transport::ServerAction::Continue;
+  }
 
-  // Determine the set of messages to forward in the next round.
-  std::unordered_map<unsigned int, std::vector<msg::Message>> toSend;
-  for (msg::Message msg : msgs_this_round_) {
-    if (msg.round != round_ - 1) {
-      throw std::logic_error(
-          "message in msgs_this_round_ not from current round");
+  // The payload is complete, so the held messages can be delivered.
+  auto held = std::move(it->second.held);
+  fetching_.erase(it);
+  auto action = transport::ServerAction::Continue;
+  for (auto const& entry : held) {
+    if (entry.second.proof) {
+      DeliverProof(entry.second.from, entry.second.pid, entry.first.second,
+                   entry.second.seq, now);
+    } else if (Deliver(entry.second.from, entry.second.pid,
+                       entry.first.second, entry.second.seq,
+                       now) == transport::ServerAction::Stop) {
+      action = transport::ServerAction::Stop;
     }
+  }
+  return action;
+}
 
-    // Update the messages round number to the current round.
-    msg.round = round_;
+void Lieutenant::RetryFetches(TimePoint now) {
+  for (auto it = fetching_.begin(); it != fetching_.end();) {
+    auto& held = it->second.held;
+    for (auto h = held.begin(); h != held.end();) {
+      if (decisions_[h->first.second.instance]) {
+        h = held.erase(h);
+      } else {
+        ++h;
+      }
+    }
+    if (held.empty()) {
+      it = fetching_.erase(it);
+      continue;
+    }
+    if (now - it->second.last_fetch >= payload::kFetchTimeout) {
+      Fetch(it->first, it->second, now);
+    }
+    ++it;
+  }
+}
+
+transport::ServerAction Lieutenant::Apply(unsigned int instance, Step step) {
+  switch (step) {
+    case Step::NewRound:
+      StartSenders(*instances_.at(instance));
+      return transport::ServerAction::Continue;
+    case Step::Done: {
+      // Leave the instance's senders running until their acks arrive, but
+      // free its round state.
+      auto it = instances_.find(instance);
+      decisions_[instance] = it->second->machine.Decision();
+      value_decisions_[instance] = it->second->machine.ValueDecision();
+      last_sent_[instance] = std::move(it->second->sent);
+      last_proofs_[instance] = it->second->machine.Proofs();
+      reported_rounds_.erase(instance);
+      if (it->second->senders.joinable()) it->second->senders.detach();
+      instances_.erase(it);
+      return --undecided_ == 0 ? transport::ServerAction::Stop
+                               : transport::ServerAction::Continue;
+    }
+    default:
+      return transport::ServerAction::Continue;
+  }
+}
+
+transport::ServerAction Lieutenant::PollAll(TimePoint now) {
+  RetryFetches(now);
+  RequestCatchUps(now);
+  if (UpdateSuspects(now) == transport::ServerAction::Stop) {
+    return transport::ServerAction::Stop;
+  }
+  std::vector<unsigned int> expired;
+  for (auto const& entry : instances_) {
+    if (now > entry.second->machine.RoundDeadline()) {
+      expired.push_back(entry.first);
+    }
+  }
+  auto action = transport::ServerAction::Continue;
+  for (auto id : expired) {
+    action = Apply(id, instances_.at(id)->machine.Poll(now));
+  }
+  return action;
+}
 
-    // Add this process in at the end of the message id list.
-    msg.ids.push_back(id_);
+void Lieutenant::SendHeartbeats() {
+  if (!ShouldSendMsg()) {
+    return;
+  }
+  msg::Heartbeat heartbeat = {};
+  heartbeat.type = htonl(kHeartbeatType);
+  heartbeat.size = htonl(sizeof(heartbeat));
+  const char* buf = reinterpret_cast<const char*>(&heartbeat);
+  // The commander relays nothing, so it neither sends nor needs heartbeats.
+  for (unsigned int pid = 1; pid < processes_.size(); ++pid) {
+    if (pid != id_) ClientForId(pid)->Send(buf, sizeof(heartbeat));
+  }
+}
+
+transport::ServerAction Lieutenant::UpdateSuspects(TimePoint now) {
+  bool changed = false;
+  for (unsigned int pid = 1; pid < processes_.size(); ++pid) {
+    const bool suspected =
+        pid != id_ && now - last_heard_[pid] > kSuspectTimeout;
+    if (suspected != suspected_[pid]) {
+      LOG(Debug, suspected ? "Suspecting p" : "No longer suspecting p", pid);
+      timeline::Instant(suspected ? "suspect" : "trust", now, {{"pid", pid}});
+      suspected_[pid] = suspected;
+      changed = true;
+    }
+  }
+  if (!changed) {
+    return transport::ServerAction::Continue;
+  }
+
+  std::vector<unsigned int> ids;
+  for (auto const& entry : instances_) ids.push_back(entry.first);
+  auto action = transport::ServerAction::Continue;
+  for (auto id : ids) {
+    if (Apply(id, instances_.at(id)->machine.Suspect(suspected_, now)) ==
+        transport::ServerAction::Stop) {
+      action = transport::ServerAction::Stop;
+    }
+  }
+  return action;
+}
 
-    // Determine which processes we need to send this message to.
+transport::ServerAction Lieutenant::Convict(unsigned int pid,
+                                            evidence::Offense offense,
+                                            TimePoint now) {
+  if (!evidence_.Record(pid, offense)) {
+    return transport::ServerAction::Continue;
+  }
+  timeline::Instant("convict", now, {{"pid", pid}});
+
+  std::vector<unsigned int> ids;
+  for (auto const& entry : instances_) ids.push_back(entry.first);
+  auto action = transport::ServerAction::Continue;
+  for (auto id : ids) {
+    auto& machine = instances_.at(id)->machine;
+    if (Apply(id, machine.Convict(evidence_.Convicts(), now)) ==
+        transport::ServerAction::Stop) {
+      action = transport::ServerAction::Stop;
+    }
+  }
+  return action;
+}
+
+void Lieutenant::RequestCatchUps(TimePoint now) {
+  if (now - last_catch_up_ < kCatchUpInterval) {
+    return;
+  }
+  last_catch_up_ = now;
+
+  // The first round never times out, so an instance that missed it would wait
+  // in it for good. Asking is cheap, and the answers tell whether the rest of
+  // the cluster has moved on.
+  msg::CatchUp request = {};
+  request.type = htonl(kCatchUpType);
+  request.size = htonl(sizeof(request));
+  const char* buf = reinterpret_cast<const char*>(&request);
+  for (unsigned int i = 0; i < std::min<size_t>(heard_, decisions_.size());
+       ++i) {
+    auto it = instances_.find(i);
+    const bool begun = it != instances_.end();
+    if (decisions_[i] || (begun && it->second->machine.Round() > 0)) {
+      continue;
+    }
+    LOG(Debug, "Asking to catch up in instance ", i);
+    CatchUpRequestsSent().Add();
+    request.instance = htonl(i);
     for (unsigned int pid = 0; pid < processes_.size(); ++pid) {
-      // Only send to processes not already in this message.
-      bool inMsg = false;
-      for (auto const& id : msg.ids) {
-        if (id == pid) {
-          inMsg = true;
-          break;
+      if (pid != id_) ClientForId(pid)->Send(buf, sizeof(request));
+    }
+  }
+}
+
+void Lieutenant::AnswerCatchUp(const transport::Address& from,
+                               unsigned int pid, unsigned int instance) {
+  // Processes proven faulty are not relayed to, so nothing is sent again.
+  if (instance >= decisions_.size() || evidence_.Convicted(pid) ||
+      !ShouldSendMsg()) {
+    return;
+  }
+  // The process repeats its request until it catches up, so one answer at a
+  // time is enough.
+  const auto request = std::make_pair(pid, instance);
+  {
+    std::lock_guard<std::mutex> lock(senders_mu_);
+    if (answering_.count(request) > 0) {
+      return;
+    }
+  }
+  unsigned int round = 0;
+  const std::vector<msg::Message>* seen = nullptr;
+  std::vector<msg::Message> msgs;
+  if (decisions_[instance]) {
+    round = faulty_ + 1;
+    auto it = last_sent_.find(instance);
+    if (it != last_sent_.end()) msgs = it->second[pid];
+    auto proofs = last_proofs_.find(instance);
+    if (proofs != last_proofs_.end()) seen = &proofs->second;
+  } else {
+    auto it = instances_.find(instance);
+    if (it != instances_.end()) {
+      round = it->second->machine.Round();
+      msgs = it->second->sent[pid];
+      seen = &it->second->machine.Proofs();
+    }
+  }
+  // The process relayed the proofs whose paths run through it, so it has seen
+  // their orders already.
+  std::vector<msg::Message> proofs;
+  if (seen != nullptr) {
+    for (auto const& proof : *seen) {
+      if (std::find(proof.ids.begin(), proof.ids.end(), pid) ==
+          proof.ids.end()) {
+        proofs.push_back(proof);
+      }
+    }
+  }
+
+  msg::RoundReport report = {};
+  report.type = htonl(kRoundReportType);
+  report.size = htonl(sizeof(report));
+  report.instance = htonl(instance);
+  report.round = htonl(round);
+  if (proofs.empty()) {
+    server_->Send(from, reinterpret_cast<const char*>(&report),
+                  sizeof(report));
+    if (msgs.empty()) {
+      return;
+    }
+  }
+
+  // Send the proofs and the round's messages again on a thread of their own.
+  // The report waits for the proofs, so that the process has them by the time
+  // it catches up and its new round's relays mask what it missed. The
+  // messages are accepted once the process has caught up, which takes the
+  // reports of more than faulty processes, so the first attempts may go
+  // unacknowledged.
+  {
+    std::lock_guard<std::mutex> lock(senders_mu_);
+    answering_.insert(request);
+    running_senders_++;
+  }
+  std::thread([this, pid, request, report, proofs = std::move(proofs),
+               msgs = std::move(msgs)] {
+    timeline::NameThread("catch up p" + std::to_string(pid));
+    transport::ClientPtr client = ClientForId(pid);
+    try {
+      for (auto const& proof : proofs) {
+        SendProof(client, proof);
+      }
+      if (!proofs.empty()) {
+        client->Send(reinterpret_cast<const char*>(&report), sizeof(report));
+      }
+      for (auto const& msg : msgs) {
+        SendMessage(client, msg);
+      }
+    } catch (const net::SendException& e) {
+      // The process asks again if it still needs an answer.
+      LOG(Warning, "Could not answer p", pid,
+          " to catch up: ", std::string(e.what()));
+    }
+    std::lock_guard<std::mutex> lock(senders_mu_);
+    answering_.erase(request);
+    if (--running_senders_ == 0) senders_cv_.notify_all();
+  }).detach();
+}
+
+transport::ServerAction Lieutenant::AddRoundReport(unsigned int pid,
+                                                   unsigned int instance,
+                                                   unsigned int round,
+                                                   TimePoint now) {
+  if (instance >= decisions_.size() || decisions_[instance]) {
+    return transport::ServerAction::Continue;
+  }
+  auto it = instances_.find(instance);
+  if (it != instances_.end() && it->second->machine.Round() > 0) {
+    return transport::ServerAction::Continue;
+  }
+  auto& rounds = reported_rounds_[instance];
+  rounds[pid] = round;
+  if (rounds.size() <= faulty_) {
+    return transport::ServerAction::Continue;
+  }
+
+  // Faulty processes can report any round, so only trust a round once more
+  // than faulty processes have reached it.
+  std::vector<unsigned int> reached;
+  for (auto const& entry : rounds) reached.push_back(entry.second);
+  std::nth_element(reached.begin(), reached.begin() + faulty_, reached.end(),
+                   std::greater<unsigned int>());
+  const unsigned int target = reached[faulty_];
+  if (target == 0) {
+    return transport::ServerAction::Continue;
+  }
+  reported_rounds_.erase(instance);
+  auto& machine = InstanceFor(instance, now)->machine;
+  return Apply(instance, machine.CatchUp(target, now));
+}
+
+void Lieutenant::StartSenders(Instance& instance) {
+  // For each process that we have messages to send to...
+  std::vector<std::pair<unsigned int, std::vector<msg::Message>>> batches;
+  auto const& outbox = instance.machine.Outbox();
+  for (unsigned int pid = 0; pid < outbox.size(); ++pid) {
+    std::vector<msg::Message> batch;
+    for (auto const& msg : outbox[pid]) {
+      if (ShouldSendMsg()) {
+        LOG(Debug, "Sending  ", msg, " to p", pid);
+        batch.push_back(msg);
+      }
+    }
+    instance.sent[pid] = batch;
+    if (!batch.empty()) {
+      batches.emplace_back(pid, std::move(batch));
+    }
+  }
+
+  const unsigned int round = instance.machine.Round();
+  std::thread previous = std::move(instance.senders);
+  {
+    std::lock_guard<std::mutex> lock(senders_mu_);
+    running_senders_++;
+  }
+  instance.senders = std::thread(
+      [this, round, batches = std::move(batches),
+       previous = std::move(previous)]() mutable {
+        if (previous.joinable()) {
+          timeline::Span span("ClearSenders", {{"round", round - 1}});
+          previous.join();
+        }
+
+        threadutil::ThreadGroup senders;
+        for (auto const& entry : batches) {
+          const unsigned int pid = entry.first;
+          const auto& batch = entry.second;
+          senders.AddThread([this, pid, &batch, round] {
+            timeline::NameThread("sender p" + std::to_string(pid) +
+                                 " round " + std::to_string(round));
+            // Send each message to the process serially in a new thread.
+            transport::ClientPtr client = ClientForId(pid);
+            for (auto const& msg : batch) {
+              MaybeDelaySend();
+              SendMessage(client, msg);
+            }
+          });
+        }
+        senders.JoinAll();
+
+        // Notify with the lock held, since DecideInstances may return as
+        // soon as it is released.
+        std::lock_guard<std::mutex> lock(senders_mu_);
+        if (--running_senders_ == 0) senders_cv_.notify_all();
+      });
+}
+
+namespace {
+
+// The most messages a Participant stashes for later rounds of one instance,
+// so that peers cannot exhaust memory with messages far ahead.
+const size_t kMaxEarlyMessages = 4096;
+
+// How often a Participant checks its shared round clock while no datagrams
+// arrive. Every process must leave a round at close to the same time, so the
+// clock is checked far more often than the round timeout.
+const auto kParticipantTick = std::chrono::milliseconds{10};
+
+// The round timeout of a Participant's machines, long enough that they never
+// time out on their own, since their rounds follow the shared round clock.
+// Comparisons with a maximal duration would overflow.
+const auto kMachineTimeout = std::chrono::hours{24 * 365};
+
+}  // namespace
+
+std::vector<msg::Orders> Participant::DecideInstances(unsigned int instances,
+                                                      unsigned int in_flight) {
+  static metrics::Histogram& latency = DecideLatency("participant");
+  const size_t process_num = processes_.size();
+  if (instances != process_num) {
+    throw std::invalid_argument(
+        "interactive consistency runs one instance per process");
+  }
+  const auto start = std::chrono::steady_clock::now();
+  timeline::Span span("Decide", {{"instances", instances}});
+
+  machines_.clear();
+  for (unsigned int k = 0; k < process_num; ++k) {
+    machines_.push_back(k == id_ ? nullptr
+                                 : std::make_unique<LieutenantMachine>(
+                                       process_num, ForInstance(k, id_),
+                                       faulty_, kMachineTimeout));
+    if (machines_.back()) {
+      machines_.back()->Convict(ConvictsForInstance(evidence_, k), start);
+    }
+  }
+  decisions_.assign(process_num, {});
+  decisions_[id_] = msg::Orders(1, order_);
+  undecided_ = process_num - 1;
+  early_.assign(process_num, {});
+  pending_.clear();
+  senders_.clear();
+  senders_.resize(process_num);
+  sent_round_ = 0;
+  round_start_ = start;
+
+  // Our own instance only has its first round, which is sent right away.
+  auto& first = pending_[0];
+  first.resize(process_num);
+  for (unsigned int pid = 0; pid < process_num; ++pid) {
+    if (pid != id_ && ShouldSendMsg()) {
+      msg::Message msg{0, msg::Orders(1, OrderForMsg(order_)), {id_}, id_};
+      LOG(Debug, "Sending  ", msg, " to p", pid);
+      first[pid].push_back(msg);
+    }
+  }
+  SendRound(0);
+
+  if (undecided_ > 0) {
+    server_->Listen(
+        // Called on all incoming Bundles.
+        [this](const transport::Address& from, char* buf, size_t n) {
+          const auto now = std::chrono::steady_clock::now();
+          auto pid = ids_.find(from);
+          auto msgs = BundleFromBuf(buf, n);
+          if (!msgs || pid == ids_.end()) {
+            // If the bundle was not usable, only check for round timeouts.
+            if (pid != ids_.end()) server_->NoteInvalid(from);
+            return Advance(now);
+          }
+          if (auto ack = AckForMessage(buf, n)) {
+            server_->Send(from, ack->data(), ack->size());
+          }
+          for (auto const& msg : *msgs) {
+            Receive(pid->second, msg, now);
+          }
+          return Advance(now);
+        },
+        // Called on socket timeout, or every tick.
+        [this]() { return Advance(std::chrono::steady_clock::now()); },
+        kParticipantTick);
+  }
+
+  // Wait for the last acknowledgements to every process.
+  for (auto& sender : senders_) {
+    if (sender.joinable()) sender.join();
+  }
+
+  latency.Record(std::chrono::steady_clock::now() - start);
+  std::vector<msg::Orders> decisions;
+  for (auto const& decision : decisions_) decisions.push_back(*decision);
+  return decisions;
+}
+
+void Participant::Receive(unsigned int pid, const msg::Message& msg,
+                          TimePoint now) {
+  const unsigned int k = msg.instance;
+  if (k >= machines_.size() || !machines_[k]) {
+    server_->NoteInvalid(ClientForId(pid)->RemoteAddress());
+    return;
+  }
+  if (decisions_[k]) {
+    // The instance has decided, so the message is no longer needed.
+    return;
+  }
+
+  auto& machine = *machines_[k];
+  const msg::Message vmsg = SwapIds(msg, k);
+  const unsigned int vpid = ForInstance(k, pid);
+  if (vmsg.round < machine.Round()) {
+    // The instance already moved past the round, like after skipping a
+    // first round whose order arrived late.
+    return;
+  }
+  if (vmsg.round > machine.Round()) {
+    // Peers send a round once every instance reaches it, so one of ours may
+    // still be behind. Hold the message until it gets there.
+    if (vmsg.round <= faulty_ + 1 && early_[k].size() < kMaxEarlyMessages) {
+      early_[k].emplace(vpid, vmsg);
+    }
+    return;
+  }
+
+  auto reaction = machine.Receive(vpid, vmsg, now);
+  if (!reaction.ack) {
+    server_->NoteInvalid(ClientForId(pid)->RemoteAddress());
+  }
+  Apply(k, reaction.step, now);
+  Convict(ForInstance(k, reaction.offender), reaction.offense, now);
+}
+
+void Participant::Apply(unsigned int instance, Step step, TimePoint now) {
+  auto& machine = *machines_[instance];
+  switch (step) {
+    case Step::NewRound: {
+      // Queue the messages of the round, with the ids they have outside of
+      // the instance, until every instance reaches it.
+      auto& round = pending_[machine.Round()];
+      round.resize(processes_.size());
+      auto const& outbox = machine.Outbox();
+      for (unsigned int vpid = 0; vpid < outbox.size(); ++vpid) {
+        const unsigned int pid = ForInstance(instance, vpid);
+        for (auto const& msg : outbox[vpid]) {
+          if (ShouldSendMsg()) {
+            msg::Message real = SwapIds(msg, instance);
+            LOG(Debug, "Sending  ", real, " to p", pid);
+            round[pid].push_back(std::move(real));
+          }
+        }
+      }
+
+      // Handle the messages that arrived early for the round.
+      auto& early = early_[instance];
+      std::vector<std::pair<unsigned int, msg::Message>> ready;
+      for (auto it = early.begin(); it != early.end();) {
+        if (it->second.round <= machine.Round()) {
+          ready.push_back(*it);
+          it = early.erase(it);
+        } else {
+          ++it;
         }
       }
-      if (!inMsg) {
-        if (ShouldSendMsg()) {
-          logging::out << "Sending  " << msg << " to p" << pid << "\n";
-          toSend[pid].push_back(msg);
+      for (auto const& entry : ready) {
+        if (decisions_[instance] ||
+            entry.second.round != machine.Round()) {
+          continue;
         }
+        auto reaction = machine.Receive(entry.first, entry.second, now);
+        Apply(instance, reaction.step, now);
+        Convict(ForInstance(instance, reaction.offender), reaction.offense,
+                now);
       }
+      return;
     }
+    case Step::Done:
+      if (!decisions_[instance]) {
+        decisions_[instance] = machine.Decision();
+        early_[instance].clear();
+        undecided_--;
+      }
+      return;
+    default:
+      return;
   }
+}
 
-  // For each process that we have messages to send to...
-  for (auto const& batch : toSend) {
-    sender_threads_this_round_.AddThread([this, batch] {
-      // Send each message to the process serially in a new thread.
-      unsigned int pid = batch.first;
-      udp::ClientPtr client = ClientForId(pid);
-      for (auto const& msg : batch.second) {
+void Participant::Convict(unsigned int pid, evidence::Offense offense,
+                          TimePoint now) {
+  if (!evidence_.Record(pid, offense)) {
+    return;
+  }
+  timeline::Instant("convict", now, {{"pid", pid}});
+  for (unsigned int k = 0; k < machines_.size(); ++k) {
+    if (machines_[k] && !decisions_[k]) {
+      Apply(k, machines_[k]->Convict(ConvictsForInstance(evidence_, k), now),
+            now);
+    }
+  }
+}
+
+transport::ServerAction Participant::Advance(TimePoint now) {
+  // Time out the instances that are still in the last round sent once it has
+  // lasted a round timeout. Every process broadcasts at the start, so an order
+  // that has not arrived by the end of the first round is not coming.
+  if (now - round_start_ > kRoundTimeout) {
+    for (unsigned int k = 0; k < machines_.size(); ++k) {
+      if (!machines_[k] || decisions_[k]) continue;
+      auto& machine = *machines_[k];
+      if (machine.Round() == sent_round_) {
+        Apply(k,
+              sent_round_ == 0 ? machine.SkipFirstRound(now)
+                               : machine.Timeout(now),
+              now);
+      }
+    }
+  }
+
+  // Send every round that every undecided instance has reached.
+  while (sent_round_ < faulty_ + 1) {
+    bool reached = true;
+    for (unsigned int k = 0; k < machines_.size(); ++k) {
+      if (machines_[k] && !decisions_[k] &&
+          machines_[k]->Round() <= sent_round_) {
+        reached = false;
+        break;
+      }
+    }
+    if (!reached) break;
+    SendRound(++sent_round_);
+    round_start_ = now;
+  }
+  return undecided_ == 0 ? transport::ServerAction::Stop
+                         : transport::ServerAction::Continue;
+}
+
+void Participant::SendRound(unsigned int round) {
+  auto it = pending_.find(round);
+  if (it == pending_.end()) {
+    return;
+  }
+  for (unsigned int pid = 0; pid < it->second.size(); ++pid) {
+    if (it->second[pid].empty()) continue;
+    auto bundles = EncodeBundles(it->second[pid], round);
+    std::thread previous = std::move(senders_[pid]);
+    senders_[pid] = std::thread([this, pid, round,
+                                 bundles = std::move(bundles),
+                                 previous = std::move(previous)]() mutable {
+      timeline::NameThread("sender p" + std::to_string(pid) + " round " +
+                           std::to_string(round));
+      if (previous.joinable()) previous.join();
+      // Send each bundle to the process serially.
+      transport::ClientPtr client = ClientForId(pid);
+      for (auto& bundle : bundles) {
         MaybeDelaySend();
-        SendMessage(client, msg);
+        SendBundle(client, bundle);
       }
     });
   }
+  pending_.erase(it);
+}
+
+namespace {
+
+// The most instances a Daemon runs at once. Messages that would begin more
+// are dropped, so that peers cannot exhaust memory with instance ids.
+const size_t kMaxDaemonInstances = 1024;
+
+// The most decisions a Daemon remembers for DecisionOf.
+const size_t kMaxDaemonDecisions = 1 << 16;
 
-  // Clear round-specific containers and reset round start timestamp.
-  ids_this_round_.clear();
-  msgs_this_round_.clear();
-  round_start_ts_ = std::chrono::steady_clock::now();
+// How long a Daemon keeps an instance that has not heard from its commander,
+// like one begun by a message that arrived after the instance decided and was
+// forgotten.
+const auto kDaemonInstanceExpiry = 10 * kRoundTimeout;
+
+// How often a Daemon checks if it should stop while no datagrams arrive.
+const auto kDaemonTick = std::chrono::milliseconds{100};
+
+}  // namespace
+
+std::vector<msg::Orders> Daemon::DecideInstances(unsigned int instances,
+                                                 unsigned int in_flight) {
+  throw std::logic_error("a Daemon decides instances as they are proposed");
 }
 
-bool Lieutenant::ValidMessage(const msg::Message& msg,
-                              const net::Address& from) const {
-  // Invalid if the message is from a later round.
-  if (msg.round > round_) {
+void Daemon::Run() {
+  server_->Listen(
+      // Called on all incoming Byzantine Messages.
+      [this](const transport::Address& from, char* buf, size_t n) {
+        const auto now = std::chrono::steady_clock::now();
+        auto pid = ids_.find(from);
+        auto msg = ByzantineMsgFromBuf(buf, n);
+        if (!msg || pid == ids_.end() || msg->ids.empty()) {
+          if (pid != ids_.end()) server_->NoteInvalid(from);
+        } else {
+          Deliver(from, pid->second, *msg, SeqOfMessage(buf), now);
+        }
+        PollAll(now);
+        return stopping_ ? transport::ServerAction::Stop
+                         : transport::ServerAction::Continue;
+      },
+      // Called on socket timeout, or every tick.
+      [this]() {
+        PollAll(std::chrono::steady_clock::now());
+        return stopping_ ? transport::ServerAction::Stop
+                         : transport::ServerAction::Continue;
+      },
+      kDaemonTick);
+
+  // Wait for the last acknowledgements of every instance.
+  instances_.clear();
+  std::unique_lock<std::mutex> lock(senders_mu_);
+  senders_cv_.wait(lock, [this] { return running_senders_ == 0; });
+}
+
+bool Daemon::Propose(unsigned int instance, msg::Order order) {
+  // The commander decides its own order, which also makes the Daemon ignore
+  // messages of the instance from then on.
+  if (!Decided(instance, msg::Orders(slots_, order))) {
     return false;
   }
-  // Invalid if the message has an incorrect number of ids.
-  if (msg.round + 1 != msg.ids.size()) {
-    return false;
+
+  std::vector<std::pair<unsigned int, msg::Message>> msgs;
+  for (unsigned int pid = 0; pid < processes_.size(); ++pid) {
+    if (pid != id_ && ShouldSendMsg()) {
+      msg::Message msg{0, msg::Orders(slots_, OrderForMsg(order)), {id_},
+                       instance};
+      LOG(Debug, "Sending  ", msg, " to p", pid);
+      msgs.emplace_back(pid, msg);
+    }
   }
-  // Invalid if the first message is not from the General (pid 0);
-  if (msg.ids.at(0) != 0) {
-    return false;
+  StartSender([this, msgs] {
+    threadutil::ThreadGroup senders;
+    for (auto const& entry : msgs) {
+      senders.AddThread([this, entry] {
+        MaybeDelaySend();
+        SendMessage(ClientForId(entry.first), entry.second);
+      });
+    }
+    senders.JoinAll();
+  }).detach();
+  return true;
+}
+
+std::experimental::optional<msg::Order> Daemon::DecisionOf(
+    unsigned int instance) const {
+  std::lock_guard<std::mutex> lock(decisions_mu_);
+  auto it = decisions_.find(instance);
+  if (it == decisions_.end()) {
+    return {};
   }
-  // Invalid if not all ids are unique.
-  std::set<unsigned int> idset;
-  for (auto const& id : msg.ids) {
-    // Invalid if any id is out of bounds.
-    if (id >= processes_.size()) {
+  return it->second.At(0);
+}
+
+bool Daemon::Decided(unsigned int instance, const msg::Orders& decision) {
+  {
+    std::lock_guard<std::mutex> lock(decisions_mu_);
+    if (!decisions_.emplace(instance, decision).second) {
       return false;
     }
-    // Invalid if any id is our id.
-    if (id == id_) {
-      return false;
+    decision_order_.push_back(instance);
+    if (decision_order_.size() > kMaxDaemonDecisions) {
+      decisions_.erase(decision_order_.front());
+      decision_order_.pop_front();
     }
-    idset.insert(id);
   }
-  if (idset.size() < msg.ids.size()) {
-    return false;
+  if (on_decision_) on_decision_(instance, decision);
+  return true;
+}
+
+void Daemon::Deliver(const transport::Address& from, unsigned int pid,
+                     const msg::Message& msg, uint32_t seq, TimePoint now) {
+  if (HasDecided(msg.instance)) {
+    // Acknowledge messages of decided instances so that their senders stop
+    // retrying.
+    SendAck(*server_, from, msg.instance, msg.round, seq);
+    return;
   }
-  // Invalid if the last id does not match the sender. This check will not
-  // be complete for processes on the same host, because we can not know the
-  // sending port of the process, only its receiving port.
-  if (processes_.at(msg.ids.back()).hostname() != from.hostname()) {
-    return false;
+
+  auto it = instances_.find(msg.instance);
+  if (it == instances_.end()) {
+    // Only the commander's own order begins an instance.
+    const unsigned int commander = msg.ids.front();
+    if (msg.round != 0 || commander != pid || commander == id_ ||
+        instances_.size() >= kMaxDaemonInstances) {
+      server_->NoteInvalid(from);
+      return;
+    }
+    it = instances_
+             .emplace(msg.instance,
+                      std::make_unique<Instance>(processes_.size(), id_,
+                                                 faulty_, commander, now))
+             .first;
+    it->second->machine.Convict(ConvictsForInstance(evidence_, commander),
+                                now);
   }
-  return true;
+
+  Instance& instance = *it->second;
+  const unsigned int commander = instance.commander;
+  auto reaction = instance.machine.Receive(ForInstance(commander, pid),
+                                           SwapIds(msg, commander), now);
+  if (reaction.ack) {
+    SendAck(*server_, from, msg.instance, msg.round, seq);
+  } else {
+    server_->NoteInvalid(from);
+  }
+  Apply(msg.instance, reaction.step);
+  Convict(ForInstance(commander, reaction.offender), reaction.offense, now);
+}
+
+void Daemon::Apply(unsigned int instance, Step step) {
+  switch (step) {
+    case Step::NewRound:
+      StartSenders(*instances_.at(instance));
+      return;
+    case Step::Done: {
+      // Leave the instance's senders running until their acks arrive, but
+      // free its round state.
+      auto it = instances_.find(instance);
+      if (it->second->senders.joinable()) it->second->senders.detach();
+      auto decision = it->second->machine.Decision();
+      instances_.erase(it);
+      Decided(instance, decision);
+      return;
+    }
+    default:
+      return;
+  }
+}
+
+void Daemon::Convict(unsigned int pid, evidence::Offense offense,
+                     TimePoint now) {
+  if (!evidence_.Record(pid, offense)) {
+    return;
+  }
+  timeline::Instant("convict", now, {{"pid", pid}});
+  std::vector<unsigned int> ids;
+  for (auto const& entry : instances_) ids.push_back(entry.first);
+  for (auto id : ids) {
+    auto& instance = *instances_.at(id);
+    Apply(id, instance.machine.Convict(
+                  ConvictsForInstance(evidence_, instance.commander), now));
+  }
+}
+
+void Daemon::PollAll(TimePoint now) {
+  std::vector<unsigned int> expired;
+  for (auto it = instances_.begin(); it != instances_.end();) {
+    auto const& machine = it->second->machine;
+    if (machine.Round() == 0 &&
+        now - it->second->started > kDaemonInstanceExpiry) {
+      it = instances_.erase(it);
+      continue;
+    }
+    if (now > machine.RoundDeadline()) {
+      expired.push_back(it->first);
+    }
+    ++it;
+  }
+  for (auto id : expired) {
+    Apply(id, instances_.at(id)->machine.Poll(now));
+  }
+}
+
+void Daemon::StartSenders(Instance& instance) {
+  // For each process that we have messages to send to...
+  std::vector<std::pair<unsigned int, std::vector<msg::Message>>> batches;
+  auto const& outbox = instance.machine.Outbox();
+  for (unsigned int vpid = 0; vpid < outbox.size(); ++vpid) {
+    const unsigned int pid = ForInstance(instance.commander, vpid);
+    std::vector<msg::Message> batch;
+    for (auto const& msg : outbox[vpid]) {
+      if (ShouldSendMsg()) {
+        msg::Message real = SwapIds(msg, instance.commander);
+        LOG(Debug, "Sending  ", real, " to p", pid);
+        batch.push_back(std::move(real));
+      }
+    }
+    if (!batch.empty()) {
+      batches.emplace_back(pid, std::move(batch));
+    }
+  }
+
+  std::thread previous = std::move(instance.senders);
+  instance.senders = StartSender(
+      [this, batches = std::move(batches),
+       previous = std::make_shared<std::thread>(std::move(previous))] {
+        if (previous->joinable()) previous->join();
+        threadutil::ThreadGroup senders;
+        for (auto const& entry : batches) {
+          senders.AddThread([this, &entry] {
+            // Send each message to the process serially in a new thread.
+            transport::ClientPtr client = ClientForId(entry.first);
+            for (auto const& msg : entry.second) {
+              MaybeDelaySend();
+              SendMessage(client, msg);
+            }
+          });
+        }
+        senders.JoinAll();
+      });
+}
+
+std::thread Daemon::StartSender(std::function<void()> send) {
+  {
+    std::lock_guard<std::mutex> lock(senders_mu_);
+    running_senders_++;
+  }
+  return std::thread([this, send] {
+    send();
+    // Notify with the lock held, since Run may return as soon as it is
+    // released.
+    std::lock_guard<std::mutex> lock(senders_mu_);
+    if (--running_senders_ == 0) senders_cv_.notify_all();
+  });
 }
 
 }  // namespace generals
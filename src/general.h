@@ -1,21 +1,39 @@
 #ifndef GENERAL_H_
 #define GENERAL_H_
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <exception>
+#include <functional>
+#include <iomanip>
+#include <iostream>
 #include <experimental/optional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <random>
 #include <set>
+#include <sstream>
 #include <string>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 
+#include "evidence.h"
+#include "lieutenant_machine.h"
 #include "log.h"
 #include "message.h"
+#include "metrics.h"
 #include "net.h"
+#include "payload.h"
+#include "replay_conn.h"
+#include "shm_conn.h"
 #include "thread.h"
+#include "timeline.h"
+#include "transport.h"
 #include "udp_conn.h"
 
 namespace generals {
@@ -23,10 +41,18 @@ namespace generals {
 const auto kAckTimeout = std::chrono::milliseconds{250};
 const auto kRoundTimeout = std::chrono::seconds{1};
 const unsigned int kSendAttempts = 3;
-
-// Determines the maximum number of valid messages that a Lieutenant process
-// should expect in a certain round given a number of initial processes.
-size_t MessagesForRound(size_t process_num, unsigned int round);
+// How long a commander waits for every lieutenant to be listening once a
+// quorum of them is (see General::Rendezvous).
+const auto kRendezvousTimeout = 5 * kRoundTimeout;
+// How long a commander waits for a quorum of lieutenants to be listening
+// before it gives up on deciding.
+const auto kQuorumTimeout = 6 * kRendezvousTimeout;
+// How often lieutenants send heartbeats, and how long one goes unheard before
+// the others suspect it has failed. The timeout spans every attempt of two
+// sends, so that neither a run of lost heartbeats nor a relay still being
+// retransmitted raises a suspicion.
+const auto kHeartbeatInterval = std::chrono::milliseconds{100};
+const auto kSuspectTimeout = 2 * kSendAttempts * kAckTimeout;
 
 // Decodes a msg::Message from the provided buffer. If the decoding is
 // successful, the optional return value will be present. If not, the return
@@ -34,27 +60,130 @@ size_t MessagesForRound(size_t process_num, unsigned int round);
 std::experimental::optional<msg::Message> ByzantineMsgFromBuf(char* buf,
                                                               size_t n);
 
-// Decodes a msg::Ack from the provided buffer and returns its round number. If
-// the decoding is successful, the optional return value will be present. If
+// Decodes a proof (see kProofType) from the provided buffer, like
+// ByzantineMsgFromBuf.
+std::experimental::optional<msg::Message> ProofFromBuf(char* buf, size_t n);
+
+// Returns the sequence number of the msg::ByzantineMessage or proof in the
+// provided buffer, which must already have been decoded.
+uint32_t SeqOfMessage(const char* buf);
+
+// Decodes a msg::Ack from the provided buffer and returns its sequence number.
+// If the decoding is successful, the optional return value will be present. If
 // not, the return value will be absent.
-std::experimental::optional<unsigned int> RoundOfAck(char* buf, size_t n);
+std::experimental::optional<uint32_t> SeqOfAck(const char* buf, size_t n);
+
+// Decodes a msg::Hello from the provided buffer and returns its sequence
+// number. If the buffer does not hold one, the return value will be absent.
+std::experimental::optional<uint32_t> SeqOfHello(const char* buf, size_t n);
+
+// Decodes a msg::CatchUp from the provided buffer and returns its instance. If
+// the buffer does not hold one, the return value will be absent.
+std::experimental::optional<unsigned int> InstanceOfCatchUp(const char* buf,
+                                                            size_t n);
+
+// Decodes a msg::RoundReport from the provided buffer and returns its instance
+// and round. If the buffer does not hold one, the return value will be absent.
+std::experimental::optional<std::pair<unsigned int, unsigned int>>
+RoundReportFromBuf(const char* buf, size_t n);
+
+// Determines if the provided buffer holds a msg::Heartbeat.
+bool IsHeartbeat(const char* buf, size_t n);
+
+// Returns the size of the msg::ByzantineMessage encoding of the message.
+size_t EncodedSize(const msg::Message& msg);
+
+// Returns the most orders a message can batch in a cluster with the provided
+// number of faulty processes, such that every message fits in a datagram.
+size_t MaxSlots(unsigned int faulty);
+
+// Encodes the message with the provided sequence number into buf as a
+// msg::ByzantineMessage, or as a proof if type is kProofType. buf must hold at
+// least EncodedSize(msg) bytes.
+void EncodeMessage(const msg::Message& msg, uint32_t seq, char* buf,
+                   uint32_t type = kByzantineMessageType);
 
 // Sends the message to the client.
-void SendMessage(udp::ClientPtr client, const msg::Message& msg);
+void SendMessage(transport::ClientPtr client, const msg::Message& msg);
+
+// Sends the message to the client as a proof (see kProofType).
+void SendProof(transport::ClientPtr client, const msg::Message& msg);
+
+// Encodes the messages, all sent in the provided round, into as few
+// msg::Bundle datagrams as fit them. The sequence number of each is set when it
+// is sent (see SendBundle).
+std::vector<std::vector<char>> EncodeBundles(
+    const std::vector<msg::Message>& msgs, unsigned int round);
+
+// Decodes the messages of a msg::Bundle from the provided buffer. If the buffer
+// does not hold a well formed Bundle, the return value will be absent.
+std::experimental::optional<std::vector<msg::Message>> BundleFromBuf(char* buf,
+                                                                     size_t n);
+
+// Sends the bundle encoded by EncodeBundles to the client, with a new sequence
+// number, and waits for its acknowledgement.
+void SendBundle(transport::ClientPtr client, std::vector<char>& bundle);
+
+// Maps between the id of a process and its id in an instance commanded by the
+// provided process, where the two are swapped so that the commander is 0 as a
+// LieutenantMachine expects. The mapping is its own inverse.
+inline unsigned int ForInstance(unsigned int commander, unsigned int pid) {
+  return pid == commander ? 0 : pid == 0 ? commander : pid;
+}
+
+// Maps every id of the message, like ForInstance.
+msg::Message SwapIds(msg::Message msg, unsigned int commander);
+
+// Maps the convictions of the ledger, indexed by process id, to the ids of an
+// instance commanded by the provided process, like ForInstance.
+std::vector<bool> ConvictsForInstance(const evidence::Ledger& ledger,
+                                      unsigned int commander);
+
+// Sends an acknowledgement of the message with the provided instance, round and
+// sequence number to the remote address.
+void SendAck(transport::Server& server, const transport::Address& to,
+             unsigned int instance, unsigned int round, uint32_t seq);
 
-// Sends an acknowledgement for the provided round to the client.
-void SendAckForRound(udp::ClientPtr client, unsigned int round);
+// Encodes the acknowledgement of the msg::ByzantineMessage, proof, msg::Bundle
+// or msg::Hello in the provided buffer. If the buffer does not hold one, the
+// return value will be absent.
+std::experimental::optional<std::vector<char>> AckForMessage(const char* buf,
+                                                             size_t n);
 
 // Holds a list of processes participating in the agreement algorithm.
 typedef std::vector<net::Address> ProcessList;
 
-// Holds a mapping from network addresses to UDP clients.
-typedef std::unordered_map<net::Address, udp::ClientPtr, net::AHash>
-    UdpClientMap;
+// Holds a mapping from network addresses to clients.
+typedef std::unordered_map<net::Address, transport::ClientPtr, net::AHash>
+    ClientMap;
+
+// Creates a mapping from network addresses to clients, populated with each
+// process provided. Hostnames are resolved concurrently and every Client sends
+// through the provided server.
+ClientMap ClientsForProcessList(const ProcessList& processes,
+                                std::shared_ptr<transport::Server> server);
+
+// The mechanisms through which Generals can exchange messages.
+enum class Transport {
+  // UDP datagrams through a single socket per process.
+  UDP,
+  // Lock-free rings in shared memory. All processes must be on the same host.
+  SHM,
+};
+
+// Maps a string to a Transport, throwing an exception if the string is
+// invalid.
+Transport StringToTransport(std::string str);
+
+// Creates the server through which the process with the provided id sends and
+// receives all of its messages.
+std::shared_ptr<transport::Server> ServerForProcess(
+    Transport transport, const ProcessList& processes, unsigned int id);
 
-// Creates a mapping from network addresses to UDP clients, populated with each
-// process provided.
-UdpClientMap ClientsForProcessList(const ProcessList& processes);
+// Creates a server that replays the trace at the provided multiple of its
+// recorded pace (0 for as fast as possible), instead of using the network.
+std::shared_ptr<replay::Server> ReplayServer(const std::string& path,
+                                             double speed);
 
 // Represents different types of malicious behavior a traitorous general can
 // exhibit. Individual instances are stored as bit flags by combining individual
@@ -97,33 +226,89 @@ std::string MaliciousBehaviorString(MaliciousBehavior m);
 // Algorithm. Extended by the Commander and Lieutenant classes.
 class General {
  public:
-  General(const ProcessList& processes, unsigned int id, unsigned int faulty,
-          MaliciousBehavior behavior)
+  General(const ProcessList& processes, unsigned int id,
+          std::shared_ptr<transport::Server> server, unsigned int faulty,
+          MaliciousBehavior behavior, size_t slots)
       : processes_(processes),
-        clients_(ClientsForProcessList(processes)),
+        server_(server),
+        clients_(ClientsForProcessList(processes, server_)),
         id_(id),
         faulty_(faulty),
         behavior_(behavior),
-        round_(0) {}
+        slots_(slots),
+        evidence_(processes.size()) {}
 
   virtual ~General() = default;
 
   // Runs the Byzantine Agreement Algorithm and decides on an order by
-  // coordinating with peer processes.
-  virtual msg::Order Decide() = 0;
+  // coordinating with peer processes. Returns the order of the first slot.
+  inline msg::Order Decide() { return DecideInstances(1, 1).front().At(0); }
+
+  // Runs the provided number of independent agreement instances, numbered
+  // from 0, over the same server and returns the decision of each: a batch of
+  // the General's number of slots. Every instance has its own round state, so
+  // they proceed concurrently: the commander keeps up to in_flight instances
+  // running at once, and lieutenants run every instance they hear of until it
+  // decides.
+  virtual std::vector<msg::Orders> DecideInstances(unsigned int instances,
+                                                   unsigned int in_flight) = 0;
+
+  // Runs a single agreement instance on a value, for Generals constructed to
+  // decide one, and returns the payload decided on. The decision is absent if
+  // the lieutenants saw no value from the commander, or more than one.
+  std::experimental::optional<std::string> DecideValue();
+
+  // Prints a table of the quality of the link to every other process. Safe to
+  // call while Decide runs.
+  void PrintLinks(std::ostream& o) const;
 
  protected:
   const ProcessList processes_;
-  const UdpClientMap clients_;
+  // The single endpoint through which the General sends and receives all
+  // messages.
+  const std::shared_ptr<transport::Server> server_;
+  const ClientMap clients_;
   const unsigned int id_;
   const unsigned int faulty_;
   const MaliciousBehavior behavior_;
+  // The number of orders each instance decides on. Each is agreed on
+  // independently, but they share their messages, rounds and validation.
+  // msg::kValueSlots if the General decides on a value instead.
+  const size_t slots_;
+  // The payloads of the values the General has proposed or received.
+  payload::Store payloads_;
+  // The processes proven faulty, which are no longer relayed to. Only used on
+  // the thread that receives messages.
+  evidence::Ledger evidence_;
+
+  inline bool DecidesValue() const { return slots_ == msg::kValueSlots; }
+
+  // Returns the value the General decided on in the instance.
+  virtual msg::Digest DecidedValue(unsigned int instance) const = 0;
+
+  // Sends every chunk of the payload to the client, without waiting for acks.
+  void PushPayload(transport::ClientPtr client, const msg::Digest& digest);
+  // Answers a Fetch with the chunks it asks for, if the payload is complete.
+  void ServeFetch(const transport::Address& to,
+                  const payload::FetchRequest& fetch);
+
+  // Waits until the other processes are listening, so that messages sent
+  // right after are not lost to processes that have yet to start. Each is sent
+  // msg::Hellos until it acknowledges one. Returns once every process has, or
+  // once at least quorum have and kRendezvousTimeout has passed, so that
+  // crashed processes only delay the start. Throws std::runtime_error if fewer
+  // than quorum have once kQuorumTimeout has passed.
+  void Rendezvous(size_t quorum);
 
   // Returns the UDP client for a given process ID.
-  inline udp::ClientPtr ClientForId(unsigned int pid) const {
+  inline transport::ClientPtr ClientForId(unsigned int pid) const {
     return clients_.at(processes_.at(pid));
   }
 
+  // Maps the address of each process in the list to its id.
+  static std::map<transport::Address, unsigned int> IdsForClients(
+      const ProcessList& processes, const ClientMap& clients);
+
   // Determines if the current General exhibits the provided behavior.
   inline bool ExhibitsBehavior(MaliciousBehavior test) const {
     return Exhibits(behavior_, test);
@@ -134,104 +319,400 @@ class General {
   // Possibly delay the send of a message, based on the General's malicious
   // behavior. Blocks synchonously if delaying.
   void MaybeDelaySend();
-
-  unsigned int round_;
-  // Determines if this is the first round of the algorithm.
-  inline bool FirstRound() const { return round_ == 0; }
-  // Determines if this is the last round of the algorithm.
-  inline bool LastRound() const { return round_ == faulty_ + 1; };
-  // Increments the round number.
-  inline void IncrementRound() {
-    round_++;
-    logging::out << "Moving to round " << round_ << "\n";
-  };
+  // Determins the order a General should send for a certain message when it
+  // commands an instance with the provided order, based on its malicious
+  // behavior.
+  msg::Order OrderForMsg(msg::Order order) const;
 };
 
 // A representation of a commander process in the Byzantine Agreement Algorithm.
 class Commander : public General {
  public:
-  Commander(const ProcessList& processes, unsigned int faulty, msg::Order order,
-            MaliciousBehavior behavior)
-      : General(processes, 0, faulty, behavior), order_(order) {}
+  Commander(const ProcessList& processes,
+            std::shared_ptr<transport::Server> server, unsigned int faulty,
+            msg::Order order, MaliciousBehavior behavior, size_t slots = 1)
+      : General(processes, 0, server, faulty, behavior, slots),
+        order_(order),
+        value_(msg::kNoValue),
+        wrong_value_(msg::kNoValue) {}
+  // Proposes the payload as a value instead of an order.
+  Commander(const ProcessList& processes,
+            std::shared_ptr<transport::Server> server, unsigned int faulty,
+            const std::string& value, MaliciousBehavior behavior);
+
+  std::vector<msg::Orders> DecideInstances(unsigned int instances,
+                                           unsigned int in_flight);
 
-  msg::Order Decide();
+ protected:
+  msg::Digest DecidedValue(unsigned int instance) const { return value_; }
 
  private:
   const msg::Order order_;
+  // The value proposed, and the different one a traitor sends instead of it
+  // (see ValueForMsg).
+  const msg::Digest value_;
+  const msg::Digest wrong_value_;
+
+  // Sends the order of the instance in every slot to every lieutenant and
+  // waits for their acknowledgements.
+  void Propose(unsigned int instance);
 
-  // Determins the order a Commander should send for a certain message, based on
-  // the Commander's malicious behavior.
-  msg::Order OrderForMsg() const;
+  // Determines the value a Commander should send, like OrderForMsg.
+  msg::Digest ValueForMsg() const;
 };
 
 // A representation of a lieutenant process in the Byzantine Agreement
-// Algorithm.
+// Algorithm. Runs a LieutenantMachine per agreement instance over the General's
+// transport.
 class Lieutenant : public General {
  public:
   Lieutenant(const ProcessList& processes, unsigned int id,
-             unsigned short server_port, unsigned int faulty,
-             MaliciousBehavior behavior)
-      : General(processes, id, faulty, behavior),
-        server_(server_port, kRoundTimeout) {}
+             std::shared_ptr<transport::Server> server, unsigned int faulty,
+             MaliciousBehavior behavior, size_t slots = 1)
+      : General(processes, id, server, faulty, behavior, slots),
+        ids_(IdsForClients(processes_, clients_)),
+        undecided_(0),
+        running_senders_(0) {}
 
-  msg::Order Decide();
+  std::vector<msg::Orders> DecideInstances(unsigned int instances,
+                                           unsigned int in_flight);
+
+ protected:
+  msg::Digest DecidedValue(unsigned int instance) const {
+    return value_decisions_.at(instance);
+  }
 
  private:
-  const udp::Server server_;
-
-  // The set of unique orders seen orders over the course of the agreement
-  // algorithm.
-  std::set<msg::Order> orders_seen_;
-
-  // Decides what the order should be based on the seen orders over the course
-  // of the agreement algorithm. Defined as follows:
-  //
-  // choice(V) := v        if V = {v}
-  //            | RETREAT  if V = {} or |V| >= 2
-  //
-  inline msg::Order DecideOrder() const;
-
-  // Per-round variables:
-
-  // Timestamp at the begining of the round, used as a backup round timeout
-  // because socket timeouts alone are not sufficient (see
-  // ContinueUnlessTimeout). steady_clock (monotonic) to measure elapsed time
-  // accurately even in the face of clock resets.
-  std::chrono::steady_clock::time_point round_start_ts_;
-  // Contains the set of all unique messages received so far this round.
-  std::set<msg::Message> msgs_this_round_;
-  // Same as msgs_this_round_, except with only the ids so that all messages
-  // with the same process list collide.
-  std::set<std::vector<unsigned int>> ids_this_round_;
-  // Holds the sender threads for the given round.
-  threadutil::ThreadGroup sender_threads_this_round_;
-
-  // Decides if the current round is complete based on the number of messages
-  // received.
-  inline bool RoundComplete() const;
-
-  // Checks if the round has timed out and returns an action accordingly. If the
-  // round has not yet timed out, the server will be told to continue. We need
-  // both a round timeout and a socket timeout so that faulty processes cannot
-  // continue to send messages to reset the socket timeout without ever actually
-  // making forward progress.
-  udp::ServerAction ContinueUnlessTimeout();
-  // Handles a round timeout, moving to the next round if necessary.
-  udp::ServerAction HandleRoundTimeout();
-  // Handles moving to the next round, unless this is as already the last round.
-  udp::ServerAction MoveToNewRoundOrStop();
-
-  // Waits for all sender threads to drain and terminate before clearing the
-  // sender_threads_this_round_ vector.
-  void ClearSenders();
-  // Handles a new round by setting up per-round variables and launching threads
-  // (senders) to send round related messages.
-  void InitNewRound();
-
-  // Validates that the message makes sense in the current context of the
-  // algorithm and verifies that it is properly formatted. This protects against
-  // malicious messages.
-  bool ValidMessage(const msg::Message& msg, const net::Address& from) const;
+  // An agreement instance that has begun but not yet decided.
+  struct Instance {
+    Instance(size_t process_num, unsigned int id, unsigned int faulty,
+             size_t slots)
+        : machine(process_num, id, faulty, kRoundTimeout, slots),
+          sent(process_num) {}
+    ~Instance() {
+      if (senders.joinable()) senders.join();
+    }
+
+    LieutenantMachine machine;
+    // Sends the messages of the latest round, once those of the previous
+    // round are done.
+    std::thread senders;
+    // The messages of the latest round, by destination, kept to send again to
+    // processes that ask to catch up.
+    std::vector<std::vector<msg::Message>> sent;
+  };
+
+  // Maps the address of each process to its id.
+  const std::map<transport::Address, unsigned int> ids_;
+  // The instances in progress, by instance id. An instance begins when its
+  // first message arrives.
+  std::map<unsigned int, std::unique_ptr<Instance>> instances_;
+  // The decision of every instance, present once it is made.
+  std::vector<std::experimental::optional<msg::Orders>> decisions_;
+  std::vector<msg::Digest> value_decisions_;
+  unsigned int undecided_;
+  // One past the highest instance heard of. Instances below it that have not
+  // begun have been proposed, so their first round may have been missed.
+  unsigned int heard_;
+  // The messages of the last round of each decided instance, by destination,
+  // to answer requests to catch up after the instance decided.
+  std::map<unsigned int, std::vector<std::vector<msg::Message>>> last_sent_;
+  // The proofs of the orders or values seen in each decided instance (see
+  // LieutenantMachine::Proofs), for the same requests.
+  std::map<unsigned int, std::vector<msg::Message>> last_proofs_;
+  // When anything last arrived from each process, heartbeats or otherwise,
+  // and which of them are suspected to have failed because nothing has for
+  // kSuspectTimeout.
+  std::vector<TimePoint> last_heard_;
+  std::vector<bool> suspected_;
+  // The round each other process reported for the instances that missed
+  // their first round, and when they were last asked.
+  std::map<unsigned int, std::map<unsigned int, unsigned int>> reported_rounds_;
+  TimePoint last_catch_up_;
+  // Counts the sender threads that are running, including those of decided
+  // instances, which are detached and may still be waiting on acks.
+  std::mutex senders_mu_;
+  std::condition_variable senders_cv_;
+  unsigned int running_senders_;
+  // The process and instance of every request to catch up whose answer is
+  // still being sent. Repeats of them are dropped until it is done.
+  std::set<std::pair<unsigned int, unsigned int>> answering_;
+
+  // A message or proof whose value's payload is not complete yet. It is held
+  // back, unacknowledged, until the payload arrives, so that a lieutenant
+  // never accepts a value it cannot hand to others.
+  struct Held {
+    transport::Address from;
+    unsigned int pid;
+    uint32_t seq;
+    bool proof;
+  };
+  // A payload being fetched for held messages.
+  struct Fetching {
+    // The held messages by sender, which tells a proof from the relay of the
+    // same message.
+    std::map<std::pair<unsigned int, msg::Message>, Held> held;
+    // The processes that sent or relayed the value and so should hold its
+    // payload, in the order to ask them: the latest first.
+    std::vector<unsigned int> peers;
+    size_t next_peer = 0;
+    // The end of the chunks last requested, and when.
+    size_t requested_end = 0;
+    TimePoint last_fetch;
+  };
+  std::map<msg::Digest, Fetching> fetching_;
+
+  // Returns the instance with the provided id, beginning it if needed. Returns
+  // nullptr if the instance has already decided or is out of range.
+  Instance* InstanceFor(unsigned int instance, TimePoint now);
+
+  // Hands the message to the machine of its instance and acknowledges it if
+  // it is valid, or holds it until its payload arrives. Returns how the server
+  // should proceed.
+  transport::ServerAction Deliver(const transport::Address& from,
+                                  unsigned int pid, const msg::Message& msg,
+                                  uint32_t seq, TimePoint now);
+  // Hands the proof (see kProofType) to the machine of its instance and
+  // acknowledges it if it is well-formed, or holds it until its payload
+  // arrives.
+  void DeliverProof(const transport::Address& from, unsigned int pid,
+                    const msg::Message& proof, uint32_t seq, TimePoint now);
+  // Holds the message or proof until the payload of its value arrives,
+  // fetching the payload from the processes that sent or relayed it.
+  void Hold(const transport::Address& from, unsigned int pid,
+            const msg::Message& msg, uint32_t seq, bool proof, TimePoint now);
+  // Asks the next peer for the missing chunks of the payload.
+  void Fetch(const msg::Digest& digest, Fetching& fetching, TimePoint now);
+  // Adds a received chunk, delivering the messages held for its payload once
+  // it is complete.
+  transport::ServerAction AddChunk(const payload::ChunkView& chunk,
+                                   TimePoint now);
+  // Fetches again every payload whose last fetch timed out, and drops held
+  // messages of instances that have decided.
+  void RetryFetches(TimePoint now);
+
+  // Sends a heartbeat to every other lieutenant.
+  void SendHeartbeats();
+  // Updates the processes suspected to have failed, and hands any change to
+  // the machine of every instance. Returns how the server should proceed.
+  transport::ServerAction UpdateSuspects(TimePoint now);
+  // Records the offense of the process, and hands a new conviction to the
+  // machine of every instance. Returns how the server should proceed.
+  transport::ServerAction Convict(unsigned int pid, evidence::Offense offense,
+                                  TimePoint now);
+
+  // Asks every other process for the round of each instance that is still in
+  // its first round, in case it was missed, every kCatchUpInterval.
+  void RequestCatchUps(TimePoint now);
+  // Answers a request to catch up in the instance with the proofs of what it
+  // has seen and the round it is in, and sends the messages of that round to
+  // the process again.
+  void AnswerCatchUp(const transport::Address& from, unsigned int pid,
+                     unsigned int instance);
+  // Records the round the process reported for the instance, and jumps to the
+  // highest round that more than faulty processes have reached, which at
+  // least one correct process has.
+  transport::ServerAction AddRoundReport(unsigned int pid,
+                                         unsigned int instance,
+                                         unsigned int round, TimePoint now);
+
+  // Carries out the step the instance's machine took, returning how the
+  // server should proceed.
+  transport::ServerAction Apply(unsigned int instance, Step step);
+  // Checks every instance in progress for a round timeout, and retries
+  // overdue fetches.
+  transport::ServerAction PollAll(TimePoint now);
+
+  // Launches threads (senders) to send the messages of the round that just
+  // began, once the previous round's senders are done. Never blocks, so one
+  // instance waiting on acks does not hold up the others.
+  void StartSenders(Instance& instance);
+};
+
+// A process in interactive consistency, where every process broadcasts its own
+// order and all of them agree on the vector of orders. The broadcast of each
+// process is an agreement instance numbered by its id: the Participant
+// commands its own instance and runs a LieutenantMachine in every other one,
+// in which the ids of the commander and of process 0 are swapped so that the
+// commander is 0 as usual. Every instance shares one round clock: the messages
+// of a round are sent once every instance has reached it, and those to the
+// same process are coalesced into msg::Bundles.
+class Participant : public General {
+ public:
+  Participant(const ProcessList& processes, unsigned int id,
+              std::shared_ptr<transport::Server> server, unsigned int faulty,
+              msg::Order order, MaliciousBehavior behavior)
+      : General(processes, id, server, faulty, behavior, 1),
+        order_(order),
+        ids_(IdsForClients(processes_, clients_)),
+        undecided_(0),
+        sent_round_(0) {}
+
+  // Runs the broadcast of every process and returns the agreed vector,
+  // indexed by process id. instances must be the number of processes, and
+  // in_flight is ignored, since every broadcast runs at once.
+  std::vector<msg::Orders> DecideInstances(unsigned int instances,
+                                           unsigned int in_flight);
+
+ protected:
+  msg::Digest DecidedValue(unsigned int instance) const {
+    return msg::kNoValue;
+  }
+
+ private:
+  const msg::Order order_;
+  // Maps the address of each process to its id.
+  const std::map<transport::Address, unsigned int> ids_;
+  // The machine of every instance, by the id of its commander. Null for the
+  // Participant's own instance.
+  std::vector<std::unique_ptr<LieutenantMachine>> machines_;
+  std::vector<std::experimental::optional<msg::Orders>> decisions_;
+  unsigned int undecided_;
+  // Messages, with the id of their sender, that arrived for a later round
+  // than their instance is in. Handled once the instance gets there.
+  std::vector<std::set<std::pair<unsigned int, msg::Message>>> early_;
+  // The messages of each round that have not been sent yet, by destination.
+  std::map<unsigned int, std::vector<std::vector<msg::Message>>> pending_;
+  // The shared round clock: the last round whose messages were sent, and
+  // when they were. Instances time out a round a round timeout after it was
+  // sent, rather than after they reached it, so that they stay in step with
+  // the same instances at other processes.
+  unsigned int sent_round_;
+  TimePoint round_start_;
+  // Sends the messages of each round to each process, once those of the
+  // previous round to the process are done.
+  std::vector<std::thread> senders_;
+
+  // Hands a message from the process to the machine of its instance.
+  void Receive(unsigned int pid, const msg::Message& msg, TimePoint now);
+  // Carries out the step the instance's machine took: queues the messages of
+  // a new round and handles early messages for it, or records the decision.
+  void Apply(unsigned int instance, Step step, TimePoint now);
+  // Records the offense of the process, and hands a new conviction to the
+  // machine of every undecided instance.
+  void Convict(unsigned int pid, evidence::Offense offense, TimePoint now);
+  // Times out the instances in the last round sent if it has lasted too long,
+  // and sends every round that every instance has reached. Returns how the
+  // server should proceed.
+  transport::ServerAction Advance(TimePoint now);
+  // Sends the messages of the round, coalesced by destination.
+  void SendRound(unsigned int round);
+};
+
+// A long-running process that decides instances as they are proposed, by
+// itself or by any other process, over one warm server and set of clients.
+// The commander of an instance is the first id of its messages, and inside
+// the instance its id is swapped with process 0's, like in a Participant.
+// Decisions are handed to a callback as they are made and remembered for a
+// while.
+class Daemon : public General {
+ public:
+  // Called with the id and decision of every instance the Daemon decides.
+  typedef std::function<void(unsigned int, const msg::Orders&)> OnDecision;
+
+  Daemon(const ProcessList& processes, unsigned int id,
+         std::shared_ptr<transport::Server> server, unsigned int faulty,
+         MaliciousBehavior behavior)
+      : General(processes, id, server, faulty, behavior, 1),
+        ids_(IdsForClients(processes_, clients_)),
+        stopping_(false),
+        running_senders_(0) {}
+
+  // A Daemon has no fixed set of instances to decide. Use Run instead.
+  std::vector<msg::Orders> DecideInstances(unsigned int instances,
+                                           unsigned int in_flight);
+
+  // Sets the function called with each decision, on the thread of Run or of
+  // Propose. Must be called before either.
+  inline void SetOnDecision(OnDecision on_decision) {
+    on_decision_ = on_decision;
+  }
+
+  // Takes part in every instance proposed until Stop is called. Returns once
+  // the last acknowledgements have been waited for.
+  void Run();
+  // Makes Run return. Thread-safe.
+  inline void Stop() { stopping_ = true; }
+
+  // Proposes the order in the instance as its commander, which decides it at
+  // once. Returns false if the instance has already been decided. Thread-safe,
+  // but instance ids must be unique across the cluster, which is up to the
+  // callers.
+  bool Propose(unsigned int instance, msg::Order order);
+
+  // Returns the decision of the instance, if it has been made and is still
+  // remembered. Thread-safe.
+  std::experimental::optional<msg::Order> DecisionOf(
+      unsigned int instance) const;
+
+ protected:
+  msg::Digest DecidedValue(unsigned int instance) const {
+    return msg::kNoValue;
+  }
+
+ private:
+  // An instance that has begun but not yet decided.
+  struct Instance {
+    Instance(size_t process_num, unsigned int id, unsigned int faulty,
+             unsigned int commander, TimePoint now)
+        : commander(commander),
+          machine(process_num, ForInstance(commander, id), faulty,
+                  kRoundTimeout),
+          started(now) {}
+    ~Instance() {
+      if (senders.joinable()) senders.join();
+    }
+
+    const unsigned int commander;
+    LieutenantMachine machine;
+    const TimePoint started;
+    // Sends the messages of the latest round, once those of the previous
+    // round are done.
+    std::thread senders;
+  };
+
+  // Maps the address of each process to its id.
+  const std::map<transport::Address, unsigned int> ids_;
+  OnDecision on_decision_;
+  std::atomic<bool> stopping_;
+  // The instances in progress, by instance id. Only used by Run.
+  std::map<unsigned int, std::unique_ptr<Instance>> instances_;
+  // The latest decisions, and the order they were made in, so that the oldest
+  // can be forgotten.
+  mutable std::mutex decisions_mu_;
+  std::map<unsigned int, msg::Orders> decisions_;
+  std::deque<unsigned int> decision_order_;
+  // Counts the sender threads that are running, like in a Lieutenant.
+  std::mutex senders_mu_;
+  std::condition_variable senders_cv_;
+  unsigned int running_senders_;
+
+  // Records the decision, unless the instance already has one, and hands it
+  // to the callback. Returns whether it was recorded.
+  bool Decided(unsigned int instance, const msg::Orders& decision);
+  inline bool HasDecided(unsigned int instance) const {
+    std::lock_guard<std::mutex> lock(decisions_mu_);
+    return decisions_.count(instance) > 0;
+  }
+
+  // Hands the message to the machine of its instance, beginning the instance
+  // if needed, and acknowledges it if it is valid.
+  void Deliver(const transport::Address& from, unsigned int pid,
+               const msg::Message& msg, uint32_t seq, TimePoint now);
+  // Carries out the step the instance's machine took.
+  void Apply(unsigned int instance, Step step);
+  // Records the offense of the process, and hands a new conviction to the
+  // machine of every instance in progress.
+  void Convict(unsigned int pid, evidence::Offense offense, TimePoint now);
+  // Checks every instance in progress for a round timeout, and drops those
+  // that never heard from their commander.
+  void PollAll(TimePoint now);
+  // Launches a thread to send the messages of the round that just began, like
+  // Lieutenant::StartSenders, with the ids they have outside of the instance.
+  void StartSenders(Instance& instance);
+  // Returns a thread running the function, counted in running_senders_ until
+  // it returns.
+  std::thread StartSender(std::function<void()> send);
 };
 
 }  // namespace generals
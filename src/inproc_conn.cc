@@ -0,0 +1,146 @@
+#include "inproc_conn.h"
+
+#include <string.h>
+
+#include <stdexcept>
+
+#include "futex.h"
+
+namespace inproc {
+
+MpscQueue::MpscQueue() {
+  Node* stub = new Node(transport::Address(sockaddr_in{}));
+  head_ = stub;
+  tail_ = stub;
+}
+
+MpscQueue::~MpscQueue() {
+  Node* node = tail_;
+  while (node) {
+    Node* next = node->next.load();
+    delete node;
+    node = next;
+  }
+}
+
+void MpscQueue::Push(Node* node) {
+  node->next.store(nullptr, std::memory_order_relaxed);
+  Node* prev = head_.exchange(node, std::memory_order_acq_rel);
+  prev->next.store(node, std::memory_order_release);
+}
+
+bool MpscQueue::Pop(Node* out) {
+  Node* tail = tail_;
+  Node* next = tail->next.load(std::memory_order_acquire);
+  if (next == nullptr) {
+    return false;
+  }
+
+  // The next node becomes the new stub once its datagram is copied out.
+  out->from = next->from;
+  out->size = next->size;
+  memcpy(out->data, next->data, next->size);
+  tail_ = next;
+  delete tail;
+  return true;
+}
+
+Network::Network(const std::vector<transport::Address>& processes)
+    : servers_(new std::atomic<Server*>[processes.size()]) {
+  for (size_t i = 0; i < processes.size(); ++i) {
+    index_.emplace(processes[i], i);
+    servers_[i] = nullptr;
+  }
+}
+
+std::atomic<Server*>* Network::Slot(const transport::Address& addr) {
+  auto it = index_.find(addr);
+  if (it == index_.end()) {
+    return nullptr;
+  }
+  return &servers_[it->second];
+}
+
+Server::Server(std::shared_ptr<Network> network,
+               const transport::Address& addr,
+               transport::AckDecoderFn ack_decoder,
+               std::chrono::microseconds timeout)
+    : transport::Server(ack_decoder, timeout),
+      network_(network),
+      addr_(addr),
+      seq_(0),
+      sleeping_(0),
+      stopped_(false) {
+  auto slot = network_->Slot(addr_);
+  if (slot == nullptr) {
+    throw std::invalid_argument("address is not a process in the cluster");
+  }
+  Server* expected = nullptr;
+  if (!slot->compare_exchange_strong(expected, this)) {
+    throw std::invalid_argument("address already has an in-process server");
+  }
+  receiver_ = std::thread([this] { Receive(); });
+}
+
+Server::~Server() {
+  network_->Slot(addr_)->store(nullptr);
+  stopped_ = true;
+  receiver_.join();
+}
+
+void Server::Transmit(uint64_t id, const transport::Address& to,
+                      const char* buf, size_t size) {
+  auto slot = network_->Slot(to);
+  if (slot == nullptr) {
+    throw std::invalid_argument("address is not a process in the cluster");
+  }
+  Server* server = slot->load(std::memory_order_acquire);
+  if (server == nullptr) {
+    // The peer is not up yet. Drop the datagram, as UDP would.
+    return;
+  }
+  server->Push(addr_, buf, size);
+}
+
+void Server::Push(const transport::Address& from, const char* buf,
+                  size_t size) {
+  if (size > BUFSIZE) {
+    throw std::invalid_argument("datagram larger than BUFSIZE");
+  }
+  Node* node = new Node(from);
+  node->size = size;
+  memcpy(node->data, buf, size);
+  queue_.Push(node);
+
+  // Wake the receiver if it is sleeping. Both this increment and the
+  // receiver's sleeping flag are sequentially consistent, so either we see
+  // the flag or the receiver sees the new seq and does not sleep.
+  seq_.fetch_add(1);
+  if (sleeping_.load()) {
+    futex::Wake(&seq_, true);
+  }
+}
+
+void Server::Receive() {
+  Node node(addr_);
+  while (!stopped_) {
+    // Drain the queue, remembering seq beforehand so that a push racing with
+    // the drain prevents us from sleeping.
+    uint32_t seq = seq_.load();
+    bool received = false;
+    while (queue_.Pop(&node)) {
+      Deliver(node.from, node.data, node.size);
+      received = true;
+    }
+    if (received) continue;
+
+    // Nothing to read, so sleep until a sender pushes a datagram. The futex
+    // timeout wakes us up periodically to check if the Server is being
+    // destroyed.
+    sleeping_.store(1);
+    futex::Wait(&seq_, seq, transport::kReceivePollInterval, true);
+    sleeping_.store(0);
+  }
+}
+
+}  // namespace inproc
@@ -0,0 +1,107 @@
+#ifndef INPROC_CONN_H_
+#define INPROC_CONN_H_
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "transport.h"
+
+namespace inproc {
+
+// A datagram in flight between two in-process Servers.
+struct Node {
+  std::atomic<Node*> next;
+  transport::Address from;
+  size_t size;
+  char data[BUFSIZE];
+
+  Node(const transport::Address& from) : next(nullptr), from(from), size(0){};
+};
+
+// A lock-free intrusive multi-producer single-consumer queue (after Dmitry
+// Vyukov's design). Any number of threads may Push concurrently, while a single
+// thread Pops.
+class MpscQueue {
+ public:
+  MpscQueue();
+  ~MpscQueue();
+
+  // Appends the node to the queue and takes ownership of it.
+  void Push(Node* node);
+
+  // Copies the oldest datagram into the provided node and returns true, or
+  // returns false if the queue is empty or the next push has not completed.
+  bool Pop(Node* out);
+
+ private:
+  // Producers swap themselves into head_, while the consumer reads from tail_,
+  // which is always a stub whose datagram was already consumed.
+  std::atomic<Node*> head_;
+  Node* tail_;
+};
+
+class Server;
+
+// Connects the in-process Servers of a cluster. The cluster's addresses are
+// fixed at construction so that a Server can be found by address without
+// taking a lock.
+class Network {
+ public:
+  Network(const std::vector<transport::Address>& processes);
+
+ private:
+  friend class Server;
+
+  std::map<transport::Address, size_t> index_;
+  std::unique_ptr<std::atomic<Server*>[]> servers_;
+
+  // Returns the slot of the Server with the provided address, or nullptr if
+  // the address is not part of the cluster.
+  std::atomic<Server*>* Slot(const transport::Address& addr);
+};
+
+// A transport for Generals running on threads of a single process, which lets
+// entire clusters run inside one binary without involving the kernel in any
+// message. Sending a datagram pushes it onto the receiver's lock-free MPSC
+// queue, and the receiver's thread only sleeps on a futex when the queue is
+// empty. A Server must outlive every send addressed to it.
+class Server : public transport::Server {
+ public:
+  Server(std::shared_ptr<Network> network, const transport::Address& addr,
+         transport::AckDecoderFn ack_decoder,
+         std::chrono::microseconds timeout = transport::kNoTimeout);
+
+  ~Server();
+
+ private:
+  // Sends the message to the remote Server. Datagrams to Servers that have
+  // not been created yet are dropped.
+  void Transmit(uint64_t id, const transport::Address& to, const char* buf,
+                size_t size);
+
+  const std::shared_ptr<Network> network_;
+  const transport::Address addr_;
+
+  MpscQueue queue_;
+  // Incremented after every push, and used as a futex to wake the receiver.
+  std::atomic<uint32_t> seq_;
+  // Set while the receiver is, or is about to be, waiting on seq_.
+  std::atomic<uint32_t> sleeping_;
+
+  std::atomic<bool> stopped_;
+  std::thread receiver_;
+
+  // Adds a datagram to the Server's queue. Called by other Servers.
+  void Push(const transport::Address& from, const char* buf, size_t size);
+
+  // Receives datagrams until the Server is destroyed.
+  void Receive();
+};
+
+}  // namespace inproc
+
+#endif
@@ -0,0 +1,412 @@
+#include "lieutenant_machine.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "log.h"
+#include "metrics.h"
+#include "timeline.h"
+
+namespace generals {
+
+namespace {
+
+// Rounds beyond this share one counter, as only the first faulty + 2 rounds
+// are valid in any cluster.
+const size_t kMaxCountedRound = 32;
+
+metrics::CounterVec& ReceivedMessages() {
+  static metrics::CounterVec counters(
+      "byzantine_messages_received_total",
+      "Messages received by lieutenants, by the round of the message.", "round",
+      kMaxCountedRound);
+  return counters;
+}
+
+metrics::Counter& CatchUps() {
+  static metrics::Counter& counter = metrics::Default().GetCounter(
+      "byzantine_catch_ups_total",
+      "Jumps of lieutenants that fell behind to the round of the cluster.");
+  return counter;
+}
+
+metrics::Counter& InvalidMessages() {
+  static metrics::Counter& counter = metrics::Default().GetCounter(
+      "byzantine_invalid_messages_total",
+      "Messages rejected by LieutenantMachine::ValidMessage.");
+  return counter;
+}
+
+// Returns the histogram of round durations for rounds that ended in the
+// provided way: "complete" when every expected message arrived, and "timeout"
+// otherwise.
+metrics::Histogram& RoundDuration(const std::string& end) {
+  return metrics::Default().GetHistogram(
+      "byzantine_round_duration_seconds",
+      "Time from the start of a round to its end, by how it ended.",
+      {{"end", end}});
+}
+
+// Adds the value to the values provided if it is new and fewer than two are
+// there, and returns whether it was added.
+bool AddValue(std::vector<msg::Digest>& values, const msg::Digest& value) {
+  if (value == msg::kNoValue || values.size() >= 2 ||
+      std::find(values.begin(), values.end(), value) != values.end()) {
+    return false;
+  }
+  values.push_back(value);
+  return true;
+}
+
+// Adds the orders and value of the proof to those provided, and records the
+// proof if it added any.
+void Prove(const msg::Message& proof, msg::Orders& orders,
+           std::vector<msg::Digest>& values,
+           std::vector<msg::Message>& proofs) {
+  bool added = AddValue(values, proof.value);
+  for (size_t w = 0; w < orders.Words(); ++w) {
+    added |= (proof.orders.Retreat(w) & ~orders.Retreat(w)) != 0 ||
+             (proof.orders.Attack(w) & ~orders.Attack(w)) != 0;
+    orders.Retreat(w) |= proof.orders.Retreat(w);
+    orders.Attack(w) |= proof.orders.Attack(w);
+  }
+  if (added) proofs.push_back(proof);
+}
+
+}  // namespace
+
+Reaction LieutenantMachine::Receive(unsigned int from, const msg::Message& msg,
+                                    TimePoint now) {
+  if (done_) {
+    return {false, Step::Done};
+  }
+  ReceivedMessages().At(msg.round).Add();
+  if (!ValidMessage(msg, from)) {
+    // If the message was not valid, return without trying to use it.
+    InvalidMessages().Add();
+    Reaction reaction{false, Poll(now)};
+    if (Malformed(msg, from)) {
+      reaction.offense = evidence::Offense::MALFORMED;
+      reaction.offender = from;
+    }
+    return reaction;
+  }
+
+  LOG(Debug, "Received ", msg, " from p", from);
+
+  bool newRound = false;
+  auto offense = evidence::Offense::NONE;
+  if (FirstRound()) {
+    // Only handle the first real orders or value.
+    if (DecidesValue()) {
+      newRound = SeeValue(msg.value);
+    } else if (msg.orders.Any() && !orders_seen_.Any()) {
+      orders_seen_ = msg.orders;
+      newRound = true;
+    }
+    if (newRound) {
+      msgs_this_round_.push_back(msg);
+      proofs_.push_back(msg);
+    }
+  } else {
+    // Handle if not a replay of a previous message (msg with same ids).
+    if (paths_this_round_->Insert(msg.ids)) {
+      // Handle the order in each slot based on if we've seen the same order
+      // or not, a word of slots at a time. Orders we have not seen yet are
+      // added to the orders_seen set and forwarded in the next round. Orders
+      // we have already seen are forwarded as no_order instead. A value is
+      // handled the same way, as if it were a single slot.
+      msg::Message fwd = msg;
+      if (DecidesValue() && !SeeValue(msg.value)) {
+        fwd.value = msg::kNoValue;
+      }
+      for (size_t w = 0; w < msg.orders.Words(); ++w) {
+        fwd.orders.Retreat(w) &= ~orders_seen_.Retreat(w);
+        fwd.orders.Attack(w) &= ~orders_seen_.Attack(w);
+        orders_seen_.Retreat(w) |= msg.orders.Retreat(w);
+        orders_seen_.Attack(w) |= msg.orders.Attack(w);
+      }
+      if (fwd.orders.Any() || fwd.value != msg::kNoValue) {
+        proofs_.push_back(msg);
+      }
+
+      // Chains of correct relays cannot alter a signed order, so two of them
+      // in a slot were both signed by the commander.
+      if (Equivocated()) {
+        offense = evidence::Offense::EQUIVOCATION;
+      }
+
+      // Record the message so we can forward it next round.
+      msgs_this_round_.push_back(std::move(fwd));
+      // A suspected relay that is still relaying is waited for after all.
+      const bool revived = suspected_[from] && !relayed_[from];
+      relayed_[from] = true;
+      if (revived) {
+        Recount();
+      } else if (Live(msg.ids)) {
+        live_paths_++;
+      }
+
+      // Determine if this is the last message needed for the round.
+      newRound = RoundComplete();
+    }
+  }
+
+  Reaction reaction{true,
+                    newRound ? MoveToNewRoundOrStop(now, false) : Poll(now)};
+  reaction.offense = offense;
+  return reaction;
+}
+
+Step LieutenantMachine::Poll(TimePoint now) {
+  // If the round has lasted longer than the round timeout, handle the timeout.
+  // We need both a round timeout and a socket timeout so that faulty processes
+  // cannot continue to send messages to reset the socket timeout without ever
+  // actually making forward progress.
+  if (now - round_start_ts_ > round_timeout_) {
+    return Timeout(now);
+  }
+  return Step::Continue;
+}
+
+Step LieutenantMachine::Timeout(TimePoint now) {
+  if (done_) {
+    return Step::Done;
+  }
+  if (FirstRound()) {
+    // We can't timeout in the first round. Just continue to wait.
+    return Step::Continue;
+  }
+
+  LOG(Debug, "Timeout in round ", round_);
+  timeline::Instant("round timeout", now, {{"round", round_}});
+  return MoveToNewRoundOrStop(now, true);
+}
+
+Step LieutenantMachine::SkipFirstRound(TimePoint now) {
+  if (done_ || !FirstRound()) {
+    return Step::Continue;
+  }
+
+  LOG(Debug, "No order in round 0");
+  timeline::Instant("round timeout", now, {{"round", round_}});
+  return MoveToNewRoundOrStop(now, true);
+}
+
+Step LieutenantMachine::CatchUp(unsigned int round, TimePoint now) {
+  if (done_ || round <= round_ || round > faulty_ + 1) {
+    return Step::Continue;
+  }
+
+  LOG(Debug, "Catching up from round ", round_, " to round ", round);
+  timeline::Instant("catch up", now, {{"from", round_}, {"to", round}});
+  CatchUps().Add();
+  // The relays of the rounds ahead mask what the cluster has already seen, so
+  // the held proofs are all that shows it.
+  caught_up_ = true;
+  for (auto const& proof : proofs_held_) {
+    Prove(proof, orders_seen_, values_seen_, proofs_);
+  }
+  proofs_held_.clear();
+  msgs_this_round_.clear();
+  round_ = round - 1;
+  InitNewRound(now);
+  return Step::NewRound;
+}
+
+bool LieutenantMachine::AddProof(const msg::Message& proof) {
+  if (proof.ids.empty() || Malformed(proof, proof.ids.back())) {
+    return false;
+  }
+  if (caught_up_ && !done_) {
+    Prove(proof, orders_seen_, values_seen_, proofs_);
+  } else if (FirstRound()) {
+    Prove(proof, orders_proven_, values_proven_, proofs_held_);
+  }
+  return true;
+}
+
+Step LieutenantMachine::Suspect(const std::vector<bool>& suspected,
+                                TimePoint now) {
+  suspected_ = suspected;
+  suspected_[0] = false;
+  suspected_[id_] = false;
+  return Reassess(now);
+}
+
+Step LieutenantMachine::Convict(const std::vector<bool>& convicted,
+                                TimePoint now) {
+  convicted_ = convicted;
+  convicted_[0] = false;
+  convicted_[id_] = false;
+  return Reassess(now);
+}
+
+void LieutenantMachine::Recount() {
+  for (size_t pid = 0; pid < process_num_; ++pid) {
+    excluded_[pid] = convicted_[pid] || (suspected_[pid] && !relayed_[pid]);
+  }
+  excluded_num_ = std::count(excluded_.begin(), excluded_.end(), true);
+  live_paths_ = 0;
+  for (auto const& msg : msgs_this_round_) {
+    if (Live(msg.ids)) live_paths_++;
+  }
+}
+
+Step LieutenantMachine::Reassess(TimePoint now) {
+  Recount();
+
+  // The first round has only the commander's message to wait for.
+  if (done_ || FirstRound() || !RoundComplete()) {
+    return Step::Continue;
+  }
+  return MoveToNewRoundOrStop(now, false);
+}
+
+bool LieutenantMachine::Live(const std::vector<unsigned int>& ids) const {
+  if (excluded_num_ == 0) return true;
+  for (auto const& id : ids) {
+    if (excluded_[id]) return false;
+  }
+  return true;
+}
+
+bool LieutenantMachine::RoundComplete() const {
+  if (paths_this_round_->Complete()) return true;
+  // The paths that avoid k excluded relays are those of a cluster without
+  // them.
+  return excluded_num_ > 0 &&
+         live_paths_ >= MessagesForRound(process_num_ - excluded_num_, round_);
+}
+
+bool LieutenantMachine::Equivocated() {
+  if (equivocated_) return false;
+  if (DecidesValue()) {
+    equivocated_ = values_seen_.size() > 1;
+  }
+  for (size_t w = 0; w < orders_seen_.Words() && !equivocated_; ++w) {
+    equivocated_ = (orders_seen_.Retreat(w) & orders_seen_.Attack(w)) != 0;
+  }
+  return equivocated_;
+}
+
+msg::Orders LieutenantMachine::Decision() const {
+  // Only slots that have seen attack alone decide to attack.
+  msg::Orders decision(orders_seen_.Slots(), msg::Order::NO_ORDER);
+  for (size_t w = 0; w < decision.Words(); ++w) {
+    const uint64_t attack = orders_seen_.Attack(w) & ~orders_seen_.Retreat(w);
+    decision.Attack(w) = attack;
+    decision.Retreat(w) = ~attack & decision.Mask(w);
+  }
+  return decision;
+}
+
+msg::Digest LieutenantMachine::ValueDecision() const {
+  return values_seen_.size() == 1 ? values_seen_.front() : msg::kNoValue;
+}
+
+bool LieutenantMachine::SeeValue(const msg::Digest& value) {
+  return AddValue(values_seen_, value);
+}
+
+Step LieutenantMachine::MoveToNewRoundOrStop(TimePoint now, bool timed_out) {
+  // The first round has no start, since it begins whenever the process does.
+  if (!FirstRound()) {
+    static metrics::Histogram& complete = RoundDuration("complete");
+    static metrics::Histogram& timeout = RoundDuration("timeout");
+    (timed_out ? timeout : complete).Record(now - round_start_ts_);
+    timeline::Complete("round", round_start_ts_, now,
+                       {{"round", round_}, {"timed_out", timed_out}});
+  }
+  if (LastRound()) {
+    done_ = true;
+    return Step::Done;
+  }
+  InitNewRound(now);
+  return Step::NewRound;
+}
+
+void LieutenantMachine::InitNewRound(TimePoint now) {
+  round_++;
+  LOG(Debug, "Moving to round ", round_);
+  timeline::Span span("InitNewRound", {{"round", round_}});
+
+  // Determine the set of messages to forward in the next round.
+  for (auto& batch : outbox_) batch.clear();
+  for (msg::Message msg : msgs_this_round_) {
+    if (msg.round != round_ - 1) {
+      throw std::logic_error(
+          "message in msgs_this_round_ not from current round");
+    }
+
+    // Update the messages round number to the current round.
+    msg.round = round_;
+
+    // Add this process in at the end of the message id list.
+    msg.ids.push_back(id_);
+
+    // Only send to processes not already in this message, and never to those
+    // proven faulty.
+    for (unsigned int pid = 0; pid < process_num_; ++pid) {
+      if (convicted_[pid]) {
+        continue;
+      }
+      bool inMsg = false;
+      for (auto const& id : msg.ids) {
+        if (id == pid) {
+          inMsg = true;
+          break;
+        }
+      }
+      if (!inMsg) {
+        outbox_[pid].push_back(msg);
+      }
+    }
+  }
+
+  // Clear round-specific containers and reset round start timestamp.
+  paths_this_round_->Reset(round_);
+  msgs_this_round_.clear();
+  relayed_.assign(process_num_, false);
+  Recount();
+  round_start_ts_ = now;
+}
+
+bool LieutenantMachine::ValidMessage(const msg::Message& msg,
+                                     unsigned int from) const {
+  // Invalid if the message is from a later round.
+  if (msg.round > round_) {
+    return false;
+  }
+  // Invalid if no correct process could have sent it.
+  return !Malformed(msg, from);
+}
+
+bool LieutenantMachine::Malformed(const msg::Message& msg,
+                                  unsigned int from) const {
+  // Malformed if the message has an incorrect number of ids.
+  if (msg.round + 1 != msg.ids.size()) {
+    return true;
+  }
+  // Malformed if the message has the wrong number of orders, or more than one
+  // order in a slot.
+  if (msg.orders.Slots() != orders_seen_.Slots() || !msg.orders.Single()) {
+    return true;
+  }
+  // Malformed if the first message is not from the General (pid 0);
+  if (msg.ids.at(0) != 0) {
+    return true;
+  }
+  // Malformed if any id is out of bounds, any id is our id, or not all ids are
+  // unique.
+  if (!paths_this_round_->ValidPath(msg.ids)) {
+    return true;
+  }
+  // Malformed if the last id does not match the sender.
+  if (msg.ids.back() != from) {
+    return true;
+  }
+  return false;
+}
+
+}  // namespace generals
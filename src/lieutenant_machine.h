@@ -0,0 +1,256 @@
+#ifndef LIEUTENANT_MACHINE_H_
+#define LIEUTENANT_MACHINE_H_
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "evidence.h"
+#include "message.h"
+#include "path_set.h"
+
+namespace generals {
+
+// The clock that LieutenantMachines are driven by. Real Lieutenants pass
+// steady_clock::now(), while the simulator passes its virtual time.
+typedef std::chrono::steady_clock::time_point TimePoint;
+
+// The outcome of handing an event to a LieutenantMachine.
+enum class Step {
+  // Keep waiting in the current round.
+  Continue,
+  // A new round began, and its messages are waiting in the Outbox.
+  NewRound,
+  // The algorithm is complete, and Decision is final.
+  Done,
+};
+
+// The reaction of a LieutenantMachine to a received message.
+struct Reaction {
+  // Whether the message was valid and should be acknowledged.
+  bool ack;
+  Step step;
+  // The offense the message proves, if any, and the process it convicts.
+  evidence::Offense offense = evidence::Offense::NONE;
+  unsigned int offender = 0;
+};
+
+// The state machine of a lieutenant process in the Byzantine Agreement
+// Algorithm. It performs no IO and never reads the clock: it is fed messages
+// and the current time, and leaves the messages it wants sent in its Outbox.
+// This lets the same logic run over a real transport (see Lieutenant) and in a
+// deterministic simulation (see sim::Simulation).
+class LieutenantMachine {
+ public:
+  // Decides on a batch of the provided number of orders (see msg::Orders), or
+  // on a value if slots is msg::kValueSlots.
+  LieutenantMachine(size_t process_num, unsigned int id, unsigned int faulty,
+                    std::chrono::microseconds round_timeout, size_t slots = 1)
+      : process_num_(process_num),
+        id_(id),
+        faulty_(faulty),
+        round_timeout_(round_timeout),
+        round_(0),
+        done_(false),
+        orders_seen_(slots, msg::Order::NO_ORDER),
+        caught_up_(false),
+        orders_proven_(slots, msg::Order::NO_ORDER),
+        paths_this_round_(MakePathSet(process_num, faulty, id)),
+        suspected_(process_num),
+        convicted_(process_num),
+        relayed_(process_num),
+        excluded_(process_num),
+        excluded_num_(0),
+        live_paths_(0),
+        equivocated_(false),
+        outbox_(process_num) {}
+
+  // Handles a message received from the process with the provided id. Late
+  // messages also check for a round timeout, like Poll.
+  Reaction Receive(unsigned int from, const msg::Message& msg, TimePoint now);
+
+  // Checks if the round has timed out and moves on if it has. Called when a
+  // datagram that is not a usable message arrives, so that faulty processes
+  // cannot hold a round open by sending garbage.
+  Step Poll(TimePoint now);
+
+  // Handles a round timeout, moving to the next round if necessary.
+  Step Timeout(TimePoint now);
+
+  // Ends the first round without an order from the commander. The first round
+  // never times out on its own, since a lieutenant cannot tell a slow
+  // commander from a silent one, so this is for lieutenants that know when
+  // the commander must have sent (see Participant). Relayed orders are still
+  // handled in later rounds.
+  Step SkipFirstRound(TimePoint now);
+
+  // Jumps ahead to the provided round, which the rest of the cluster has
+  // reached, as if every round before it had timed out. The messages of the
+  // current round are dropped instead of forwarded, since the processes they
+  // would go to have moved past them. For lieutenants that fell behind, like
+  // those that missed the first round (see Lieutenant), which never times out
+  // on its own. The orders and values of the proofs held so far (see
+  // AddProof) are taken as seen first. Does nothing unless the round is ahead
+  // and valid.
+  Step CatchUp(unsigned int round, TimePoint now);
+
+  // Handles a proof (see kProofType): a message another process received
+  // earlier in the agreement, whose path shows the commander signed its orders
+  // or value. Later rounds relay orders as NO_ORDER to processes that have seen
+  // them, so a lieutenant that catches up past the rounds that carried them
+  // learns them only this way. Proofs are held in the first round until
+  // CatchUp, dropped if the round ends normally instead, and taken as seen at
+  // once after a catch up. Orders learned from a proof are never forwarded.
+  // Only the form of a proof is checked, since it may have arrived in any
+  // round. Returns whether it was well-formed and should be acknowledged.
+  bool AddProof(const msg::Message& proof);
+
+  // Returns the messages that first carried each order or value seen, as they
+  // arrived, to send to lieutenants that catch up.
+  inline const std::vector<msg::Message>& Proofs() const { return proofs_; }
+
+  // Sets the processes suspected to have failed, indexed by id. A round no
+  // longer waits for the messages relayed through them: it completes as soon
+  // as every message along a path that avoids them has arrived. Their messages
+  // are still accepted if they come, and once one relays a message in a round
+  // the round waits for its paths again, since it is evidently still relaying.
+  // The suspicions of the commander and of this process are ignored.
+  Step Suspect(const std::vector<bool>& suspected, TimePoint now);
+
+  // Sets the processes proven faulty (see evidence::Ledger), indexed by id.
+  // They are left out of the destinations of every later round, so they
+  // relay nothing more, and rounds stop waiting for the paths through them as
+  // if they were suspected. Their messages are still accepted and
+  // acknowledged, so that they do not retransmit them. The convictions of the
+  // commander and of this process are ignored.
+  Step Convict(const std::vector<bool>& convicted, TimePoint now);
+
+  // Returns the messages to send for the round that just began, indexed by
+  // destination process id. Only valid until the next event.
+  inline const std::vector<std::vector<msg::Message>>& Outbox() const {
+    return outbox_;
+  }
+
+  // Returns the time at which the current round times out.
+  inline TimePoint RoundDeadline() const {
+    return round_start_ts_ + round_timeout_;
+  }
+
+  inline unsigned int Round() const { return round_; }
+  inline bool Done() const { return done_; }
+
+  // Decides what the order of each slot should be based on the orders seen in
+  // the slot over the course of the agreement algorithm. Defined as follows:
+  //
+  // choice(V) := v        if V = {v}
+  //            | RETREAT  if V = {} or |V| >= 2
+  //
+  msg::Orders Decision() const;
+
+  // Decides what the value should be based on the values seen, with the same
+  // choice function as Decision: the value if exactly one was seen, and
+  // msg::kNoValue otherwise.
+  msg::Digest ValueDecision() const;
+
+  // Determines if the machine decides on a value rather than on orders.
+  inline bool DecidesValue() const {
+    return orders_seen_.Slots() == msg::kValueSlots;
+  }
+
+  // Validates that the message makes sense in the current context of the
+  // algorithm and verifies that it is properly formatted. This protects against
+  // malicious messages.
+  bool ValidMessage(const msg::Message& msg, unsigned int from) const;
+
+  // Determines if the message could not have been sent by a correct process,
+  // whatever round either of them is in.
+  bool Malformed(const msg::Message& msg, unsigned int from) const;
+
+ private:
+  const size_t process_num_;
+  const unsigned int id_;
+  const unsigned int faulty_;
+  const std::chrono::microseconds round_timeout_;
+
+  unsigned int round_;
+  bool done_;
+
+  // The set of unique orders seen in each slot over the course of the
+  // agreement algorithm.
+  msg::Orders orders_seen_;
+  // The unique values seen over the course of the agreement algorithm, when
+  // deciding on a value. Only the first two are kept: the decision is the
+  // same for any two or more, so later values are never forwarded either.
+  std::vector<msg::Digest> values_seen_;
+  // The messages that first carried each of them.
+  std::vector<msg::Message> proofs_;
+  // Whether this lieutenant has caught up, and the orders, values and proofs
+  // held until it does (see AddProof).
+  bool caught_up_;
+  msg::Orders orders_proven_;
+  std::vector<msg::Digest> values_proven_;
+  std::vector<msg::Message> proofs_held_;
+
+  // Per-round variables:
+
+  // Timestamp at the begining of the round, used as a backup round timeout
+  // because socket timeouts alone are not sufficient (see Poll).
+  TimePoint round_start_ts_;
+  // Contains the unique messages received so far this round, in the order
+  // they arrived. paths_this_round_ drops replays before they get here, and
+  // the vector keeps its capacity from round to round.
+  std::vector<msg::Message> msgs_this_round_;
+  // Same as msgs_this_round_, except with only the ids so that all messages
+  // with the same process list collide. Specialized for the cluster shape when
+  // possible.
+  const std::unique_ptr<PathSet> paths_this_round_;
+  // The processes suspected to have failed, those proven faulty, those that
+  // have relayed a message this round, and the relays that the round does not
+  // wait for: those convicted, and those suspected that have not relayed.
+  // Along with them, the paths seen this round that avoid them all.
+  std::vector<bool> suspected_;
+  std::vector<bool> convicted_;
+  std::vector<bool> relayed_;
+  std::vector<bool> excluded_;
+  size_t excluded_num_;
+  size_t live_paths_;
+  // Whether the commander has been caught equivocating.
+  bool equivocated_;
+  // The messages to send this round, indexed by destination.
+  std::vector<std::vector<msg::Message>> outbox_;
+
+  // Determines if this is the first round of the algorithm.
+  inline bool FirstRound() const { return round_ == 0; }
+  // Determines if this is the last round of the algorithm.
+  inline bool LastRound() const { return round_ == faulty_ + 1; };
+
+  // Determines if no process on the path is suspected to have failed or
+  // proven faulty.
+  bool Live(const std::vector<unsigned int>& ids) const;
+  // Determines if every message expected this round has arrived, leaving out
+  // those relayed through suspected or convicted processes.
+  bool RoundComplete() const;
+  // Recounts the excluded processes and the live paths seen this round.
+  void Recount();
+  // Recounts after the suspicions or convictions changed, and ends the round
+  // if the paths complete it.
+  Step Reassess(TimePoint now);
+  // Determines if the orders or values seen show that the commander signed
+  // two different ones. Reports it only once.
+  bool Equivocated();
+
+  // Adds the value to the values seen if it is new and fewer than two have
+  // been seen, and returns whether it was added.
+  bool SeeValue(const msg::Digest& value);
+
+  // Handles moving to the next round, unless this is as already the last round.
+  // Records how long the round took and whether it timed out.
+  Step MoveToNewRoundOrStop(TimePoint now, bool timed_out);
+  // Handles a new round by resetting per-round variables and filling the
+  // Outbox with the messages to forward.
+  void InitNewRound(TimePoint now);
+};
+
+}  // namespace generals
+
+#endif
@@ -1,8 +1,188 @@
 #include "log.h"
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
 namespace logging {
 
-// Needed to be defined in .cc file to avoid duplicate symbols.
-Logger out(&std::cerr);
+namespace internal {
+std::atomic<int> level{static_cast<int>(Level::Info)};
+}  // namespace internal
+
+namespace {
+
+// The number of records each thread can have waiting to be written.
+const size_t kRingSlots = 512;
+// How often the background thread writes waiting records.
+const auto kDrainInterval = std::chrono::milliseconds{1};
+
+struct Slot {
+  std::chrono::steady_clock::time_point time;
+  internal::FormatFn format;
+  alignas(std::max_align_t) char args[kMaxRecordSize];
+};
+
+// A single-producer single-consumer ring of records. The owning thread
+// appends at head and the background thread consumes from tail.
+struct Ring {
+  Slot slots[kRingSlots];
+  std::atomic<size_t> head{0};
+  std::atomic<size_t> tail{0};
+  // Records dropped because the ring was full.
+  std::atomic<size_t> dropped{0};
+  // Set once the owning thread exits, after which the ring is freed as soon
+  // as it is empty.
+  std::atomic<bool> closed{false};
+};
+
+// The state of the logger. Allocated once and never freed, so that the
+// background thread can keep running while the process exits.
+struct State {
+  std::mutex rings_mu;
+  std::vector<std::shared_ptr<Ring>> rings;
+  // Held while writing records, so that Flush and the background thread never
+  // write at the same time.
+  std::mutex drain_mu;
+};
+
+State& GetState() {
+  static State* state = new State();
+  return *state;
+}
+
+// Writes every waiting record, in time order across threads.
+void Drain() {
+  State& state = GetState();
+  std::lock_guard<std::mutex> drain_lock(state.drain_mu);
+  std::vector<std::shared_ptr<Ring>> rings;
+  {
+    std::lock_guard<std::mutex> lock(state.rings_mu);
+    rings = state.rings;
+  }
+
+  std::vector<Slot*> pending;
+  std::vector<size_t> heads(rings.size());
+  std::vector<bool> closed(rings.size());
+  std::ostringstream out;
+  for (size_t i = 0; i < rings.size(); ++i) {
+    Ring& ring = *rings[i];
+    // Check closed before head, so that a closed ring's last records are seen.
+    closed[i] = ring.closed.load(std::memory_order_acquire);
+    heads[i] = ring.head.load(std::memory_order_acquire);
+    for (size_t t = ring.tail.load(std::memory_order_relaxed); t < heads[i];
+         ++t) {
+      pending.push_back(&ring.slots[t % kRingSlots]);
+    }
+    size_t dropped = ring.dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0) {
+      out << "[" << dropped << " log records dropped]\n";
+    }
+  }
+  std::stable_sort(pending.begin(), pending.end(),
+                   [](const Slot* a, const Slot* b) {
+                     return a->time < b->time;
+                   });
+  for (auto slot : pending) {
+    slot->format(out, slot->args);
+  }
+  for (size_t i = 0; i < rings.size(); ++i) {
+    rings[i]->tail.store(heads[i], std::memory_order_release);
+  }
+
+  // Write everything at once, so records from different threads are never
+  // interleaved.
+  const std::string buf = out.str();
+  size_t written = 0;
+  while (written < buf.size()) {
+    ssize_t n =
+        write(STDERR_FILENO, buf.data() + written, buf.size() - written);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    written += n;
+  }
+
+  // Free the rings of exited threads once they are empty.
+  std::lock_guard<std::mutex> lock(state.rings_mu);
+  for (size_t i = 0; i < rings.size(); ++i) {
+    if (closed[i]) {
+      state.rings.erase(
+          std::remove(state.rings.begin(), state.rings.end(), rings[i]),
+          state.rings.end());
+    }
+  }
+}
+
+// Starts the background thread and flushes at exit. Called when the first
+// ring is created, so a program that never logs never starts the thread.
+void StartWriter() {
+  static std::once_flag once;
+  std::call_once(once, [] {
+    std::thread([] {
+      while (true) {
+        Drain();
+        std::this_thread::sleep_for(kDrainInterval);
+      }
+    }).detach();
+    std::atexit(Flush);
+  });
+}
+
+// Owns the calling thread's ring, and closes it when the thread exits.
+struct RingHolder {
+  std::shared_ptr<Ring> ring;
+  ~RingHolder() {
+    if (ring) ring->closed.store(true, std::memory_order_release);
+  }
+};
+
+Ring& ThreadRing() {
+  thread_local RingHolder holder;
+  if (!holder.ring) {
+    holder.ring = std::make_shared<Ring>();
+    {
+      State& state = GetState();
+      std::lock_guard<std::mutex> lock(state.rings_mu);
+      state.rings.push_back(holder.ring);
+    }
+    StartWriter();
+  }
+  return *holder.ring;
+}
+
+}  // namespace
+
+namespace internal {
+
+void* Reserve() {
+  Ring& ring = ThreadRing();
+  size_t head = ring.head.load(std::memory_order_relaxed);
+  if (head - ring.tail.load(std::memory_order_acquire) >= kRingSlots) {
+    ring.dropped.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+  }
+  Slot& slot = ring.slots[head % kRingSlots];
+  slot.time = std::chrono::steady_clock::now();
+  return slot.args;
+}
+
+void Commit(FormatFn format) {
+  Ring& ring = ThreadRing();
+  size_t head = ring.head.load(std::memory_order_relaxed);
+  ring.slots[head % kRingSlots].format = format;
+  ring.head.store(head + 1, std::memory_order_release);
+}
+
+}  // namespace internal
+
+void Flush() { Drain(); }
 
 }  // namespace logging
@@ -2,35 +2,106 @@
 #define LOG_H_
 
 #include <atomic>
+#include <chrono>
+#include <cstddef>
 #include <iostream>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 
+// An asynchronous logger. Each thread appends records to its own lock-free
+// ring, holding copies of the values to log rather than formatted text. A
+// background thread formats the records in time order and writes each batch
+// with a single write to stderr, so records are never interleaved or split.
+// When a thread's ring is full, its records are dropped instead of blocking.
+//
+// Records are logged with the LOG macro:
+//
+//   LOG(Debug, "Received ", msg, " from p", from);
+//
+// which appends a newline. The values are formatted with operator<<, so they
+// must be copyable and, if pointers, point to static data like string
+// literals.
 namespace logging {
 
-// A logger that can be turned on or off. A better alternative would be to use
-// macros, but this isn't a performance critical application.
-class Logger {
- public:
-  Logger(std::ostream* output) : output_(output), enabled_(false){};
+enum class Level { Debug = 0, Info, Warning, Error, Off };
 
-  inline void enable(bool enable) { enabled_ = enable; };
+// The lowest level compiled into the program, set with `make LOG_LEVEL=...`.
+// Statements below it are removed entirely, arguments and all.
+#ifndef LOGGING_MIN_LEVEL
+#define LOGGING_MIN_LEVEL Debug
+#endif
+constexpr Level kMinLevel = Level::LOGGING_MIN_LEVEL;
+
+// The size of a record's copy of its values.
+const size_t kMaxRecordSize = 192;
+
+namespace internal {
+
+extern std::atomic<int> level;
+
+// Formats the values held at args to the stream and destroys them.
+typedef void (*FormatFn)(std::ostream& o, void* args);
+
+// Reserves space in the calling thread's ring for a record's values, or
+// returns nullptr if the ring is full. Must be followed by Commit.
+void* Reserve();
+void Commit(FormatFn format);
 
-  template <typename T>
-  const Logger& operator<<(const T& v) const {
-    if (enabled_) {
-      *output_ << v;
-    }
-    return *this;
-  }
+template <class Tuple, size_t... I>
+void FormatTuple(std::ostream& o, Tuple& t, std::index_sequence<I...>) {
+  using expand = int[];
+  (void)expand{0, ((void)(o << std::get<I>(t)), 0)...};
+}
 
- private:
-  std::ostream* output_;
-  std::atomic<bool> enabled_;
-};
+template <class Tuple>
+void FormatAndDestroy(std::ostream& o, void* args) {
+  Tuple* t = static_cast<Tuple*>(args);
+  FormatTuple(o, *t, std::make_index_sequence<std::tuple_size<Tuple>::value>());
+  t->~Tuple();
+}
 
-// The global logger. This should always be used instead of creating new Logger
-// instances.
-extern Logger out;
+}  // namespace internal
+
+// Sets the lowest level that is logged at runtime. Defaults to Info.
+inline void SetLevel(Level level) {
+  internal::level.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+// Determines if records at the level are logged.
+inline bool Enabled(Level level) {
+  return level >= kMinLevel &&
+         static_cast<int>(level) >=
+             internal::level.load(std::memory_order_relaxed);
+}
+
+// Appends a record of the values to the calling thread's ring. Prefer LOG,
+// which skips evaluating the values when the level is disabled.
+template <class... Args>
+void Log(Args&&... args) {
+  typedef std::tuple<typename std::decay<Args>::type...> Tuple;
+  static_assert(sizeof(Tuple) <= kMaxRecordSize,
+                "values are too large for a log record");
+  static_assert(alignof(Tuple) <= alignof(std::max_align_t),
+                "values are too strictly aligned for a log record");
+  void* slot = internal::Reserve();
+  if (slot == nullptr) return;
+  new (slot) Tuple(std::forward<Args>(args)...);
+  internal::Commit(&internal::FormatAndDestroy<Tuple>);
+}
+
+// Blocks until every record appended so far has been written. Called
+// automatically when the process exits.
+void Flush();
 
 }  // namespace logging
 
+#define LOG(level, ...)                            \
+  do {                                             \
+    if (logging::Enabled(logging::Level::level)) { \
+      logging::Log(__VA_ARGS__, "\n");             \
+    }                                              \
+  } while (0)
+
 #endif
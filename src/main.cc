@@ -1,16 +1,25 @@
+#include <signal.h>
+
+#include <chrono>
 #include <exception>
 #include <experimental/optional>
 #include <fstream>
+#include <future>
 #include <iostream>
 #include <memory>
 #include <set>
+#include <sstream>
 #include <string>
 #include <vector>
 
 #include "args.h"
+#include "byzantine.h"
+#include "capacity.h"
+#include "control.h"
 #include "general.h"
 #include "log.h"
 #include "net.h"
+#include "sim.h"
 
 const std::string program_desc =
     "An implementation of the Byzantine Agreement Algorithm.";
@@ -57,16 +66,125 @@ const std::string malicious_desc =
     "-\"silent\": send no messages (lieutenants only)\n"
     "-\"delay_send\": delays the send of messages\n"
     "-\"partial_send\": occasionally drop messages (lieutenants only)\n"
-    "-\"wrong_order\": occasionally send the wrong order (commander only)\n";
+    "-\"wrong_order\": occasionally send the wrong order or value (commander "
+    "only)\n";
 const std::string id_desc =
     "The optional id specifier of this process. Only needed if multiple "
     "processes in the hostfile are running on the same host, otherwise it can "
     "be deduced from the hostfile. 0-indexed.";
 const std::string verbose_desc = "Sets the logging level to verbose.";
+const std::string link_rate_desc =
+    "The link rate, in Mbit/s, assumed when checking that every round's "
+    "traffic fits within the round timeout. Configurations that cannot are "
+    "rejected at startup. Defaults to 1000.";
+const std::string transport_desc =
+    "The transport used to exchange messages. Options:\n"
+    "-\"udp\": UDP datagrams through a single socket (default)\n"
+    "-\"shm\": lock-free rings in shared memory. Every process in the "
+    "hostfile must be on the current host.\n";
+const std::string record_desc =
+    "Records every datagram this process receives, with its sender and a "
+    "monotonic timestamp, to the provided trace file.";
+const std::string replay_desc =
+    "Runs this lieutenant against the datagrams of a trace file recorded with "
+    "--record instead of the network, and reports how long it took to "
+    "decide. Must be run with the same hostfile, faulty count, commander id "
+    "and id as the recording.";
+const std::string replay_speed_desc =
+    "The pace at which --replay delivers datagrams, as a multiple of the "
+    "recorded pace. Defaults to 0, which delivers them as fast as possible.";
+const std::string report_desc =
+    "Prints a JSON report after deciding, with the decision, the "
+    "steady_clock time at which it was made, the time Decide took, and the "
+    "datagrams and bytes this process received.";
+const std::string metrics_desc =
+    "Writes every metric to the provided file as JSON after deciding: "
+    "messages sent and received per round, retransmissions, rejected "
+    "messages, and histograms of round and Decide durations. The metrics are "
+    "also printed to stderr in the Prometheus text format whenever the "
+    "process receives SIGUSR1.";
+const std::string timeline_desc =
+    "Records a timeline of rounds, send attempts, acks, round timeouts and "
+    "sender joins on every thread, and writes it to the provided file as "
+    "Chrome trace JSON after deciding. Open it in chrome://tracing or "
+    "Perfetto to see what each round waited on.";
+const std::string stats_interval_desc =
+    "Prints a table of the quality of the link to every peer to stderr at "
+    "the provided interval, in milliseconds, while deciding, and once more "
+    "after: RTT estimate, loss rate inferred from retransmissions, messages "
+    "and bytes in each direction, invalid messages received and when each "
+    "peer was last heard from.";
+const std::string instances_desc =
+    "The number of independent agreements to run, numbered from 0. They share "
+    "the process's socket and run concurrently, each with its own rounds. "
+    "Every process must be given the same count. Defaults to 1.";
+const std::string in_flight_desc =
+    "The most agreements the commander runs at once when --instances is "
+    "greater than 1. Lieutenants run every agreement they hear of. Defaults "
+    "to 16.";
+const std::string batch_desc =
+    "The number of orders each agreement decides at once. The commander "
+    "proposes its order in every slot, and each slot is agreed on "
+    "independently, while the rounds, paths and validation of the messages "
+    "are shared by the whole batch. Every process must be given the same "
+    "count. Defaults to 1.";
+const std::string value_desc =
+    "Agrees on the contents of a file instead of an order. The commander "
+    "proposes the contents of the provided file, of at most 16 MiB, and each "
+    "lieutenant writes the value it decides on to the provided file. Only the "
+    "SHA-256 digest of the value is relayed between lieutenants, while its "
+    "contents are sent once to every lieutenant and fetched again on demand. "
+    "Every process must pass the flag, with --instances and --batch of 1.";
+const std::string interactive_desc =
+    "Runs interactive consistency instead of a single broadcast: every "
+    "process passes --order and broadcasts it, and all processes agree on "
+    "the vector of every process's order. The broadcasts run in parallel and "
+    "share rounds, so the messages of a round to each process are sent "
+    "together. Every process must pass the flag, without --commander_id, "
+    "--instances, --batch or --value. Processes should be started together, "
+    "since a broadcast not heard within a round timeout of the start is "
+    "skipped.";
+const std::string daemon_desc =
+    "Runs as a long-running daemon instead of deciding once, with its socket, "
+    "peers and threads kept warm between agreements. Commands are read from "
+    "a Unix domain socket at the provided path, one per line: \"propose "
+    "<instance> <order>\" proposes the order as commander of the instance, "
+    "\"get <instance>\" replies with its decision, \"watch\" streams every "
+    "decision and \"shutdown\" stops the daemon. Every process must run as a "
+    "daemon, without --commander_id, --order, --instances, --batch, --value, "
+    "--interactive or --replay, and instance ids must be unique across the "
+    "cluster.";
+const std::string plan_program_desc =
+    "Reports the capacity needed to run the Byzantine Agreement Algorithm on "
+    "a cluster of a given shape: messages per round, bytes on the wire, peak "
+    "memory for a round's messages, and the minimum feasible round time.";
+const std::string processes_desc = "The total number of processes.";
+const std::string sim_program_desc =
+    "Simulates the Byzantine Agreement Algorithm on a virtual clock over a "
+    "simulated network, and reports how many runs agreed and how long they "
+    "took in virtual time. Runs are deterministic given the seed.";
+const std::string sim_order_desc =
+    "The order of the commander, either \"attack\" (default) or "
+    "\"retreat\".";
+const std::string runs_desc = "The number of agreements to simulate.";
+const std::string seed_desc =
+    "The seed of the first run. Run i is seeded with seed + i.";
+const std::string latency_desc =
+    "The minimum one-way latency of a datagram, in microseconds.";
+const std::string jitter_desc =
+    "The mean of the exponentially distributed delay added to every "
+    "datagram's latency, in microseconds. Reorders datagrams.";
+const std::string loss_desc =
+    "The probability that a datagram is dropped, from 0 to 1.";
+const std::string traitor_desc =
+    "A malicious behavior of a process, as <id>:<behavior>, where the "
+    "commander is id 0. Can be repeated. See --malicious of the main program "
+    "for the behaviors.";
 const std::string red_start = "\033[1;31m";
 const std::string red_end = "\033[0m";
 
 typedef args::ValueFlag<int> IntFlag;
+typedef args::ValueFlag<double> DoubleFlag;
 typedef args::ValueFlag<std::string> StringFlag;
 typedef args::ValueFlagList<std::string> StringFlagList;
 
@@ -128,15 +246,12 @@ int GetProcessId(const generals::ProcessList& processes) {
   return found;
 }
 
-// Validate the commander_id flag. While doing so, moves the commander to the
-// first entry in the ProcessList.
-void ValidateCommanderId(generals::ProcessList& processes, int commander_id) {
-  // Make sure the commander_id is valid
+// Validate the commander_id flag.
+void ValidateCommanderId(const generals::ProcessList& processes,
+                         int commander_id) {
   if (commander_id < 0 || (size_t)commander_id >= processes.size()) {
     throw args::ValidationError("commander_id does not reference a process");
   }
-  // Move the commander to the first element in the vector
-  std::iter_swap(processes.begin(), processes.begin() + commander_id);
 }
 
 // Validate the fault flag.
@@ -150,11 +265,52 @@ void ValidateFaultyCount(const generals::ProcessList& processes, int faulty) {
   }
 }
 
+// Validate that the cluster shape can run on links of the provided rate.
+void ValidateClusterShape(const generals::ProcessList& processes, int faulty,
+                          double link_rate_mbps) {
+  try {
+    generals::ValidateClusterShape(processes.size(), faulty, link_rate_mbps);
+  } catch (const std::invalid_argument& e) {
+    throw args::ValidationError(e.what());
+  }
+}
+
+// Validate the transport flag. The shared memory transport can only be used if
+// every process is on the current host.
+generals::Transport ValidateTransport(const generals::ProcessList& processes,
+                                      StringFlag& transport) {
+  auto t = generals::Transport::UDP;
+  if (transport) {
+    try {
+      t = generals::StringToTransport(args::get(transport));
+    } catch (const std::invalid_argument& e) {
+      throw args::ValidationError(e.what());
+    }
+  }
+  if (t == generals::Transport::SHM) {
+    auto hostname = net::GetHostname();
+    for (auto const& addr : processes) {
+      if (addr.hostname() != hostname && addr.hostname() != "localhost") {
+        throw args::ValidationError(
+            "the shm transport requires every process to run on this host");
+      }
+    }
+  }
+  return t;
+}
+
 // Validate the order flag. Returns a present Order if this process is the
-// commander, or an absent Order if it is not.
+// commander of orders, or an absent Order if it is not.
 std::experimental::optional<msg::Order> ValidateOrder(StringFlag& order,
-                                                      bool is_commander) {
-  if (is_commander) {
+                                                      bool is_commander,
+                                                      bool decides_value) {
+  if (is_commander && decides_value) {
+    if (order) {
+      throw args::ValidationError(
+          "the commander proposes a value instead of an order with --value");
+    }
+    return {};
+  } else if (is_commander) {
     if (!order) {
       throw args::UsageError("the commander must specify an order");
     }
@@ -182,9 +338,11 @@ const auto only_commander_behavior = std::set<generals::MaliciousBehavior>{
     generals::MaliciousBehavior::WRONG_ORDER,
 };
 
-// Determine which malicious behavior this process will exhibit.
+// Determine which malicious behavior this process will exhibit. A participant
+// in interactive consistency is both a commander and a lieutenant.
 generals::MaliciousBehavior GetMaliciousBehavior(StringFlagList& malicious,
-                                                 bool is_commander) {
+                                                 bool is_commander,
+                                                 bool is_lieutenant) {
   // Create the MaliciousBehavior instance.
   generals::MaliciousBehavior b = generals::MaliciousBehavior::NONE;
   try {
@@ -196,7 +354,7 @@ generals::MaliciousBehavior GetMaliciousBehavior(StringFlagList& malicious,
   }
 
   // Validate that the malicious behavior is valid for the general type.
-  if (is_commander) {
+  if (!is_lieutenant) {
     for (auto const& not_avail : only_lieutenant_behavior) {
       if (generals::Exhibits(b, not_avail)) {
         throw args::ValidationError(
@@ -204,7 +362,8 @@ generals::MaliciousBehavior GetMaliciousBehavior(StringFlagList& malicious,
             generals::MaliciousBehaviorString(not_avail) + "\"");
       }
     }
-  } else {
+  }
+  if (!is_commander) {
     for (auto const& not_avail : only_commander_behavior) {
       if (generals::Exhibits(b, not_avail)) {
         throw args::ValidationError(
@@ -222,7 +381,224 @@ void PrintOrder(int id, msg::Order decision) {
   std::cout << id << ": Agreed on " << msg::OrderString(decision) << std::endl;
 }
 
+// Prints the value that our process decided upon to stdout.
+void PrintValue(int id, const std::experimental::optional<std::string>& value) {
+  std::cout << id << ": Agreed on ";
+  if (value) {
+    std::cout << "value " << msg::DigestString(payload::DigestOf(*value))
+              << " (" << value->size() << " bytes)" << std::endl;
+  } else {
+    std::cout << "no value" << std::endl;
+  }
+}
+
+// Prints the vector of orders that our process decided upon to stdout.
+void PrintVector(int id, const std::vector<msg::Orders>& decisions) {
+  std::cout << id << ": Agreed on vector [";
+  for (size_t pid = 0; pid < decisions.size(); ++pid) {
+    if (pid > 0) std::cout << ", ";
+    std::cout << msg::OrderString(decisions[pid].At(0));
+  }
+  std::cout << "]" << std::endl;
+}
+
+// Waits for the future, printing the General's link table to stderr at the
+// provided interval, in milliseconds, meanwhile, if one is given.
+template <class T>
+void PrintLinksUntilReady(const std::future<T>& future,
+                          const generals::General& general,
+                          IntFlag& stats_interval) {
+  if (!stats_interval) {
+    future.wait();
+    return;
+  }
+  const auto interval = std::chrono::milliseconds{args::get(stats_interval)};
+  while (future.wait_for(interval) != std::future_status::ready) {
+    general.PrintLinks(std::cerr);
+  }
+}
+
+// Reads the whole file, throwing an exception on error.
+std::string ReadFile(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("could not open value file " + path);
+  }
+  std::ostringstream contents;
+  contents << file.rdbuf();
+  return contents.str();
+}
+
+// Prints how many of the slots of every instance agreed on each order, and
+// how many decisions were made per second.
+void PrintDecisions(int id, const std::vector<msg::Orders>& decisions,
+                    std::chrono::steady_clock::duration elapsed) {
+  size_t attack = 0;
+  size_t total = 0;
+  for (auto const& batch : decisions) {
+    for (size_t slot = 0; slot < batch.Slots(); ++slot) {
+      if (batch.At(slot) == msg::Order::ATTACK) attack++;
+    }
+    total += batch.Slots();
+  }
+  double secs = std::chrono::duration<double>(elapsed).count();
+  std::cout << id << ": Agreed on " << msg::OrderString(msg::Order::ATTACK)
+            << " in " << attack << " and "
+            << msg::OrderString(msg::Order::RETREAT) << " in "
+            << total - attack << " of " << total << " decisions over "
+            << decisions.size() << " instances, " << total / secs
+            << " decisions/s" << std::endl;
+}
+
+// Prints the report requested with --report as a single JSON line.
+void PrintReport(int id, const std::string& decision,
+                 std::chrono::steady_clock::time_point decided,
+                 std::chrono::steady_clock::duration elapsed,
+                 const transport::Traffic& traffic) {
+  std::cout << "{\"id\": " << id << ", \"decision\": \"" << decision
+            << "\", \"decided_ns\": "
+            << std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   decided.time_since_epoch())
+                   .count()
+            << ", \"elapsed_us\": "
+            << std::chrono::duration<double, std::micro>(elapsed).count()
+            << ", \"messages_received\": " << traffic.messages
+            << ", \"acks_received\": " << traffic.acks
+            << ", \"bytes_received\": " << traffic.bytes << "}" << std::endl;
+}
+
+// Runs the "plan" subcommand, which prints the capacity plan for a cluster
+// shape.
+int RunPlanner(int argc, const char** argv) {
+  args::ArgumentParser parser(plan_program_desc);
+  args::HelpFlag help(parser, "help", help_desc, {"help"});
+  IntFlag processes(parser, "processes", processes_desc, {'n', "processes"});
+  IntFlag faulty(parser, "faulty", faulty_desc, {'f', "faulty"});
+  DoubleFlag link_rate(parser, "link_rate", link_rate_desc,
+                       {'r', "link_rate"}, generals::kDefaultLinkRateMbps);
+
+  try {
+    parser.ParseCLI(argc, argv);
+
+    if (!processes) throw args::UsageError("--processes is a required flag");
+    if (!faulty) throw args::UsageError("--faulty is a required flag");
+    auto processes_val = args::get(processes);
+    auto faulty_val = args::get(faulty);
+    if (processes_val < 0 || faulty_val < 0) {
+      throw args::ValidationError("counts must be non-negative");
+    }
+
+    auto plan = generals::PlanCapacity(processes_val, faulty_val,
+                                       args::get(link_rate));
+    std::cout << plan;
+    return plan.feasible ? 0 : 2;
+  } catch (const args::Help&) {
+    std::cout << parser;
+    return 0;
+  } catch (const args::UsageError& e) {
+    std::cerr << "\n  " << red_start << e.what() << red_end << "\n\n";
+    std::cerr << parser;
+    return 1;
+  } catch (const std::exception& e) {
+    std::cerr << red_start << e.what() << red_end << "\n";
+    return 1;
+  }
+}
+
+// Parses the <id>:<behavior> traitor flags into per-process behaviors.
+std::vector<generals::MaliciousBehavior> GetTraitors(
+    StringFlagList& traitors, size_t process_num) {
+  std::vector<generals::MaliciousBehavior> behaviors(
+      process_num, generals::MaliciousBehavior::NONE);
+  for (auto const& traitor : args::get(traitors)) {
+    auto sep = traitor.find(':');
+    if (sep == std::string::npos) {
+      throw args::ValidationError("traitors must be given as <id>:<behavior>");
+    }
+    size_t pid;
+    try {
+      pid = std::stoul(traitor.substr(0, sep));
+    } catch (const std::exception&) {
+      throw args::ValidationError("invalid traitor id in " + traitor);
+    }
+    if (pid >= process_num) {
+      throw args::ValidationError("traitor id out of range in " + traitor);
+    }
+    try {
+      behaviors[pid] |=
+          generals::StringToMaliciousBehavior(traitor.substr(sep + 1));
+    } catch (const std::invalid_argument& e) {
+      throw args::ValidationError(e.what());
+    }
+  }
+  return behaviors;
+}
+
+// Runs the "simulate" subcommand, which runs agreements in the discrete-event
+// simulator.
+int RunSimulator(int argc, const char** argv) {
+  args::ArgumentParser parser(sim_program_desc);
+  args::HelpFlag help(parser, "help", help_desc, {"help"});
+  IntFlag processes(parser, "processes", processes_desc, {'n', "processes"});
+  IntFlag faulty(parser, "faulty", faulty_desc, {'f', "faulty"});
+  StringFlag order(parser, "order", sim_order_desc, {'o', "order"}, "attack");
+  IntFlag runs(parser, "runs", runs_desc, {"runs"}, 1000);
+  IntFlag seed(parser, "seed", seed_desc, {"seed"}, 1);
+  IntFlag latency(parser, "latency", latency_desc, {"latency"}, 100);
+  IntFlag jitter(parser, "jitter", jitter_desc, {"jitter"}, 50);
+  DoubleFlag loss(parser, "loss", loss_desc, {"loss"}, 0);
+  StringFlagList traitors(parser, "traitor", traitor_desc, {"traitor"});
+
+  try {
+    parser.ParseCLI(argc, argv);
+
+    if (!processes) throw args::UsageError("--processes is a required flag");
+    if (!faulty) throw args::UsageError("--faulty is a required flag");
+    if (args::get(processes) < 0 || args::get(faulty) < 0 ||
+        args::get(runs) < 0 || args::get(latency) < 0 ||
+        args::get(jitter) < 0) {
+      throw args::ValidationError("counts and durations must be non-negative");
+    }
+    if (args::get(loss) < 0 || args::get(loss) >= 1) {
+      throw args::ValidationError("loss must be in [0, 1)");
+    }
+
+    sim::Config config;
+    config.process_num = args::get(processes);
+    config.faulty = args::get(faulty);
+    try {
+      config.order = msg::StringToOrder(args::get(order));
+    } catch (const std::invalid_argument& e) {
+      throw args::ValidationError(e.what());
+    }
+    config.behaviors = GetTraitors(traitors, config.process_num);
+    config.network.latency = std::chrono::microseconds{args::get(latency)};
+    config.network.jitter = std::chrono::microseconds{args::get(jitter)};
+    config.network.loss = args::get(loss);
+
+    std::cout << sim::SimulateMany(config, args::get(seed), args::get(runs));
+    return 0;
+  } catch (const args::Help&) {
+    std::cout << parser;
+    return 0;
+  } catch (const args::UsageError& e) {
+    std::cerr << "\n  " << red_start << e.what() << red_end << "\n\n";
+    std::cerr << parser;
+    return 1;
+  } catch (const std::exception& e) {
+    std::cerr << red_start << e.what() << red_end << "\n";
+    return 1;
+  }
+}
+
 int main(int argc, const char** argv) {
+  if (argc > 1 && std::string(argv[1]) == "plan") {
+    return RunPlanner(argc - 1, argv + 1);
+  }
+  if (argc > 1 && std::string(argv[1]) == "simulate") {
+    return RunSimulator(argc - 1, argv + 1);
+  }
+
   args::ArgumentParser parser(program_desc);
   args::HelpFlag help(parser, "help", help_desc, {"help"});
   IntFlag port(parser, "port", port_desc, {'p', "port"});
@@ -234,20 +610,57 @@ int main(int argc, const char** argv) {
                            {'m', "malicious"});
   IntFlag id(parser, "id", id_desc, {'i', "id"});
   args::Flag verbose(parser, "verbose", verbose_desc, {'v', "verbose"});
+  DoubleFlag link_rate(parser, "link_rate", link_rate_desc,
+                       {"link_rate"}, generals::kDefaultLinkRateMbps);
+  StringFlag transport(parser, "transport", transport_desc, {"transport"});
+  StringFlag record(parser, "record", record_desc, {"record"});
+  StringFlag replay(parser, "replay", replay_desc, {"replay"});
+  DoubleFlag replay_speed(parser, "replay_speed", replay_speed_desc,
+                          {"replay_speed"}, 0);
+  args::Flag report(parser, "report", report_desc, {"report"});
+  StringFlag metrics_file(parser, "metrics", metrics_desc, {"metrics"});
+  StringFlag timeline_file(parser, "timeline", timeline_desc, {"timeline"});
+  IntFlag stats_interval(parser, "stats_interval", stats_interval_desc,
+                         {"stats_interval"});
+  IntFlag instances(parser, "instances", instances_desc, {"instances"}, 1);
+  IntFlag in_flight(parser, "in_flight", in_flight_desc, {"in_flight"}, 16);
+  IntFlag batch(parser, "batch", batch_desc, {"batch"}, 1);
+  StringFlag value_file(parser, "value", value_desc, {"value"});
+  args::Flag interactive(parser, "interactive", interactive_desc,
+                         {"interactive"});
+  StringFlag daemon_socket(parser, "daemon", daemon_desc, {"daemon"});
 
   try {
     parser.ParseCLI(argc, argv);
 
+    // Dump metrics on demand. Must happen before any thread is started.
+    metrics::DumpOnSignal(SIGUSR1, &std::cerr);
+    if (timeline_file) {
+      timeline::Enable();
+      timeline::NameThread("main");
+    }
+
     // Set up logging.
-    logging::out.enable(verbose);
+    logging::SetLevel(verbose ? logging::Level::Debug : logging::Level::Info);
 
     // Check required fields.
     if (!hostfile) throw args::UsageError("--hostfile is a required flag");
     if (!faulty) throw args::UsageError("--faulty is a required flag");
-    if (!cmdr_id) throw args::UsageError("--commander_id is a required flag");
+    if (!cmdr_id && !interactive && !daemon_socket) {
+      throw args::UsageError("--commander_id is a required flag");
+    }
+    if (cmdr_id && interactive) {
+      throw args::ValidationError(
+          "every process commands its own broadcast with --interactive");
+    }
+    if (daemon_socket && (cmdr_id || order || instances || batch ||
+                          value_file || interactive || replay)) {
+      throw args::ValidationError(
+          "commanders and orders are given over the control socket with "
+          "--daemon");
+    }
     auto hostfile_val = args::get(hostfile);
     auto faulty_val = args::get(faulty);
-    auto commander_id_val = args::get(cmdr_id);
 
     // Get the default process port, if one is supplied.
     std::experimental::optional<unsigned short> default_port;
@@ -266,34 +679,166 @@ int main(int argc, const char** argv) {
     } else {
       my_id = GetProcessId(processes);
     }
-    auto server_port = processes.at(my_id).port();
-
-    // Validate commander_id and faulty count flags.
-    ValidateCommanderId(processes, commander_id_val);
+    // Validate commander_id and faulty count flags. In interactive
+    // consistency and daemons, every process commands instances of its own.
+    const bool any_commander = interactive || daemon_socket;
+    const int commander_id_val = any_commander ? my_id : args::get(cmdr_id);
+    if (!any_commander) ValidateCommanderId(processes, commander_id_val);
     ValidateFaultyCount(processes, faulty_val);
+    ValidateClusterShape(processes, faulty_val, args::get(link_rate));
+    auto transport_val = ValidateTransport(processes, transport);
+
+    if (args::get(instances) <= 0 || args::get(in_flight) <= 0) {
+      throw args::ValidationError(
+          "--instances and --in_flight must be positive");
+    }
+    if (args::get(batch) <= 0 ||
+        (size_t)args::get(batch) > generals::MaxSlots(faulty_val)) {
+      throw args::ValidationError(
+          "--batch must be positive and at most " +
+          std::to_string(generals::MaxSlots(faulty_val)) +
+          " for messages to fit in a datagram");
+    }
+    if (value_file && (args::get(instances) != 1 || args::get(batch) != 1)) {
+      throw args::ValidationError(
+          "--value decides a single value, with --instances and --batch of 1");
+    }
+    if (interactive && (instances || batch || value_file || replay)) {
+      throw args::ValidationError(
+          "--interactive decides one order per process, without "
+          "--instances, --batch, --value or --replay");
+    }
 
     // Determine if the current process is the commander, and if so, what order
     // they should use.
-    bool is_commander = my_id == commander_id_val;
-    auto order_val = ValidateOrder(order, is_commander);
+    bool is_commander = my_id == commander_id_val && !daemon_socket;
+    auto order_val = ValidateOrder(order, is_commander, bool{value_file});
 
     // Determine which malicious behavior this process will exhibit.
     generals::MaliciousBehavior behavior =
-        GetMaliciousBehavior(malicious, is_commander);
+        GetMaliciousBehavior(malicious, is_commander || any_commander,
+                             !is_commander || any_commander);
+
+    // Describe the General to the library.
+    byzantine::Config config;
+    config.processes = processes;
+    config.id = my_id;
+    config.faulty = faulty_val;
+    config.commander = commander_id_val;
+    config.interactive = interactive;
+    if (order_val) config.order = *order_val;
+    config.decides_value = bool{value_file};
+    if (is_commander && value_file) {
+      config.value = ReadFile(args::get(value_file));
+      if (config.value.size() > payload::kMaxPayloadSize) {
+        throw args::ValidationError("--value file is larger than 16 MiB");
+      }
+    }
+    config.batch = args::get(batch);
+    config.transport = transport_val;
+    config.behavior = behavior;
 
-    // Create the General depending on it is the Commander or a Lieutenant.
-    std::unique_ptr<generals::General> general;
-    if (is_commander) {
-      general = std::make_unique<generals::Commander>(processes, faulty_val,
-                                                      *order_val, behavior);
+    // Create the server, which replays a trace instead of using the network
+    // if requested.
+    std::shared_ptr<transport::Server> server;
+    std::shared_ptr<replay::Server> replayer;
+    if (replay) {
+      if (is_commander) {
+        throw args::ValidationError("only a lieutenant can replay a trace");
+      }
+      replayer =
+          generals::ReplayServer(args::get(replay), args::get(replay_speed));
+      server = replayer;
     } else {
-      general = std::make_unique<generals::Lieutenant>(
-          processes, my_id, server_port, faulty_val, behavior);
+      server = byzantine::NewServer(config);
+    }
+    if (record) {
+      server->Record(std::make_shared<trace::Writer>(args::get(record)));
     }
 
-    // Run the algorithm by calling Decide() and print the results.
-    msg::Order decision = general->Decide();
-    PrintOrder(my_id, decision);
+    // Serve the control socket until told to shut down, if running as a
+    // daemon.
+    if (daemon_socket) {
+      byzantine::Node node(config, server);
+      control::Server control(args::get(daemon_socket), node);
+      LOG(Info, "Listening for commands on ", args::get(daemon_socket));
+      // A shutdown command stops the Node, and Wait returns once it has
+      // stopped deciding, so it is stopped before the control server is
+      // destroyed.
+      node.Wait();
+      return 0;
+    }
+
+    if (stats_interval && args::get(stats_interval) <= 0) {
+      throw args::ValidationError("--stats_interval must be positive");
+    }
+
+    // Run the algorithm on a thread of the library, printing the link table
+    // periodically while it decides if requested, and print the results.
+    auto general = byzantine::NewGeneral(config, server);
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<msg::Orders> decisions;
+    std::experimental::optional<std::string> value;
+    std::string decision;
+    if (value_file) {
+      auto future = byzantine::DecideValueAsync(general);
+      PrintLinksUntilReady(future, *general, stats_interval);
+      value = future.get();
+      decision = value ? msg::DigestString(payload::DigestOf(*value))
+                       : "no value";
+    } else {
+      auto future =
+          interactive
+              ? byzantine::DecideAsync(general, processes.size(), 1)
+              : byzantine::DecideAsync(general, args::get(instances),
+                                       args::get(in_flight));
+      PrintLinksUntilReady(future, *general, stats_interval);
+      decisions = future.get();
+      decision = msg::OrderString(decisions.front().At(0));
+    }
+    const auto decided = std::chrono::steady_clock::now();
+    if (stats_interval) general->PrintLinks(std::cerr);
+    const auto elapsed = decided - start;
+    if (value_file) {
+      PrintValue(my_id, value);
+      if (!is_commander && value) {
+        std::ofstream file(args::get(value_file), std::ios::binary);
+        if (!file || !file.write(value->data(), value->size())) {
+          throw std::runtime_error("could not write value file " +
+                                   args::get(value_file));
+        }
+      }
+    } else if (interactive) {
+      PrintVector(my_id, decisions);
+    } else if (decisions.size() == 1 && decisions.front().Slots() == 1) {
+      PrintOrder(my_id, decisions.front().At(0));
+    } else {
+      PrintDecisions(my_id, decisions, elapsed);
+    }
+    if (report) {
+      PrintReport(my_id, decision, decided, elapsed, server->Received());
+    }
+    if (replayer) {
+      std::cout << "Replayed " << replayer->Replayed() << " datagrams in "
+                << std::chrono::duration<double, std::micro>(elapsed).count()
+                << "us" << std::endl;
+    }
+    if (metrics_file) {
+      std::ofstream file(args::get(metrics_file));
+      if (!file) {
+        throw std::runtime_error("could not open metrics file " +
+                                 args::get(metrics_file));
+      }
+      metrics::Default().WriteJson(file);
+    }
+    if (timeline_file) {
+      std::ofstream file(args::get(timeline_file));
+      if (!file) {
+        throw std::runtime_error("could not open timeline file " +
+                                 args::get(timeline_file));
+      }
+      timeline::WriteChromeTrace(file);
+    }
   } catch (const args::Help) {
     std::cout << parser;
     return 0;
@@ -21,19 +21,113 @@ std::string OrderString(Order o) {
   }
 }
 
+Orders::Orders(Order o) : Orders(1, o) {}
+
+Orders::Orders(size_t slots, Order fill) : slots_(slots), inline_{0, 0} {
+  if (slots_ > 64) heap_.assign(2 * Words(), 0);
+  for (size_t w = 0; w < Words(); ++w) {
+    if (fill == Order::RETREAT) Retreat(w) = Mask(w);
+    if (fill == Order::ATTACK) Attack(w) = Mask(w);
+  }
+}
+
+Order Orders::At(size_t slot) const {
+  const uint64_t bit = uint64_t{1} << (slot % 64);
+  const bool retreat = Retreat(slot / 64) & bit;
+  const bool attack = Attack(slot / 64) & bit;
+  if (retreat == attack) return Order::NO_ORDER;
+  return retreat ? Order::RETREAT : Order::ATTACK;
+}
+
+void Orders::Set(size_t slot, Order o) {
+  const uint64_t bit = uint64_t{1} << (slot % 64);
+  Retreat(slot / 64) &= ~bit;
+  Attack(slot / 64) &= ~bit;
+  if (o == Order::RETREAT) Retreat(slot / 64) |= bit;
+  if (o == Order::ATTACK) Attack(slot / 64) |= bit;
+}
+
+bool Orders::Any() const {
+  for (size_t w = 0; w < Words(); ++w) {
+    if (Retreat(w) | Attack(w)) return true;
+  }
+  return false;
+}
+
+bool Orders::Single() const {
+  for (size_t w = 0; w < Words(); ++w) {
+    if (Retreat(w) & Attack(w)) return false;
+  }
+  return true;
+}
+
+bool operator==(const Orders& lhs, const Orders& rhs) {
+  if (lhs.Slots() != rhs.Slots()) return false;
+  for (size_t w = 0; w < lhs.Words(); ++w) {
+    if (lhs.Retreat(w) != rhs.Retreat(w) || lhs.Attack(w) != rhs.Attack(w)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool operator<(const Orders& lhs, const Orders& rhs) {
+  if (lhs.Slots() != rhs.Slots()) {
+    return lhs.Slots() < rhs.Slots();
+  }
+  for (size_t w = 0; w < lhs.Words(); ++w) {
+    if (lhs.Retreat(w) != rhs.Retreat(w)) {
+      return lhs.Retreat(w) < rhs.Retreat(w);
+    }
+    if (lhs.Attack(w) != rhs.Attack(w)) {
+      return lhs.Attack(w) < rhs.Attack(w);
+    }
+  }
+  return false;
+}
+
+std::string DigestString(const Digest& d) {
+  static const char kHex[] = "0123456789abcdef";
+  std::string str;
+  for (size_t i = 0; i < 8; ++i) {
+    str.push_back(kHex[d[i] >> 4]);
+    str.push_back(kHex[d[i] & 0xf]);
+  }
+  return str;
+}
+
 bool operator<(const Message& lhs, const Message& rhs) {
+  if (lhs.instance != rhs.instance) {
+    return lhs.instance < rhs.instance;
+  }
   if (lhs.round != rhs.round) {
     return lhs.round < rhs.round;
   }
   if (lhs.ids != rhs.ids) {
     return lhs.ids < rhs.ids;
   }
-  return lhs.order < rhs.order;
+  if (lhs.value != rhs.value) {
+    return lhs.value < rhs.value;
+  }
+  return lhs.orders < rhs.orders;
 }
 
 std::ostream& operator<<(std::ostream& o, const Message& m) {
-  o << "{round: " << m.round << ", order: " << OrderString(m.order)
-    << ", ids: <";
+  o << "{instance: " << m.instance << ", round: " << m.round;
+  if (m.orders.Slots() == kValueSlots) {
+    o << ", value: " << (m.value == kNoValue ? "none" : DigestString(m.value));
+  } else if (m.orders.Slots() == 1) {
+    o << ", order: " << OrderString(m.orders.At(0));
+  } else {
+    // Summarize large batches rather than printing every slot.
+    size_t counts[3] = {};
+    for (size_t i = 0; i < m.orders.Slots(); ++i) {
+      counts[static_cast<int>(m.orders.At(i))]++;
+    }
+    o << ", orders: {retreat: " << counts[0] << ", attack: " << counts[1]
+      << ", no order: " << counts[2] << "}";
+  }
+  o << ", ids: <";
   for (size_t i = 0; i < m.ids.size(); ++i) {
     if (i > 0) o << ' ';
     o << m.ids[i];
@@ -1,6 +1,8 @@
 #ifndef MESSAGE_H_
 #define MESSAGE_H_
 
+#include <array>
+#include <cstdint>
 #include <exception>
 #include <iostream>
 #include <string>
@@ -8,6 +10,14 @@
 
 const uint32_t kByzantineMessageType = 1;
 const uint32_t kAckType = 2;
+const uint32_t kChunkType = 3;
+const uint32_t kFetchType = 4;
+const uint32_t kBundleType = 5;
+const uint32_t kHelloType = 6;
+const uint32_t kCatchUpType = 7;
+const uint32_t kRoundReportType = 8;
+const uint32_t kHeartbeatType = 9;
+const uint32_t kProofType = 10;
 
 namespace msg {
 
@@ -16,21 +26,103 @@ namespace msg {
 // and decoding bytes to and from sockets, but is quickly transformed into
 // a Message.
 typedef struct {
-  uint32_t type;   // Must be equal to 1
-  uint32_t size;   // size of message in bytes
-  uint32_t round;  // round number
-  uint32_t order;  // the order (retreat = 0, attack = 1, no order = 2)
-  uint32_t ids[];  // id’s of the senders of this message
+  uint32_t type;      // Must be equal to 1
+  uint32_t size;      // size of message in bytes
+  uint32_t seq;       // sequence number, echoed in the ack
+  uint32_t instance;  // agreement instance, echoed in the ack
+  uint32_t round;     // round number
+  uint32_t slots;     // number of orders in the message, or kValueSlots
+  uint32_t ids[];     // id’s of the senders of this message (round + 1),
+                      // followed by the orders as a retreat bitmask and an
+                      // attack bitmask of OrderWords(slots) words each, or
+                      // by the digest of a value if slots is kValueSlots
 } ByzantineMessage;
 
+// A proof has the layout of a ByzantineMessage with type kProofType. It is a
+// message that its sender received earlier in the instance and that first
+// carried one of the orders or the value it has seen, sent again as it arrived
+// to a lieutenant that is catching up (see LieutenantMachine::AddProof). It is
+// acknowledged like a ByzantineMessage.
+
 // Ack is the wire format of an acknowledgement message used to provided
 // reliable communication.
 typedef struct {
-  uint32_t type;   // Must be equal to 2
-  uint32_t size;   // size of message in bytes
-  uint32_t round;  // round number
+  uint32_t type;      // Must be equal to 2
+  uint32_t size;      // size of message in bytes
+  uint32_t instance;  // agreement instance of the acknowledged message
+  uint32_t round;     // round number
+  uint32_t seq;       // sequence number of the acknowledged message
 } Ack;
 
+// Bundle is the wire format of several messages to the same process, coalesced
+// into one datagram and acknowledged together (see Participant).
+typedef struct {
+  uint32_t type;   // Must be equal to 5
+  uint32_t size;   // size of message in bytes
+  uint32_t seq;    // sequence number, echoed in the ack
+  uint32_t round;  // round the messages are sent in, echoed in the ack
+  uint32_t count;  // number of messages
+  char msgs[];     // the messages, each a ByzantineMessage of its own size
+} Bundle;
+
+// Hello is the wire format of a commander's check that a process is listening
+// before it sends the first round (see General::Rendezvous). It is answered
+// with an Ack of its sequence number.
+typedef struct {
+  uint32_t type;  // Must be equal to 6
+  uint32_t size;  // size of message in bytes
+  uint32_t seq;   // sequence number, echoed in the ack
+} Hello;
+
+// CatchUp is the wire format of a lagging lieutenant's request for the round an
+// instance has reached at another process. The process answers with the
+// proofs of the orders it has seen (see kProofType), then a RoundReport, and
+// sends the messages of that round to the requester again. Neither the request
+// nor the report is acknowledged: requests are repeated until the lieutenant
+// catches up.
+typedef struct {
+  uint32_t type;      // Must be equal to 7
+  uint32_t size;      // size of message in bytes
+  uint32_t instance;  // agreement instance
+} CatchUp;
+
+// RoundReport is the wire format of the answer to a CatchUp.
+typedef struct {
+  uint32_t type;      // Must be equal to 8
+  uint32_t size;      // size of message in bytes
+  uint32_t instance;  // agreement instance
+  uint32_t round;     // round the instance is in, or its last if decided
+} RoundReport;
+
+// Heartbeat is the wire format of a lieutenant's periodic notice that it is
+// still running, from which the others detect failed processes (see
+// Lieutenant). It is not acknowledged.
+typedef struct {
+  uint32_t type;  // Must be equal to 9
+  uint32_t size;  // size of message in bytes
+} Heartbeat;
+
+// Chunk is the wire format of a piece of the payload of a value. Payloads are
+// split into chunks that each fit in a datagram, and are sent without
+// acknowledgements: missing chunks are requested again with a Fetch.
+typedef struct {
+  uint32_t type;          // Must be equal to 3
+  uint32_t size;          // size of message in bytes
+  uint8_t digest[32];     // digest of the whole payload
+  uint32_t payload_size;  // size of the whole payload in bytes
+  uint32_t index;         // index of the chunk in the payload
+  char data[];            // the chunk's bytes, up to the end of the message
+} Chunk;
+
+// Fetch is the wire format of a request for a range of a payload's chunks.
+typedef struct {
+  uint32_t type;       // Must be equal to 4
+  uint32_t size;       // size of message in bytes
+  uint8_t digest[32];  // digest of the payload
+  uint32_t first;      // index of the first chunk wanted
+  uint32_t count;      // number of chunks wanted
+} Fetch;
+
 // Order is the type of order that the Generals are attempting to come to
 // a consensus on in the Byzantine Agreement Algorithm. RETREAT and ATTACK
 // are the two options, while NO_ORDER is used in empty messages where no Order
@@ -47,12 +139,91 @@ Order StringToOrder(std::string str);
 // Returns the string representation of the provided Order.
 std::string OrderString(Order o);
 
+// Returns the number of 32 bit words each bitmask of a batch of orders takes
+// on the wire.
+inline size_t OrderWords(size_t slots) { return (slots + 31) / 32; }
+
+// A batch of orders, one per slot, held as a bitmask per order: slot i holds
+// RETREAT if bit i of the retreat mask is set, ATTACK if bit i of the attack
+// mask is, and NO_ORDER if neither is. This lets the orders of every slot be
+// relayed and decided on 64 slots at a time. The same representation holds a
+// set of orders per slot, like the orders a lieutenant has seen, in which
+// case a slot may have both bits set. Batches of up to 64 slots are stored
+// inline.
+class Orders {
+ public:
+  // A batch of a single order, so that Messages can be built from an Order.
+  Orders(Order o = Order::NO_ORDER);
+  // A batch of the provided number of slots, all holding the order.
+  Orders(size_t slots, Order fill);
+
+  inline size_t Slots() const { return slots_; }
+  // The number of 64 bit words in each mask.
+  inline size_t Words() const { return (slots_ + 63) / 64; }
+
+  // Word w of each mask. Bits past the last slot are always clear.
+  inline uint64_t& Retreat(size_t w) { return Data()[2 * w]; }
+  inline uint64_t& Attack(size_t w) { return Data()[2 * w + 1]; }
+  inline uint64_t Retreat(size_t w) const { return Data()[2 * w]; }
+  inline uint64_t Attack(size_t w) const { return Data()[2 * w + 1]; }
+  // The bits of word w that belong to a slot.
+  inline uint64_t Mask(size_t w) const {
+    size_t bits = slots_ - 64 * w;
+    return bits >= 64 ? ~uint64_t{0} : (uint64_t{1} << bits) - 1;
+  }
+
+  // Returns the order of the slot. Slots holding both orders are reported as
+  // NO_ORDER.
+  Order At(size_t slot) const;
+  void Set(size_t slot, Order o);
+
+  // Determines if any slot holds an order.
+  bool Any() const;
+  // Determines if no slot holds both orders, as in a valid batch.
+  bool Single() const;
+
+ private:
+  uint32_t slots_;
+  // The masks, interleaved by word.
+  uint64_t inline_[2];
+  std::vector<uint64_t> heap_;
+
+  inline uint64_t* Data() { return slots_ <= 64 ? inline_ : heap_.data(); }
+  inline const uint64_t* Data() const {
+    return slots_ <= 64 ? inline_ : heap_.data();
+  }
+};
+
+bool operator==(const Orders& lhs, const Orders& rhs);
+bool operator<(const Orders& lhs, const Orders& rhs);
+
+// The SHA-256 digest of the payload of a value. Values can be megabytes long,
+// so only their digests are relayed in the rounds of the algorithm, while the
+// payloads themselves travel as Chunks (see payload::Store).
+typedef std::array<uint8_t, 32> Digest;
+
+// The digest carried by messages that report no new value, the counterpart of
+// NO_ORDER.
+const Digest kNoValue = {};
+
+// The slot count of messages that carry the digest of a value instead of a
+// batch of orders.
+const size_t kValueSlots = 0;
+
+// Returns a short hex prefix of the digest, for printing.
+std::string DigestString(const Digest& d);
+
 // Message is a convenient representation of a Byzantine message. It should be
 // favored over ByzantineMessage for all uses except encoding and decoding.
 struct Message {
   unsigned int round;
-  Order order;
+  Orders orders;
   std::vector<unsigned int> ids;
+  // The agreement instance the message belongs to, when a process runs many
+  // at once (see General::DecideInstances).
+  unsigned int instance;
+  // The digest of the value, if orders has kValueSlots slots.
+  Digest value;
 };
 
 // Needed so that Message can be added to std::set.
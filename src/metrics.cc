@@ -0,0 +1,292 @@
+#include "metrics.h"
+
+#include <pthread.h>
+#include <signal.h>
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace metrics {
+
+namespace {
+
+// Assigns each thread the next counter shard as it first adds to a counter.
+size_t ThreadShard() {
+  static std::atomic<size_t> next_shard{0};
+  thread_local size_t shard =
+      next_shard.fetch_add(1, std::memory_order_relaxed) % kCounterShards;
+  return shard;
+}
+
+// Converts a value in microseconds to seconds.
+inline double Seconds(uint64_t us) { return us / 1e6; }
+
+// Writes the labels as the body of a JSON object.
+void WriteJsonLabels(std::ostream& o, const Labels& labels) {
+  o << "{";
+  for (size_t i = 0; i < labels.size(); ++i) {
+    if (i > 0) o << ", ";
+    o << "\"" << labels[i].first << "\": \"" << labels[i].second << "\"";
+  }
+  o << "}";
+}
+
+// Writes the labels, along with an extra label if provided, in the Prometheus
+// format. Writes nothing if there are no labels.
+void WritePrometheusLabels(std::ostream& o, const Labels& labels,
+                           const std::string& extra = "") {
+  if (labels.empty() && extra.empty()) return;
+  o << "{";
+  for (size_t i = 0; i < labels.size(); ++i) {
+    if (i > 0) o << ",";
+    o << labels[i].first << "=\"" << labels[i].second << "\"";
+  }
+  if (!extra.empty()) {
+    if (!labels.empty()) o << ",";
+    o << extra;
+  }
+  o << "}";
+}
+
+}  // namespace
+
+Counter::Counter() {
+  for (auto& shard : shards_) {
+    shard.value.store(0, std::memory_order_relaxed);
+  }
+}
+
+void Counter::Add(uint64_t n) {
+  shards_[ThreadShard()].value.fetch_add(n, std::memory_order_relaxed);
+}
+
+uint64_t Counter::Value() const {
+  uint64_t sum = 0;
+  for (auto const& shard : shards_) {
+    sum += shard.value.load(std::memory_order_relaxed);
+  }
+  return sum;
+}
+
+const size_t Histogram::kBuckets;
+
+Histogram::Histogram() : count_(0), sum_us_(0), max_us_(0) {
+  for (auto& bucket : buckets_) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+}
+
+size_t Histogram::BucketFor(uint64_t us) {
+  if (us < 16) return us;
+  // The position of the highest set bit, which is at least 4, picks the power
+  // of two, and the 4 bits below it pick the bucket within it.
+  unsigned int exp = 63 - __builtin_clzll(us);
+  size_t sub = (us >> (exp - 4)) & 15;
+  return 16 + (exp - 4) * 16 + sub;
+}
+
+uint64_t Histogram::BucketUpperBound(size_t bucket) {
+  if (bucket < 16) return bucket;
+  unsigned int exp = (bucket - 16) / 16 + 4;
+  uint64_t sub = (bucket - 16) % 16;
+  return ((16 + sub + 1) << (exp - 4)) - 1;
+}
+
+void Histogram::Record(std::chrono::nanoseconds value) {
+  auto micros =
+      std::chrono::duration_cast<std::chrono::microseconds>(value).count();
+  uint64_t us = micros > 0 ? micros : 0;
+  buckets_[BucketFor(us)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_us_.fetch_add(us, std::memory_order_relaxed);
+  uint64_t max = max_us_.load(std::memory_order_relaxed);
+  while (us > max &&
+         !max_us_.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+  }
+}
+
+uint64_t Histogram::Count() const {
+  return count_.load(std::memory_order_relaxed);
+}
+
+double Histogram::Sum() const {
+  return Seconds(sum_us_.load(std::memory_order_relaxed));
+}
+
+double Histogram::Max() const {
+  return Seconds(max_us_.load(std::memory_order_relaxed));
+}
+
+double Histogram::Quantile(double q) const {
+  // Sum the buckets rather than using count_, which may be momentarily out of
+  // step with them while values are being recorded.
+  uint64_t total = 0;
+  for (auto const& bucket : buckets_) {
+    total += bucket.load(std::memory_order_relaxed);
+  }
+  if (total == 0) return 0;
+
+  uint64_t rank = std::max<uint64_t>(1, (uint64_t)(q * total + 0.5));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBuckets; ++i) {
+    seen += BucketCount(i);
+    if (seen >= rank) {
+      return Seconds(std::min(BucketUpperBound(i),
+                              max_us_.load(std::memory_order_relaxed)));
+    }
+  }
+  return Max();
+}
+
+Counter& Registry::GetCounter(const std::string& name, const std::string& help,
+                              const Labels& labels) {
+  std::lock_guard<std::mutex> lock(mu_);
+  auto& family = families_[name];
+  if (!family.histograms.empty()) {
+    throw std::logic_error("metric " + name + " is not a counter");
+  }
+  family.help = help;
+  auto& counter = family.counters[labels];
+  if (!counter) counter.reset(new Counter());
+  return *counter;
+}
+
+Histogram& Registry::GetHistogram(const std::string& name,
+                                  const std::string& help,
+                                  const Labels& labels) {
+  std::lock_guard<std::mutex> lock(mu_);
+  auto& family = families_[name];
+  if (!family.counters.empty()) {
+    throw std::logic_error("metric " + name + " is not a histogram");
+  }
+  family.help = help;
+  auto& histogram = family.histograms[labels];
+  if (!histogram) histogram.reset(new Histogram());
+  return *histogram;
+}
+
+void Registry::WriteJson(std::ostream& o) const {
+  std::lock_guard<std::mutex> lock(mu_);
+  o << "{\"counters\": [";
+  bool first = true;
+  for (auto const& family : families_) {
+    for (auto const& counter : family.second.counters) {
+      if (!first) o << ", ";
+      first = false;
+      o << "{\"name\": \"" << family.first << "\", \"labels\": ";
+      WriteJsonLabels(o, counter.first);
+      o << ", \"value\": " << counter.second->Value() << "}";
+    }
+  }
+  o << "], \"histograms\": [";
+  first = true;
+  for (auto const& family : families_) {
+    for (auto const& histogram : family.second.histograms) {
+      const Histogram& h = *histogram.second;
+      if (!first) o << ", ";
+      first = false;
+      o << "{\"name\": \"" << family.first << "\", \"labels\": ";
+      WriteJsonLabels(o, histogram.first);
+      o << ", \"count\": " << h.Count() << ", \"sum\": " << h.Sum()
+        << ", \"p50\": " << h.Quantile(0.5) << ", \"p90\": " << h.Quantile(0.9)
+        << ", \"p99\": " << h.Quantile(0.99) << ", \"max\": " << h.Max()
+        << "}";
+    }
+  }
+  o << "]}" << std::endl;
+}
+
+void Registry::WritePrometheus(std::ostream& o) const {
+  std::lock_guard<std::mutex> lock(mu_);
+  for (auto const& family : families_) {
+    const std::string& name = family.first;
+    o << "# HELP " << name << " " << family.second.help << "\n";
+    if (!family.second.counters.empty()) {
+      o << "# TYPE " << name << " counter\n";
+      for (auto const& counter : family.second.counters) {
+        o << name;
+        WritePrometheusLabels(o, counter.first);
+        o << " " << counter.second->Value() << "\n";
+      }
+      continue;
+    }
+
+    // Only non-empty buckets are listed, since there are far too many to list
+    // them all. Prometheus buckets are cumulative and bounded in seconds.
+    o << "# TYPE " << name << " histogram\n";
+    for (auto const& histogram : family.second.histograms) {
+      const Histogram& h = *histogram.second;
+      uint64_t cumulative = 0;
+      for (size_t i = 0; i < Histogram::kBuckets; ++i) {
+        uint64_t count = h.BucketCount(i);
+        if (count == 0) continue;
+        cumulative += count;
+        std::ostringstream le;
+        le << "le=\"" << Seconds(Histogram::BucketUpperBound(i)) << "\"";
+        o << name << "_bucket";
+        WritePrometheusLabels(o, histogram.first, le.str());
+        o << " " << cumulative << "\n";
+      }
+      o << name << "_bucket";
+      WritePrometheusLabels(o, histogram.first, "le=\"+Inf\"");
+      o << " " << cumulative << "\n";
+      o << name << "_sum";
+      WritePrometheusLabels(o, histogram.first);
+      o << " " << h.Sum() << "\n";
+      o << name << "_count";
+      WritePrometheusLabels(o, histogram.first);
+      o << " " << cumulative << "\n";
+    }
+  }
+  o << std::flush;
+}
+
+Registry& Default() {
+  static Registry* registry = new Registry();
+  return *registry;
+}
+
+CounterVec::CounterVec(const std::string& name, const std::string& help,
+                       const std::string& label, size_t size)
+    : name_(name),
+      help_(help),
+      label_(label),
+      size_(size),
+      slots_(new std::atomic<Counter*>[size + 1]) {
+  for (size_t i = 0; i <= size_; ++i) {
+    slots_[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+Counter& CounterVec::At(size_t value) {
+  size_t slot = std::min(value, size_);
+  Counter* counter = slots_[slot].load(std::memory_order_acquire);
+  if (counter == nullptr) {
+    // Racing lookups get the same counter from the registry, so whichever
+    // store wins is fine.
+    std::string label_value =
+        slot == size_ ? "overflow" : std::to_string(slot);
+    counter = &Default().GetCounter(name_, help_, {{label_, label_value}});
+    slots_[slot].store(counter, std::memory_order_release);
+  }
+  return *counter;
+}
+
+void DumpOnSignal(int signo, std::ostream* o) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, signo);
+  if (pthread_sigmask(SIG_BLOCK, &set, nullptr) != 0) {
+    throw std::runtime_error("could not block signal");
+  }
+  std::thread([set, o] {
+    int sig;
+    while (sigwait(&set, &sig) == 0) {
+      Default().WritePrometheus(*o);
+    }
+  }).detach();
+}
+
+}  // namespace metrics
@@ -0,0 +1,145 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace metrics {
+
+// Label names and values attached to a metric, like {{"round", "2"}}.
+typedef std::vector<std::pair<std::string, std::string>> Labels;
+
+// The number of shards a Counter is split into. Threads add to their own
+// shard, so concurrent increments rarely touch the same cache line.
+const size_t kCounterShards = 16;
+
+// A monotonically increasing count. Adding is a relaxed atomic increment of
+// the calling thread's shard, and reading sums the shards, so neither takes a
+// lock.
+class Counter {
+ public:
+  Counter();
+
+  void Add(uint64_t n = 1);
+  uint64_t Value() const;
+
+ private:
+  // Padded so that each shard sits on its own cache line.
+  struct Shard {
+    std::atomic<uint64_t> value;
+    char padding[64 - sizeof(std::atomic<uint64_t>)];
+  };
+  Shard shards_[kCounterShards];
+};
+
+// A histogram of durations with HDR-style log-linear buckets: values are
+// recorded in microseconds, exactly below 16us and with 16 buckets per power
+// of two above, so every bucket is within about 6% of the values in it.
+// Recording is a few relaxed atomic increments.
+class Histogram {
+ public:
+  // The number of buckets needed to cover every 64 bit value.
+  static const size_t kBuckets = 16 + 60 * 16;
+
+  Histogram();
+
+  void Record(std::chrono::nanoseconds value);
+
+  uint64_t Count() const;
+  // The sum and maximum of the recorded values, in seconds.
+  double Sum() const;
+  double Max() const;
+  // Returns the upper bound of the bucket holding the qth quantile (0 to 1)
+  // of the recorded values, in seconds, or 0 if nothing was recorded.
+  double Quantile(double q) const;
+
+  // Returns the index of the bucket holding the value in microseconds, and
+  // the largest value a bucket holds.
+  static size_t BucketFor(uint64_t us);
+  static uint64_t BucketUpperBound(size_t bucket);
+
+  // Returns the count in a bucket.
+  inline uint64_t BucketCount(size_t bucket) const {
+    return buckets_[bucket].load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<uint64_t> buckets_[kBuckets];
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_us_;
+  std::atomic<uint64_t> max_us_;
+};
+
+// Holds every metric of the process. Metrics are created on first use and
+// live as long as the Registry, so callers look them up once and keep the
+// reference. Lookups take a lock, while updating a metric never does.
+class Registry {
+ public:
+  // Returns the counter with the provided name and labels, creating it if
+  // needed. The help text describes the metric in exported output.
+  Counter& GetCounter(const std::string& name, const std::string& help,
+                      const Labels& labels = {});
+
+  // Returns the histogram with the provided name and labels, creating it if
+  // needed.
+  Histogram& GetHistogram(const std::string& name, const std::string& help,
+                          const Labels& labels = {});
+
+  // Writes every metric as a single JSON object.
+  void WriteJson(std::ostream& o) const;
+
+  // Writes every metric in the Prometheus text exposition format.
+  void WritePrometheus(std::ostream& o) const;
+
+ private:
+  // The metrics sharing a name, each with different labels.
+  struct Family {
+    std::string help;
+    std::map<Labels, std::unique_ptr<Counter>> counters;
+    std::map<Labels, std::unique_ptr<Histogram>> histograms;
+  };
+
+  mutable std::mutex mu_;
+  std::map<std::string, Family> families_;
+};
+
+// Returns the Registry of the process.
+Registry& Default();
+
+// A group of counters that share a name and are labeled by a small integer,
+// like the round of a message. Values at or above the provided size share a
+// single counter labeled "overflow", so that untrusted values cannot create
+// unbounded numbers of metrics. Looking up a counter is lock-free once it
+// exists.
+class CounterVec {
+ public:
+  CounterVec(const std::string& name, const std::string& help,
+             const std::string& label, size_t size);
+
+  Counter& At(size_t value);
+
+ private:
+  const std::string name_;
+  const std::string help_;
+  const std::string label_;
+  const size_t size_;
+  // One slot per value, and one for overflow.
+  std::unique_ptr<std::atomic<Counter*>[]> slots_;
+};
+
+// Dumps the Default registry in the Prometheus text format to the stream
+// whenever the process receives the signal. The signal is blocked in the
+// calling thread and handled by a background thread with sigwait, so this must
+// be called before any other thread is started for them to inherit the mask.
+void DumpOnSignal(int signo, std::ostream* o);
+
+}  // namespace metrics
+
+#endif
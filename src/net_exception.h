@@ -11,38 +11,59 @@ namespace net {
 
 class AbstractNetworkException : public std::exception {
  public:
-  virtual const char* what() const throw() { return stream_.str().c_str(); }
+  virtual const char* what() const throw() { return what_.c_str(); }
 
  protected:
-  std::ostringstream stream_;
+  // Sets the exception's message to the contents of the stream. Stored as a
+  // string so that exceptions can be copied across threads.
+  void SetWhat(const std::ostringstream& stream) { what_ = stream.str(); }
+
+ private:
+  std::string what_;
 };
 
 class SocketException : public AbstractNetworkException {
  public:
-  SocketException() { stream_ << "Could not create UDP Socket: " << errno; }
+  SocketException() {
+    std::ostringstream stream;
+    stream << "Could not create UDP Socket: " << errno;
+    SetWhat(stream);
+  }
 };
 
 class HostNotFoundException : public AbstractNetworkException {
  public:
   HostNotFoundException(std::string host) {
-    stream_ << "Could not find host: " << host;
+    std::ostringstream stream;
+    stream << "Could not find host: " << host;
+    SetWhat(stream);
   };
 };
 
 class BindException : public AbstractNetworkException {
  public:
-  BindException() { stream_ << "Could not bind UDP Socket: " << errno; }
+  BindException() {
+    std::ostringstream stream;
+    stream << "Could not bind UDP Socket: " << errno;
+    SetWhat(stream);
+  }
 };
 
 class SendException : public AbstractNetworkException {
  public:
-  SendException() { stream_ << "Could not send data on socket: " << errno; }
+  SendException() {
+    std::ostringstream stream;
+    stream << "Could not send data on socket: " << errno;
+    SetWhat(stream);
+  }
 };
 
 class ReceiveException : public AbstractNetworkException {
  public:
   ReceiveException() {
-    stream_ << "Could not receive data on socket: " << errno;
+    std::ostringstream stream;
+    stream << "Could not receive data on socket: " << errno;
+    SetWhat(stream);
   }
 };
 
@@ -0,0 +1,41 @@
+#include "path_set.h"
+
+namespace generals {
+
+void DynamicPathSet::Reset(unsigned int round) {
+  round_ = round;
+  paths_.clear();
+}
+
+bool DynamicPathSet::ValidPath(const std::vector<unsigned int>& ids) const {
+  std::vector<bool> used(process_num_);
+  for (auto const& id : ids) {
+    if (id >= process_num_ || id == self_ || used[id]) return false;
+    used[id] = true;
+  }
+  return true;
+}
+
+bool DynamicPathSet::Insert(const std::vector<unsigned int>& ids) {
+  if (ids.size() != round_ + 1) return false;
+  return paths_.insert(ids).second;
+}
+
+bool DynamicPathSet::Complete() const {
+  return paths_.size() == MessagesForRound(process_num_, round_);
+}
+
+std::unique_ptr<PathSet> MakePathSet(size_t process_num, unsigned int faulty,
+                                     unsigned int self) {
+#ifdef GENERALS_FIXED_SHAPES
+#define SHAPE(N, F)                                      \
+  if (process_num == N && faulty == F) {                 \
+    return std::make_unique<FixedPathSet<N, F>>(self);   \
+  }
+  GENERALS_FIXED_SHAPES
+#undef SHAPE
+#endif
+  return std::make_unique<DynamicPathSet>(process_num, self);
+}
+
+}  // namespace generals
@@ -0,0 +1,161 @@
+#ifndef PATH_SET_H_
+#define PATH_SET_H_
+
+#include <bitset>
+#include <limits>
+#include <memory>
+#include <set>
+#include <vector>
+
+namespace generals {
+
+// Returned by MessagesForRound when the message count does not fit in a
+// size_t.
+constexpr size_t kMessageCountOverflow = std::numeric_limits<size_t>::max();
+
+// Determines the maximum number of valid messages that a Lieutenant process
+// should expect in a certain round given a number of initial processes. The
+// count saturates at kMessageCountOverflow instead of silently wrapping.
+constexpr size_t MessagesForRound(size_t process_num, unsigned int round) {
+  if (round == 0) return 1;
+  if (round + 1 >= process_num) return 0;
+  const size_t prev = MessagesForRound(process_num, round - 1);
+  const size_t factor = process_num - 1 - round;
+  if (prev > kMessageCountOverflow / factor) return kMessageCountOverflow;
+  return prev * factor;
+}
+
+// Tracks the relay paths (the id lists of messages) that a Lieutenant has
+// received during a round. Used to drop replayed messages and to determine
+// when all messages expected for a round have arrived.
+class PathSet {
+ public:
+  virtual ~PathSet() = default;
+
+  // Clears the set and prepares it to hold paths for the provided round.
+  virtual void Reset(unsigned int round) = 0;
+
+  // Determines if the path is well formed: all ids are in bounds, unique, and
+  // not the id of the current process.
+  virtual bool ValidPath(const std::vector<unsigned int>& ids) const = 0;
+
+  // Records the path for the current round. Returns false if the path was
+  // already seen or does not belong to the current round.
+  virtual bool Insert(const std::vector<unsigned int>& ids) = 0;
+
+  // Determines if every path expected for the current round has been seen.
+  virtual bool Complete() const = 0;
+};
+
+// A PathSet for cluster shapes only known at runtime.
+class DynamicPathSet : public PathSet {
+ public:
+  DynamicPathSet(size_t process_num, unsigned int self)
+      : process_num_(process_num), self_(self), round_(0) {}
+
+  void Reset(unsigned int round);
+  bool ValidPath(const std::vector<unsigned int>& ids) const;
+  bool Insert(const std::vector<unsigned int>& ids);
+  bool Complete() const;
+
+ private:
+  const size_t process_num_;
+  const unsigned int self_;
+  unsigned int round_;
+  std::set<std::vector<unsigned int>> paths_;
+};
+
+// A PathSet for a cluster of N processes tolerating F faults, specialized at
+// compile time. Every valid path in round r starts with the commander (0)
+// followed by r distinct relays drawn from the N-2 processes that are neither
+// the commander nor ourselves. There are exactly MessagesForRound(N, r) such
+// paths, so each one can be ranked into a dense index and tracked in a
+// fixed-width bitset without any allocation after construction.
+template <unsigned int N, unsigned int F>
+class FixedPathSet : public PathSet {
+  static_assert(N >= F + 2, "the total number of processes must be no less "
+                            "than (faulty + 2)");
+
+  // The number of messages expected in each round, computed at compile time.
+  struct RoundTable {
+    size_t counts[F + 2];
+    size_t max;
+  };
+  static constexpr RoundTable MakeRoundTable() {
+    RoundTable t{};
+    for (unsigned int r = 0; r < F + 2; ++r) {
+      t.counts[r] = MessagesForRound(N, r);
+      if (t.counts[r] > t.max) t.max = t.counts[r];
+    }
+    return t;
+  }
+  static constexpr RoundTable kRoundTable = MakeRoundTable();
+  static_assert(kRoundTable.max <= (size_t{1} << 26),
+                "cluster shape too large to specialize");
+
+ public:
+  explicit FixedPathSet(unsigned int self)
+      : self_(self), round_(0), seen_count_(0) {}
+
+  void Reset(unsigned int round) {
+    round_ = round;
+    seen_.reset();
+    seen_count_ = 0;
+  }
+
+  bool ValidPath(const std::vector<unsigned int>& ids) const {
+    std::bitset<N> used;
+    for (auto const& id : ids) {
+      if (id >= N || id == self_ || used.test(id)) return false;
+      used.set(id);
+    }
+    return true;
+  }
+
+  bool Insert(const std::vector<unsigned int>& ids) {
+    if (round_ > F + 1 || ids.size() != round_ + 1) return false;
+
+    // Compute the mixed-radix rank of the relays, where the digit for each
+    // relay is its index among the relays not yet used earlier in the path.
+    size_t rank = 0;
+    std::bitset<N> used;
+    for (size_t k = 1; k < ids.size(); ++k) {
+      unsigned int id = ids[k];
+      unsigned int digit = id - (id > self_ ? 2 : 1);
+      for (unsigned int prev = 1; prev < id; ++prev) {
+        if (used.test(prev)) --digit;
+      }
+      used.set(id);
+      rank = rank * (N - 1 - k) + digit;
+    }
+
+    if (seen_.test(rank)) return false;
+    seen_.set(rank);
+    ++seen_count_;
+    return true;
+  }
+
+  bool Complete() const {
+    return round_ <= F + 1 && seen_count_ == kRoundTable.counts[round_];
+  }
+
+ private:
+  const unsigned int self_;
+  unsigned int round_;
+  size_t seen_count_;
+  std::bitset<kRoundTable.max> seen_;
+};
+
+template <unsigned int N, unsigned int F>
+constexpr typename FixedPathSet<N, F>::RoundTable
+    FixedPathSet<N, F>::kRoundTable;
+
+// Creates a PathSet for the provided cluster shape. If the shape was
+// specialized at build time (see FIXED_SHAPES in the Makefile), the matching
+// FixedPathSet is returned. Otherwise, a DynamicPathSet is returned.
+std::unique_ptr<PathSet> MakePathSet(size_t process_num, unsigned int faulty,
+                                     unsigned int self);
+
+}  // namespace generals
+
+#endif
@@ -0,0 +1,178 @@
+#include "payload.h"
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "log.h"
+#include "metrics.h"
+#include "sha256.h"
+
+namespace payload {
+
+namespace {
+
+metrics::Counter& ChunksReceived() {
+  static metrics::Counter& counter = metrics::Default().GetCounter(
+      "byzantine_payload_chunks_received_total",
+      "Chunks of value payloads received, duplicates included.");
+  return counter;
+}
+
+metrics::Counter& CorruptPayloads() {
+  static metrics::Counter& counter = metrics::Default().GetCounter(
+      "byzantine_payload_corrupt_total",
+      "Payloads dropped because they did not hash to their digest.");
+  return counter;
+}
+
+}  // namespace
+
+msg::Digest DigestOf(const std::string& payload) {
+  return sha256::Sum(payload.data(), payload.size());
+}
+
+size_t EncodeChunk(const msg::Digest& digest, const std::string& payload,
+                   size_t index, char* buf) {
+  const size_t offset = index * kChunkSize;
+  const size_t data_size = std::min(kChunkSize, payload.size() - offset);
+  const size_t size = sizeof(msg::Chunk) + data_size;
+
+  msg::Chunk* chunk = reinterpret_cast<msg::Chunk*>(buf);
+  chunk->type = htonl(kChunkType);
+  chunk->size = htonl(size);
+  std::copy(digest.begin(), digest.end(), chunk->digest);
+  chunk->payload_size = htonl(payload.size());
+  chunk->index = htonl(index);
+  memcpy(buf + sizeof(msg::Chunk), payload.data() + offset, data_size);
+  return size;
+}
+
+std::experimental::optional<ChunkView> ChunkFromBuf(const char* buf,
+                                                    size_t n) {
+  // Check to make sure the size and type of the buffer are correct.
+  if (n < sizeof(msg::Chunk)) {
+    return {};
+  }
+  auto chunk = reinterpret_cast<const msg::Chunk*>(buf);
+  if (ntohl(chunk->type) != kChunkType) {
+    return {};
+  }
+
+  ChunkView view;
+  std::copy(chunk->digest, chunk->digest + view.digest.size(),
+            view.digest.begin());
+  view.payload_size = ntohl(chunk->payload_size);
+  view.index = ntohl(chunk->index);
+  view.data = buf + sizeof(msg::Chunk);
+  view.size = n - sizeof(msg::Chunk);
+
+  // The chunk must hold exactly its share of the payload.
+  if (view.payload_size > kMaxPayloadSize ||
+      view.index >= ChunkCount(view.payload_size) ||
+      view.size != std::min(kChunkSize,
+                            view.payload_size - view.index * kChunkSize)) {
+    return {};
+  }
+  return view;
+}
+
+msg::Fetch MakeFetch(const msg::Digest& digest, size_t first, size_t count) {
+  msg::Fetch fetch = {};
+  fetch.type = htonl(kFetchType);
+  fetch.size = htonl(sizeof(fetch));
+  std::copy(digest.begin(), digest.end(), fetch.digest);
+  fetch.first = htonl(first);
+  fetch.count = htonl(count);
+  return fetch;
+}
+
+std::experimental::optional<FetchRequest> FetchFromBuf(const char* buf,
+                                                       size_t n) {
+  // Check to make sure the size and type of the buffer are correct.
+  if (n != sizeof(msg::Fetch)) {
+    return {};
+  }
+  auto fetch = reinterpret_cast<const msg::Fetch*>(buf);
+  if (ntohl(fetch->type) != kFetchType) {
+    return {};
+  }
+
+  FetchRequest req;
+  std::copy(fetch->digest, fetch->digest + req.digest.size(),
+            req.digest.begin());
+  req.first = ntohl(fetch->first);
+  req.count = std::min<size_t>(ntohl(fetch->count), kFetchChunks);
+  return req;
+}
+
+msg::Digest Store::Add(const std::string& payload) {
+  const msg::Digest digest = DigestOf(payload);
+  entries_[digest] = Entry{payload, {}, 0};
+  return digest;
+}
+
+bool Store::AddChunk(const ChunkView& chunk) {
+  ChunksReceived().Add();
+  auto it = entries_.find(chunk.digest);
+  if (it == entries_.end()) {
+    // Make room for the new payload by dropping the oldest incomplete one.
+    if (incomplete_.size() >= kMaxIncomplete) {
+      entries_.erase(incomplete_.front());
+      incomplete_.pop_front();
+    }
+    const size_t chunks = ChunkCount(chunk.payload_size);
+    it = entries_
+             .emplace(chunk.digest,
+                      Entry{std::string(chunk.payload_size, '\0'),
+                            std::vector<bool>(chunks, false), chunks})
+             .first;
+    incomplete_.push_back(chunk.digest);
+  }
+
+  Entry& entry = it->second;
+  if (entry.remaining == 0 || entry.data.size() != chunk.payload_size ||
+      entry.received[chunk.index]) {
+    return false;
+  }
+  memcpy(&entry.data[chunk.index * kChunkSize], chunk.data, chunk.size);
+  entry.received[chunk.index] = true;
+  if (--entry.remaining > 0) {
+    return false;
+  }
+
+  // The payload is complete, so make sure it is the one its digest names.
+  incomplete_.erase(
+      std::find(incomplete_.begin(), incomplete_.end(), chunk.digest));
+  if (DigestOf(entry.data) != chunk.digest) {
+    LOG(Warning, "Dropping payload that does not match digest ",
+        msg::DigestString(chunk.digest));
+    CorruptPayloads().Add();
+    entries_.erase(it);
+    return false;
+  }
+  entry.received.clear();
+  return true;
+}
+
+const std::string* Store::Get(const msg::Digest& digest) const {
+  auto it = entries_.find(digest);
+  if (it == entries_.end() || it->second.remaining > 0) {
+    return nullptr;
+  }
+  return &it->second.data;
+}
+
+std::pair<size_t, size_t> Store::Missing(const msg::Digest& digest) const {
+  auto it = entries_.find(digest);
+  if (it == entries_.end()) {
+    return {0, kFetchChunks};
+  }
+  auto const& received = it->second.received;
+  size_t first = std::find(received.begin(), received.end(), false) -
+                 received.begin();
+  return {first, std::min(kFetchChunks, received.size() - first)};
+}
+
+}  // namespace payload
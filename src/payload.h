@@ -0,0 +1,120 @@
+#ifndef PAYLOAD_H_
+#define PAYLOAD_H_
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <experimental/optional>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "message.h"
+#include "transport.h"
+
+// Holds the payloads of values, named by their digests. Relays of the
+// agreement algorithm only carry digests, while payloads are split into Chunks
+// that are pushed once to every peer and fetched on demand from peers that
+// relayed their digest.
+namespace payload {
+
+// The most payload bytes a Chunk carries, so that every Chunk fits in a
+// datagram.
+const size_t kChunkSize = BUFSIZE - sizeof(msg::Chunk);
+
+// The largest payload accepted from the network.
+const size_t kMaxPayloadSize = 64 << 20;
+
+// The most payloads a Store assembles at once. Once full, the oldest
+// incomplete payload is dropped to make room, so that peers cannot exhaust
+// memory with chunks of payloads that nobody wants.
+const size_t kMaxIncomplete = 8;
+
+// The most chunks requested by a single Fetch.
+const size_t kFetchChunks = 256;
+
+// How long to wait for the chunks of a Fetch before asking another peer.
+const auto kFetchTimeout = std::chrono::milliseconds{250};
+
+// Returns the number of chunks a payload of the provided size is split into.
+// An empty payload still takes one empty chunk.
+inline size_t ChunkCount(size_t payload_size) {
+  return payload_size == 0 ? 1 : (payload_size + kChunkSize - 1) / kChunkSize;
+}
+
+// Returns the digest that names the payload.
+msg::Digest DigestOf(const std::string& payload);
+
+// A Chunk decoded from a datagram. data points into the datagram.
+struct ChunkView {
+  msg::Digest digest;
+  size_t payload_size;
+  size_t index;
+  const char* data;
+  size_t size;
+};
+
+// A Fetch decoded from a datagram.
+struct FetchRequest {
+  msg::Digest digest;
+  size_t first;
+  size_t count;
+};
+
+// Encodes chunk index of the payload with the provided digest into buf, which
+// must hold BUFSIZE bytes, and returns the size of the encoding.
+size_t EncodeChunk(const msg::Digest& digest, const std::string& payload,
+                   size_t index, char* buf);
+
+// Decodes a Chunk from the buffer. If the buffer does not hold a well formed
+// Chunk, the return value will be absent.
+std::experimental::optional<ChunkView> ChunkFromBuf(const char* buf, size_t n);
+
+// Encodes a Fetch of count chunks of the payload starting at first.
+msg::Fetch MakeFetch(const msg::Digest& digest, size_t first, size_t count);
+
+// Decodes a Fetch from the buffer. If the buffer does not hold a Fetch, the
+// return value will be absent.
+std::experimental::optional<FetchRequest> FetchFromBuf(const char* buf,
+                                                       size_t n);
+
+// The payloads known to a process, complete or being assembled from chunks.
+// Not thread-safe, except that complete payloads may be read concurrently.
+class Store {
+ public:
+  // Adds a payload known in full, like a commander's own value, and returns
+  // its digest.
+  msg::Digest Add(const std::string& payload);
+
+  // Adds a received chunk. Returns true if it completed its payload. Payloads
+  // that do not hash to their digest once complete are dropped.
+  bool AddChunk(const ChunkView& chunk);
+
+  // Returns the payload with the provided digest, or nullptr if it is not
+  // complete.
+  const std::string* Get(const msg::Digest& digest) const;
+  inline bool Has(const msg::Digest& digest) const {
+    return Get(digest) != nullptr;
+  }
+
+  // Returns the first missing chunk of the payload and the number of chunks
+  // from it to request, at most kFetchChunks.
+  std::pair<size_t, size_t> Missing(const msg::Digest& digest) const;
+
+ private:
+  struct Entry {
+    std::string data;
+    // Which chunks have arrived, and how many have not, while incomplete.
+    std::vector<bool> received;
+    size_t remaining;
+  };
+
+  std::map<msg::Digest, Entry> entries_;
+  // The incomplete payloads, oldest first.
+  std::deque<msg::Digest> incomplete_;
+};
+
+}  // namespace payload
+
+#endif
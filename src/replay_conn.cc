@@ -0,0 +1,71 @@
+#include "replay_conn.h"
+
+#include <algorithm>
+
+namespace replay {
+
+Server::Server(const std::string& path, double speed,
+               transport::AckDecoderFn ack_decoder, AckEncoderFn ack_encoder,
+               std::chrono::microseconds timeout)
+    : transport::Server(ack_decoder, timeout),
+      reader_(path),
+      speed_(speed),
+      ack_decoder_(ack_decoder),
+      ack_encoder_(ack_encoder),
+      replayed_(0),
+      stopped_(false) {
+  if (speed < 0) {
+    throw std::invalid_argument("replay speed must be non-negative");
+  }
+  replayer_ = std::thread([this] { Replay(); });
+}
+
+Server::~Server() {
+  stopped_ = true;
+  replayer_.join();
+}
+
+void Server::Transmit(uint64_t id, const transport::Address& to,
+                      const char* buf, size_t size) {
+  auto ack = ack_encoder_(buf, size);
+  if (ack) {
+    Deliver(to, ack->data(), ack->size());
+  }
+}
+
+void Server::Replay() {
+  const auto start = std::chrono::steady_clock::now();
+  try {
+    while (!stopped_) {
+      auto rec = reader_.Next();
+      if (!rec) {
+        return;
+      }
+      if (ack_decoder_(rec->data.data(), rec->data.size())) {
+        continue;
+      }
+
+      if (speed_ > 0) {
+        // Sleep until the datagram is due, in slices so that destruction is
+        // not held up.
+        const auto due =
+            start + std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::duration<double, std::nano>(
+                            rec->time.count() / speed_));
+        for (auto now = std::chrono::steady_clock::now();
+             !stopped_ && now < due; now = std::chrono::steady_clock::now()) {
+          std::this_thread::sleep_for(
+              std::min<std::chrono::steady_clock::duration>(
+                  due - now, transport::kReceivePollInterval));
+        }
+      }
+
+      Deliver(rec->from, rec->data.data(), rec->data.size());
+      replayed_++;
+    }
+  } catch (...) {
+    Fail(std::current_exception());
+  }
+}
+
+}  // namespace replay
@@ -0,0 +1,62 @@
+#ifndef REPLAY_CONN_H_
+#define REPLAY_CONN_H_
+
+#include <atomic>
+#include <chrono>
+#include <experimental/optional>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "trace.h"
+#include "transport.h"
+
+namespace replay {
+
+// Builds the acknowledgement that the remote process would have sent back for
+// a datagram. If the datagram is not acknowledged, the return value will be
+// absent.
+typedef std::function<std::experimental::optional<std::vector<char>>(
+    const char*, size_t)>
+    AckEncoderFn;
+
+// Replays the datagrams of a trace (see trace::Writer) as if they were received
+// from the network, so that a General can run against a recorded workload
+// without any sockets. Acknowledgements in the trace are skipped. Instead,
+// every datagram sent through the Server is acknowledged immediately, so
+// senders never wait.
+class Server : public transport::Server {
+ public:
+  // Replays the trace at the provided multiple of its recorded pace. A speed
+  // of 0 replays every datagram as fast as possible.
+  Server(const std::string& path, double speed,
+         transport::AckDecoderFn ack_decoder, AckEncoderFn ack_encoder,
+         std::chrono::microseconds timeout = transport::kNoTimeout);
+
+  ~Server();
+
+  // Returns the number of datagrams replayed so far.
+  inline size_t Replayed() const { return replayed_; }
+
+ private:
+  // Acknowledges the datagram, if needed, and drops it.
+  void Transmit(uint64_t id, const transport::Address& to, const char* buf,
+                size_t size);
+
+  trace::Reader reader_;
+  const double speed_;
+  const transport::AckDecoderFn ack_decoder_;
+  const AckEncoderFn ack_encoder_;
+
+  std::atomic<size_t> replayed_;
+  std::atomic<bool> stopped_;
+  std::thread replayer_;
+
+  // Delivers the trace's datagrams until it ends or the Server is destroyed.
+  void Replay();
+};
+
+}  // namespace replay
+
+#endif
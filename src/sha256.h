@@ -0,0 +1,19 @@
+#ifndef SHA256_H_
+#define SHA256_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// The SHA-256 hash function (FIPS 180-4), used to name the payloads of values
+// by their content (see payload::Store).
+namespace sha256 {
+
+typedef std::array<uint8_t, 32> Hash;
+
+// Returns the SHA-256 hash of the size bytes at data.
+Hash Sum(const char* data, size_t size);
+
+}  // namespace sha256
+
+#endif
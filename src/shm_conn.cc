@@ -0,0 +1,200 @@
+#include "shm_conn.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <new>
+#include <stdexcept>
+
+#include "futex.h"
+#include "net_exception.h"
+
+namespace shm {
+
+namespace {
+
+// Identifies an initialized inbox segment.
+const uint32_t kInboxMagic = 0x42595a31;
+
+}  // namespace
+
+std::string InboxName(unsigned short port) {
+  return "/byzantine-general-" + std::to_string(port);
+}
+
+size_t Inbox::RingOffset() {
+  return (sizeof(InboxHeader) + alignof(Ring) - 1) / alignof(Ring) *
+         alignof(Ring);
+}
+
+size_t Inbox::SegmentSize(size_t rings) {
+  return RingOffset() + rings * sizeof(Ring);
+}
+
+std::unique_ptr<Inbox> Inbox::Create(const std::string& name, size_t rings) {
+  // Remove any inbox left behind by a process that did not exit cleanly.
+  shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    throw net::SocketException();
+  }
+  const size_t size = SegmentSize(rings);
+  if (ftruncate(fd, size) < 0) {
+    close(fd);
+    shm_unlink(name.c_str());
+    throw net::SocketException();
+  }
+  void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    shm_unlink(name.c_str());
+    throw net::SocketException();
+  }
+
+  // The segment is zero filled. Construct the atomics in place before
+  // publishing the inbox.
+  std::unique_ptr<Inbox> inbox(new Inbox(name, base, size, true));
+  auto header = new (base) InboxHeader();
+  header->seq = 0;
+  header->sleeping = 0;
+  for (size_t i = 0; i < rings; ++i) {
+    auto ring = new (inbox->ring(i)) Ring();
+    ring->head = 0;
+    ring->tail = 0;
+  }
+  header->magic.store(kInboxMagic, std::memory_order_release);
+  return inbox;
+}
+
+std::unique_ptr<Inbox> Inbox::Open(const std::string& name, size_t rings) {
+  int fd = shm_open(name.c_str(), O_RDWR, 0600);
+  if (fd < 0) {
+    return nullptr;
+  }
+  const size_t size = SegmentSize(rings);
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size != size) {
+    // Not yet sized by its creator, or created for a different cluster.
+    close(fd);
+    return nullptr;
+  }
+  void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    return nullptr;
+  }
+
+  std::unique_ptr<Inbox> inbox(new Inbox(name, base, size, false));
+  if (inbox->header()->magic.load(std::memory_order_acquire) != kInboxMagic) {
+    return nullptr;
+  }
+  return inbox;
+}
+
+Inbox::~Inbox() {
+  munmap(base_, size_);
+  if (owner_) shm_unlink(name_.c_str());
+}
+
+Server::Server(const std::vector<transport::Address>& processes,
+               unsigned int id, transport::AckDecoderFn ack_decoder,
+               std::chrono::microseconds timeout)
+    : transport::Server(ack_decoder, timeout),
+      processes_(processes),
+      id_(id),
+      inbox_(Inbox::Create(InboxName(processes.at(id).Port()),
+                           processes.size())),
+      outboxes_(processes.size()),
+      outbox_mus_(new std::mutex[processes.size()]),
+      stopped_(false) {
+  for (unsigned int i = 0; i < processes_.size(); ++i) {
+    ids_.emplace(processes_[i], i);
+  }
+  receiver_ = std::thread([this] { Receive(); });
+}
+
+Server::~Server() {
+  stopped_ = true;
+  receiver_.join();
+}
+
+void Server::Transmit(uint64_t id, const transport::Address& to,
+                      const char* buf, size_t size) {
+  auto it = ids_.find(to);
+  if (it == ids_.end()) {
+    throw std::invalid_argument("address is not a process in the cluster");
+  }
+  if (size > BUFSIZE) {
+    throw std::invalid_argument("datagram larger than BUFSIZE");
+  }
+  const unsigned int pid = it->second;
+
+  std::lock_guard<std::mutex> lock(outbox_mus_[pid]);
+  auto& outbox = outboxes_[pid];
+  if (!outbox) {
+    outbox = Inbox::Open(InboxName(processes_[pid].Port()), processes_.size());
+    if (!outbox) {
+      // The peer is not up yet. Drop the datagram, as UDP would.
+      return;
+    }
+  }
+
+  // Copy the datagram into the next free slot and publish it.
+  Ring* ring = outbox->ring(id_);
+  uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+  uint64_t head = ring->head.load(std::memory_order_acquire);
+  if (tail - head >= kRingSlots) {
+    return;
+  }
+  Slot& slot = ring->slots[tail % kRingSlots];
+  memcpy(slot.data, buf, size);
+  slot.size = size;
+  ring->tail.store(tail + 1, std::memory_order_release);
+
+  // Wake the receiver if it is sleeping. Both this increment and the
+  // receiver's sleeping flag are sequentially consistent, so either we see
+  // the flag or the receiver sees the new seq and does not sleep.
+  InboxHeader* header = outbox->header();
+  header->seq.fetch_add(1);
+  if (header->sleeping.load()) {
+    futex::Wake(&header->seq, false);
+  }
+}
+
+void Server::Receive() {
+  InboxHeader* header = inbox_->header();
+  char buf[BUFSIZE];
+  while (!stopped_) {
+    // Drain every ring, remembering seq beforehand so that a push racing with
+    // the scan prevents us from sleeping.
+    uint32_t seq = header->seq.load();
+    bool received = false;
+    for (unsigned int pid = 0; pid < processes_.size(); ++pid) {
+      if (pid == id_) continue;
+      Ring* ring = inbox_->ring(pid);
+      uint64_t head = ring->head.load(std::memory_order_relaxed);
+      uint64_t tail = ring->tail.load(std::memory_order_acquire);
+      for (; head < tail; ++head) {
+        const Slot& slot = ring->slots[head % kRingSlots];
+        size_t size = std::min<size_t>(slot.size, BUFSIZE);
+        memcpy(buf, slot.data, size);
+        ring->head.store(head + 1, std::memory_order_release);
+        Deliver(processes_[pid], buf, size);
+        received = true;
+      }
+    }
+    if (received) continue;
+
+    // Nothing to read, so sleep until a sender pushes a datagram. The futex
+    // timeout wakes us up periodically to check if the Server is being
+    // destroyed.
+    header->sleeping.store(1);
+    futex::Wait(&header->seq, seq, transport::kReceivePollInterval, false);
+    header->sleeping.store(0);
+  }
+}
+
+}  // namespace shm
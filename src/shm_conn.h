@@ -0,0 +1,128 @@
+#ifndef SHM_CONN_H_
+#define SHM_CONN_H_
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "transport.h"
+
+namespace shm {
+
+// The number of datagrams each ring can hold. Datagrams sent to a full ring
+// are dropped, just like datagrams that overflow a socket's receive buffer.
+const uint64_t kRingSlots = 256;
+
+// A single datagram in a ring.
+struct Slot {
+  uint32_t size;
+  char data[BUFSIZE];
+};
+
+// A lock-free single-producer single-consumer ring of datagrams. The producer
+// only advances tail and the consumer only advances head, each on its own
+// cache line.
+struct Ring {
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint64_t> tail;
+  alignas(64) Slot slots[kRingSlots];
+};
+
+// The header of a process's inbox segment, followed by one Ring per process
+// in the cluster. Ring i only carries datagrams from process i.
+struct InboxHeader {
+  // Set last when the inbox is created, so senders never see a partially
+  // initialized segment.
+  std::atomic<uint32_t> magic;
+  // Incremented after every push, and used as a futex to wake the receiver.
+  alignas(64) std::atomic<uint32_t> seq;
+  // Set while the receiver is, or is about to be, waiting on seq.
+  std::atomic<uint32_t> sleeping;
+};
+
+// A mapping of an inbox segment into this process.
+class Inbox {
+ public:
+  // Creates the inbox of a process with the provided number of rings,
+  // replacing any stale inbox left behind by an earlier process.
+  static std::unique_ptr<Inbox> Create(const std::string& name, size_t rings);
+  // Opens the existing inbox of a peer, or returns nullptr if the peer has
+  // not created it yet.
+  static std::unique_ptr<Inbox> Open(const std::string& name, size_t rings);
+
+  ~Inbox();
+
+  inline InboxHeader* header() const {
+    return reinterpret_cast<InboxHeader*>(base_);
+  };
+  inline Ring* ring(size_t i) const {
+    return reinterpret_cast<Ring*>(static_cast<char*>(base_) + RingOffset()) +
+           i;
+  };
+
+  // Returns the size of an inbox segment with the provided number of rings.
+  static size_t SegmentSize(size_t rings);
+
+ private:
+  Inbox(std::string name, void* base, size_t size, bool owner)
+      : name_(name), base_(base), size_(size), owner_(owner){};
+
+  static size_t RingOffset();
+
+  const std::string name_;
+  void* const base_;
+  const size_t size_;
+  // The owner of an inbox unlinks it when done.
+  const bool owner_;
+};
+
+// A transport for processes that all run on the same host. Every process owns
+// an inbox in a POSIX shared memory segment named after its port, holding one
+// lock-free SPSC ring per peer, so sending a datagram is a copy into the
+// receiver's memory instead of a trip through the kernel's network stack. The
+// receiver sleeps on a futex in its inbox when all of its rings are empty, and
+// senders only wake it when it is sleeping.
+class Server : public transport::Server {
+ public:
+  Server(const std::vector<transport::Address>& processes, unsigned int id,
+         transport::AckDecoderFn ack_decoder,
+         std::chrono::microseconds timeout = transport::kNoTimeout);
+
+  ~Server();
+
+ private:
+  // Sends the message to the remote process. Datagrams to processes that have
+  // not created their inbox yet, or whose ring is full, are dropped.
+  void Transmit(uint64_t id, const transport::Address& to, const char* buf,
+                size_t size);
+
+  const std::vector<transport::Address> processes_;
+  const unsigned int id_;
+  std::map<transport::Address, unsigned int> ids_;
+
+  std::unique_ptr<Inbox> inbox_;
+
+  // Peer inboxes, opened on first send. Each is guarded by its own mutex so
+  // that the current process is a single producer on every ring it writes.
+  std::vector<std::unique_ptr<Inbox>> outboxes_;
+  std::unique_ptr<std::mutex[]> outbox_mus_;
+
+  std::atomic<bool> stopped_;
+  std::thread receiver_;
+
+  // Receives datagrams until the Server is destroyed.
+  void Receive();
+};
+
+// Returns the name of the shared memory segment holding the inbox of the
+// process listening on the provided port.
+std::string InboxName(unsigned short port);
+
+}  // namespace shm
+
+#endif
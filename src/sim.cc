@@ -0,0 +1,362 @@
+#include "sim.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <stdexcept>
+
+namespace sim {
+
+Simulation::Simulation(const Config& config, uint64_t seed)
+    : config_(config),
+      rng_(seed),
+      now_(),
+      next_order_(0),
+      channels_(config.process_num * config.process_num),
+      undecided_(config.process_num - 1) {
+  if (config.process_num < (size_t)config.faulty + 2) {
+    throw std::invalid_argument(
+        "the total number of processes must be no less than (faulty + 2)");
+  }
+
+  machines_.resize(config.process_num);
+  for (unsigned int pid = 1; pid < config.process_num; ++pid) {
+    machines_[pid] = std::make_unique<generals::LieutenantMachine>(
+        config.process_num, pid, config.faulty, config.round_timeout);
+  }
+
+  result_.decided.assign(config.process_num, false);
+  result_.decisions.assign(config.process_num, msg::Order::NO_ORDER);
+  result_.decision_times.assign(config.process_num,
+                                std::chrono::microseconds{0});
+  result_.agreement = false;
+  result_.duration = std::chrono::microseconds{0};
+  result_.messages = 0;
+  result_.acks = 0;
+  result_.dropped = 0;
+  result_.events = 0;
+}
+
+Result Simulation::Run() {
+  StartCommander();
+
+  // Once every Lieutenant has decided, the remaining events are only
+  // retransmissions that nobody is listening for.
+  while (!events_.empty() && undecided_ > 0) {
+    std::pop_heap(events_.begin(), events_.end(), EventAfter());
+    Event ev = std::move(events_.back());
+    events_.pop_back();
+    now_ = ev.time;
+    result_.events++;
+
+    switch (ev.type) {
+      case EventType::DeliverMessage:
+        HandleMessage(ev);
+        break;
+      case EventType::DeliverAck:
+        HandleAck(ev);
+        break;
+      case EventType::AckTimeout:
+        HandleAckTimeout(ev);
+        break;
+      case EventType::SendNext:
+        Transmit(ev.from, ev.to);
+        break;
+      case EventType::RoundTimeout:
+        HandleRoundTimeout(ev);
+        break;
+    }
+  }
+
+  // Loyal Lieutenants must all decide the same order, which must be the
+  // Commander's if the Commander is loyal.
+  const bool loyal_commander = Behavior(0) == generals::MaliciousBehavior::NONE;
+  result_.decided[0] = true;
+  result_.decisions[0] = config_.order;
+  result_.agreement = true;
+  std::experimental::optional<msg::Order> agreed;
+  if (loyal_commander) agreed = config_.order;
+  for (unsigned int pid = 1; pid < config_.process_num; ++pid) {
+    if (Behavior(pid) != generals::MaliciousBehavior::NONE) continue;
+    if (!result_.decided[pid]) {
+      result_.agreement = false;
+      continue;
+    }
+    if (!agreed) agreed = result_.decisions[pid];
+    if (result_.decisions[pid] != *agreed) result_.agreement = false;
+  }
+  return result_;
+}
+
+generals::MaliciousBehavior Simulation::Behavior(unsigned int pid) const {
+  if (pid < config_.behaviors.size()) return config_.behaviors[pid];
+  return generals::MaliciousBehavior::NONE;
+}
+
+void Simulation::Schedule(Event ev) {
+  ev.order = next_order_++;
+  events_.push_back(std::move(ev));
+  std::push_heap(events_.begin(), events_.end(), EventAfter());
+}
+
+bool Simulation::NetworkDelay(std::chrono::microseconds* delay) {
+  if (config_.network.loss > 0 && Uniform() < config_.network.loss) {
+    result_.dropped++;
+    return false;
+  }
+  *delay = config_.network.latency;
+  if (config_.network.jitter.count() > 0) {
+    std::exponential_distribution<double> jitter(
+        1.0 / config_.network.jitter.count());
+    *delay += std::chrono::microseconds{(int64_t)jitter(rng_)};
+  }
+  return true;
+}
+
+double Simulation::Uniform() {
+  return std::uniform_real_distribution<double>(0.0, 1.0)(rng_);
+}
+
+void Simulation::Enqueue(unsigned int from, unsigned int to,
+                         msg::Message msg) {
+  ChannelFor(from, to).queue.push_back(std::move(msg));
+  StartNext(from, to);
+}
+
+void Simulation::StartNext(unsigned int from, unsigned int to) {
+  Channel& ch = ChannelFor(from, to);
+  if (ch.busy || ch.queue.empty()) {
+    return;
+  }
+  ch.busy = true;
+  ch.seq = ch.next_seq++;
+  ch.attempts = 0;
+
+  if (Exhibits(Behavior(from), generals::MaliciousBehavior::DELAY_SEND)) {
+    // Mirrors General::MaybeDelaySend: a poisson number of tenths of a second
+    // centered at half the round timeout.
+    typedef std::chrono::duration<int, std::deci> deciseconds;
+    auto timeout_deci =
+        std::chrono::duration_cast<deciseconds>(config_.round_timeout);
+    std::poisson_distribution<int> poisson(timeout_deci.count() / 2);
+    int delay = poisson(rng_);
+    if (delay > 0) {
+      Event ev = {};
+      ev.time = now_ + deciseconds{delay};
+      ev.type = EventType::SendNext;
+      ev.from = from;
+      ev.to = to;
+      Schedule(std::move(ev));
+      return;
+    }
+  }
+  Transmit(from, to);
+}
+
+void Simulation::Transmit(unsigned int from, unsigned int to) {
+  Channel& ch = ChannelFor(from, to);
+  ch.attempts++;
+  result_.messages++;
+
+  std::chrono::microseconds delay;
+  if (NetworkDelay(&delay)) {
+    Event ev = {};
+    ev.time = now_ + delay;
+    ev.type = EventType::DeliverMessage;
+    ev.from = from;
+    ev.to = to;
+    ev.seq = ch.seq;
+    ev.msg = ch.queue.front();
+    Schedule(std::move(ev));
+  }
+
+  Event timeout = {};
+  timeout.time = now_ + config_.ack_timeout;
+  timeout.type = EventType::AckTimeout;
+  timeout.from = from;
+  timeout.to = to;
+  timeout.seq = ch.seq;
+  timeout.attempt = ch.attempts;
+  Schedule(std::move(timeout));
+}
+
+void Simulation::Advance(unsigned int from, unsigned int to) {
+  Channel& ch = ChannelFor(from, to);
+  ch.queue.pop_front();
+  ch.busy = false;
+  StartNext(from, to);
+}
+
+void Simulation::StartCommander() {
+  const auto behavior = Behavior(0);
+  if (Exhibits(behavior, generals::MaliciousBehavior::SILENT)) {
+    return;
+  }
+  for (unsigned int pid = 1; pid < config_.process_num; ++pid) {
+    if (Exhibits(behavior, generals::MaliciousBehavior::PARTIAL_SEND) &&
+        Uniform() >= 0.75) {
+      continue;
+    }
+    msg::Order order = config_.order;
+    if (Exhibits(behavior, generals::MaliciousBehavior::WRONG_ORDER) &&
+        Uniform() < 0.30) {
+      order = order == msg::Order::ATTACK ? msg::Order::RETREAT
+                                          : msg::Order::ATTACK;
+    }
+    Enqueue(0, pid, msg::Message{0, order, {0}});
+  }
+}
+
+void Simulation::Apply(unsigned int pid, generals::Step step) {
+  auto& machine = *machines_[pid];
+  switch (step) {
+    case generals::Step::NewRound: {
+      // Filter the round's messages the same way General::ShouldSendMsg
+      // does.
+      const auto behavior = Behavior(pid);
+      const bool silent =
+          Exhibits(behavior, generals::MaliciousBehavior::SILENT);
+      auto const& outbox = machine.Outbox();
+      for (unsigned int to = 0; to < outbox.size() && !silent; ++to) {
+        for (auto const& msg : outbox[to]) {
+          if (Exhibits(behavior, generals::MaliciousBehavior::PARTIAL_SEND) &&
+              Uniform() >= 0.75) {
+            continue;
+          }
+          Enqueue(pid, to, msg);
+        }
+      }
+
+      Event timeout = {};
+      timeout.time = machine.RoundDeadline();
+      timeout.type = EventType::RoundTimeout;
+      timeout.to = pid;
+      timeout.seq = machine.Round();
+      Schedule(std::move(timeout));
+      break;
+    }
+    case generals::Step::Done: {
+      const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+          now_ - generals::TimePoint());
+      result_.decided[pid] = true;
+      undecided_--;
+      result_.decisions[pid] = machine.Decision().At(0);
+      result_.decision_times[pid] = elapsed;
+      result_.duration = std::max(result_.duration, elapsed);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+void Simulation::HandleMessage(Event& ev) {
+  // Only Lieutenants listen for messages.
+  if (ev.to == 0) {
+    return;
+  }
+  auto& machine = *machines_[ev.to];
+  if (machine.Done()) {
+    return;
+  }
+
+  auto reaction = machine.Receive(ev.from, ev.msg, now_);
+  if (reaction.ack) {
+    result_.acks++;
+    std::chrono::microseconds delay;
+    if (NetworkDelay(&delay)) {
+      Event ack = {};
+      ack.time = now_ + delay;
+      ack.type = EventType::DeliverAck;
+      ack.from = ev.to;
+      ack.to = ev.from;
+      ack.seq = ev.seq;
+      Schedule(std::move(ack));
+    }
+  }
+  Apply(ev.to, reaction.step);
+}
+
+void Simulation::HandleAck(const Event& ev) {
+  // The ack is addressed to the channel it came back on.
+  Channel& ch = ChannelFor(ev.to, ev.from);
+  if (ch.busy && ch.attempts > 0 && ch.seq == ev.seq) {
+    Advance(ev.to, ev.from);
+  }
+}
+
+void Simulation::HandleAckTimeout(const Event& ev) {
+  Channel& ch = ChannelFor(ev.from, ev.to);
+  if (!ch.busy || ch.seq != ev.seq || ch.attempts != ev.attempt) {
+    // The message was acknowledged, or this is a stale timeout.
+    return;
+  }
+  if (ch.attempts < config_.send_attempts) {
+    Transmit(ev.from, ev.to);
+  } else {
+    Advance(ev.from, ev.to);
+  }
+}
+
+void Simulation::HandleRoundTimeout(const Event& ev) {
+  auto& machine = *machines_[ev.to];
+  if (machine.Done() || machine.Round() != ev.seq) {
+    return;
+  }
+  Apply(ev.to, machine.Timeout(now_));
+}
+
+Summary SimulateMany(const Config& config, uint64_t seed, size_t runs) {
+  Summary summary = {};
+  summary.runs = runs;
+  if (runs == 0) {
+    return summary;
+  }
+
+  std::vector<std::chrono::microseconds> durations;
+  durations.reserve(runs);
+  size_t messages = 0;
+  size_t acks = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < runs; ++i) {
+    Result r = Simulation(config, seed + i).Run();
+    if (r.agreement) summary.agreements++;
+    for (size_t pid = 1; pid < r.decided.size(); ++pid) {
+      if (!r.decided[pid]) {
+        summary.undecided++;
+        break;
+      }
+    }
+    durations.push_back(r.duration);
+    messages += r.messages;
+    acks += r.acks;
+  }
+  summary.wall_secs = std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+
+  std::sort(durations.begin(), durations.end());
+  summary.p50 = durations[runs / 2];
+  summary.p99 = durations[std::min(runs - 1, runs * 99 / 100)];
+  summary.max = durations.back();
+  summary.mean_messages = (double)messages / runs;
+  summary.mean_acks = (double)acks / runs;
+  return summary;
+}
+
+std::ostream& operator<<(std::ostream& o, const Summary& s) {
+  auto ms = [](std::chrono::microseconds d) { return d.count() / 1000.0; };
+  o << "Simulated " << s.runs << " agreements in " << s.wall_secs << "s ("
+    << std::fixed << std::setprecision(0)
+    << (s.wall_secs > 0 ? s.runs / s.wall_secs : 0) << " per second)\n";
+  o.unsetf(std::ios_base::floatfield);
+  o << std::setprecision(6);
+  o << "  agreed: " << s.agreements << ", some lieutenant undecided: "
+    << s.undecided << "\n";
+  o << "  virtual duration (ms): p50 " << ms(s.p50) << ", p99 " << ms(s.p99)
+    << ", max " << ms(s.max) << "\n";
+  o << "  datagrams per run: " << s.mean_messages << " messages, "
+    << s.mean_acks << " acks\n";
+  return o;
+}
+
+}  // namespace sim
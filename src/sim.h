@@ -0,0 +1,200 @@
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "general.h"
+#include "lieutenant_machine.h"
+#include "message.h"
+
+namespace sim {
+
+// Models the network between simulated processes. Every datagram, message or
+// acknowledgement, is independently delayed and possibly dropped. Jitter
+// reorders datagrams that are sent close together.
+struct NetworkModel {
+  // The minimum one-way latency of a datagram.
+  std::chrono::microseconds latency;
+  // The mean of the exponentially distributed delay added to the latency.
+  std::chrono::microseconds jitter;
+  // The probability that a datagram is dropped.
+  double loss;
+};
+
+// Describes a simulated cluster.
+struct Config {
+  size_t process_num;
+  unsigned int faulty;
+  // The order of the Commander (process 0).
+  msg::Order order;
+  // The malicious behavior of each process, indexed by id. Missing entries
+  // are loyal.
+  std::vector<generals::MaliciousBehavior> behaviors;
+  NetworkModel network;
+
+  std::chrono::microseconds ack_timeout = generals::kAckTimeout;
+  std::chrono::microseconds round_timeout = generals::kRoundTimeout;
+  unsigned int send_attempts = generals::kSendAttempts;
+};
+
+// The outcome of one simulated agreement.
+struct Result {
+  // Whether each Lieutenant decided, what, and at which virtual time, indexed
+  // by id. Entry 0 is the Commander, which decides its own order at time 0.
+  std::vector<bool> decided;
+  std::vector<msg::Order> decisions;
+  std::vector<std::chrono::microseconds> decision_times;
+
+  // Whether every loyal Lieutenant decided the same order, which is the
+  // Commander's order if the Commander is loyal.
+  bool agreement;
+  // The virtual time at which the last Lieutenant decided.
+  std::chrono::microseconds duration;
+
+  // Datagrams put on the simulated network, including retransmissions and
+  // those that were dropped.
+  size_t messages;
+  size_t acks;
+  size_t dropped;
+  // Events processed by the simulation.
+  size_t events;
+};
+
+// A deterministic discrete-event simulation of one run of the Byzantine
+// Agreement Algorithm. Lieutenants run the same LieutenantMachine as real
+// processes, but on a virtual clock over a simulated network, so a run takes
+// only as long as its events take to process. Given the same Config and seed,
+// a Simulation always produces the same Result.
+//
+// Senders follow the real ones: a General sends to each peer serially, waits
+// up to ack_timeout for every acknowledgement and retries up to send_attempts
+// times, and a Lieutenant's messages for a new round queue behind those still
+// being sent from the previous one. Round timeouts fire exactly at the round
+// deadline.
+class Simulation {
+ public:
+  Simulation(const Config& config, uint64_t seed);
+
+  // Runs the agreement until every event has been processed.
+  Result Run();
+
+ private:
+  enum class EventType {
+    // A message arrives at its destination.
+    DeliverMessage,
+    // An acknowledgement arrives back at the sender.
+    DeliverAck,
+    // A sender's acknowledgement timeout expires.
+    AckTimeout,
+    // A sender is done delaying its next message (see DELAY_SEND).
+    SendNext,
+    // A Lieutenant's round deadline passes.
+    RoundTimeout,
+  };
+
+  struct Event {
+    generals::TimePoint time;
+    // Breaks ties between events at the same time in insertion order.
+    uint64_t order;
+    EventType type;
+    unsigned int from;
+    unsigned int to;
+    // The sequence number of a message or ack, the attempt of an ack timeout,
+    // or the round of a round timeout.
+    uint32_t seq;
+    uint32_t attempt;
+    msg::Message msg;
+  };
+  struct EventAfter {
+    bool operator()(const Event& a, const Event& b) const {
+      return a.time != b.time ? a.time > b.time : a.order > b.order;
+    }
+  };
+
+  // The messages a process is sending to one peer, in order.
+  struct Channel {
+    std::deque<msg::Message> queue;
+    // Whether the front of the queue is being sent.
+    bool busy = false;
+    uint32_t next_seq = 0;
+    uint32_t seq = 0;
+    uint32_t attempts = 0;
+  };
+
+  const Config config_;
+  std::mt19937_64 rng_;
+  generals::TimePoint now_;
+  uint64_t next_order_;
+  std::vector<Event> events_;
+
+  // The state machines of the Lieutenants, indexed by id. Entry 0 is empty.
+  std::vector<std::unique_ptr<generals::LieutenantMachine>> machines_;
+  // Channels indexed by sender * process_num + destination.
+  std::vector<Channel> channels_;
+  // The number of Lieutenants that have not decided yet.
+  size_t undecided_;
+  Result result_;
+
+  generals::MaliciousBehavior Behavior(unsigned int pid) const;
+  inline Channel& ChannelFor(unsigned int from, unsigned int to) {
+    return channels_[from * config_.process_num + to];
+  }
+
+  void Schedule(Event ev);
+  // Returns a delay for a datagram, or false if it is dropped.
+  bool NetworkDelay(std::chrono::microseconds* delay);
+  // Returns a random number in [0, 1).
+  double Uniform();
+
+  // Queues the message on the channel from one process to another.
+  void Enqueue(unsigned int from, unsigned int to, msg::Message msg);
+  // Starts sending the message at the front of the channel, if idle.
+  void StartNext(unsigned int from, unsigned int to);
+  // Puts the message at the front of the channel on the network.
+  void Transmit(unsigned int from, unsigned int to);
+  // Completes the message at the front of the channel and moves on.
+  void Advance(unsigned int from, unsigned int to);
+
+  // Sends the Commander's order to every Lieutenant.
+  void StartCommander();
+  // Carries out the step a Lieutenant's machine took.
+  void Apply(unsigned int pid, generals::Step step);
+
+  void HandleMessage(Event& ev);
+  void HandleAck(const Event& ev);
+  void HandleAckTimeout(const Event& ev);
+  void HandleRoundTimeout(const Event& ev);
+};
+
+// Aggregates the Results of many simulated agreements.
+struct Summary {
+  size_t runs;
+  // Runs in which the loyal Lieutenants agreed, and runs in which some
+  // Lieutenant never decided.
+  size_t agreements;
+  size_t undecided;
+  // Percentiles of the virtual duration of the runs.
+  std::chrono::microseconds p50;
+  std::chrono::microseconds p99;
+  std::chrono::microseconds max;
+  // Mean datagrams per run.
+  double mean_messages;
+  double mean_acks;
+  // The wall clock time spent simulating.
+  double wall_secs;
+};
+
+// Simulates the configured agreement runs times, seeding run i with seed + i.
+Summary SimulateMany(const Config& config, uint64_t seed, size_t runs);
+
+// Allow streaming of Summary on ostreams as a human readable report.
+std::ostream& operator<<(std::ostream& o, const Summary& s);
+
+}  // namespace sim
+
+#endif
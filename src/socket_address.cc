@@ -0,0 +1,127 @@
+#include "socket_address.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "thread.h"
+
+namespace udp {
+
+namespace {
+
+// Caches forward and reverse DNS lookups for the lifetime of the process.
+std::mutex dns_cache_mu;
+std::unordered_map<std::string, struct in_addr> host_cache;
+std::unordered_map<in_addr_t, std::string> name_cache;
+
+}  // namespace
+
+struct in_addr ResolveHost(const std::string &hostname) {
+  {
+    std::lock_guard<std::mutex> lock(dns_cache_mu);
+    auto it = host_cache.find(hostname);
+    if (it != host_cache.end()) return it->second;
+  }
+
+  // Get the remote server's DNS entry. Resolved outside of the lock so that
+  // lookups for different hosts can proceed concurrently.
+  struct addrinfo hints = {};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  struct addrinfo *res = nullptr;
+  if (getaddrinfo(hostname.c_str(), nullptr, &hints, &res) != 0 ||
+      res == nullptr) {
+    throw net::HostNotFoundException(hostname);
+  }
+  auto sin_addr = reinterpret_cast<struct sockaddr_in *>(res->ai_addr)->sin_addr;
+  freeaddrinfo(res);
+
+  std::lock_guard<std::mutex> lock(dns_cache_mu);
+  host_cache.emplace(hostname, sin_addr);
+  return sin_addr;
+}
+
+SocketAddress::SocketAddress(net::Address addr) {
+  // Build the server's Internet address.
+  addr_ = {};
+  addr_.sin_family = AF_INET;
+  addr_.sin_addr = ResolveHost(addr.hostname());
+  addr_.sin_port = htons(addr.port());
+}
+
+std::string SocketAddress::Hostname() const {
+  {
+    std::lock_guard<std::mutex> lock(dns_cache_mu);
+    auto it = name_cache.find(addr_.sin_addr.s_addr);
+    if (it != name_cache.end()) return it->second;
+  }
+
+  char host[NI_MAXHOST];
+  if (getnameinfo(addr(), addr_len(), host, sizeof(host), nullptr, 0,
+                  NI_NAMEREQD) != 0) {
+    throw net::HostNotFoundException("");
+  }
+
+  std::string hostname(host);
+  if (hostname == "localhost") {
+    hostname = net::GetHostname();
+  }
+
+  std::lock_guard<std::mutex> lock(dns_cache_mu);
+  name_cache.emplace(addr_.sin_addr.s_addr, hostname);
+  return hostname;
+}
+
+unsigned short SocketAddress::Port() const { return ntohs(addr_.sin_port); }
+
+std::vector<SocketAddress> ResolveAll(const std::vector<net::Address> &addrs) {
+  // Collect the distinct hostnames so each is only resolved once.
+  std::vector<std::string> hosts;
+  std::unordered_set<std::string> seen;
+  for (auto const &addr : addrs) {
+    if (seen.insert(addr.hostname()).second) hosts.push_back(addr.hostname());
+  }
+
+  // Resolve the hostnames on a bounded pool of threads, which pull work from a
+  // shared index. The first error is rethrown once all threads are done.
+  std::atomic<size_t> next{0};
+  std::mutex err_mu;
+  std::exception_ptr err;
+  threadutil::ThreadGroup resolvers;
+  auto threads = std::min<size_t>(hosts.size(), kResolverThreads);
+  for (size_t t = 0; t < threads; ++t) {
+    resolvers.AddThread([&] {
+      for (size_t i = next++; i < hosts.size(); i = next++) {
+        try {
+          ResolveHost(hosts[i]);
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(err_mu);
+          if (!err) err = std::current_exception();
+        }
+      }
+    });
+  }
+  resolvers.JoinAll();
+  if (err) std::rethrow_exception(err);
+
+  // All lookups now hit the cache.
+  std::vector<SocketAddress> resolved;
+  resolved.reserve(addrs.size());
+  for (auto const &addr : addrs) {
+    resolved.emplace_back(addr);
+  }
+  return resolved;
+}
+
+std::ostream &operator<<(std::ostream &os, const SocketAddress &addr) {
+  char ip[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &addr.addr_.sin_addr, ip, sizeof(ip));
+  os << ip << ':' << addr.Port();
+  return os;
+}
+
+}  // namespace udp
@@ -0,0 +1,67 @@
+#ifndef SOCKET_ADDRESS_H_
+#define SOCKET_ADDRESS_H_
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <iostream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "net.h"
+#include "net_exception.h"
+
+namespace udp {
+
+// Resolves a hostname to an IPv4 address using the reentrant getaddrinfo.
+// Results are cached for the lifetime of the process, so each hostname is
+// only looked up once. Throws a HostNotFoundException on failure.
+struct in_addr ResolveHost(const std::string& hostname);
+
+// Wraps a C sockaddr_in with a group of useful functionality.
+class SocketAddress {
+ public:
+  SocketAddress(struct sockaddr_in sockaddr) : addr_(sockaddr){};
+  SocketAddress(net::Address addr);
+
+  std::string Hostname() const;
+  unsigned short Port() const;
+
+  inline const struct sockaddr* addr() const {
+    return (struct sockaddr*)&addr_;
+  };
+  inline socklen_t addr_len() const { return sizeof(addr_); };
+
+  // Two SocketAddresses are equal if they have the same IP address and port.
+  bool operator==(const SocketAddress& other) const {
+    return addr_.sin_addr.s_addr == other.addr_.sin_addr.s_addr &&
+           addr_.sin_port == other.addr_.sin_port;
+  }
+  bool operator!=(const SocketAddress& other) const {
+    return !(*this == other);
+  }
+  bool operator<(const SocketAddress& other) const {
+    return std::tie(addr_.sin_addr.s_addr, addr_.sin_port) <
+           std::tie(other.addr_.sin_addr.s_addr, other.addr_.sin_port);
+  }
+
+  friend std::ostream& operator<<(std::ostream& os, const SocketAddress& addr);
+
+ private:
+  struct sockaddr_in addr_;
+};
+
+// The maximum number of threads used to resolve hostnames concurrently.
+const unsigned int kResolverThreads = 16;
+
+// Resolves each address concurrently, looking up every distinct hostname
+// once. The returned addresses are in the same order as the input.
+std::vector<SocketAddress> ResolveAll(const std::vector<net::Address>& addrs);
+
+}  // namespace udp
+
+#endif
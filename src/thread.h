@@ -1,6 +1,7 @@
 #ifndef THREAD_H_
 #define THREAD_H_
 
+#include <functional>
 #include <thread>
 #include <utility>
 #include <vector>
@@ -31,6 +32,21 @@ class ThreadGroup {
   std::vector<std::thread> threads_;
 };
 
+// Calls a function when it goes out of scope, however the scope is left. Used
+// to stop and join a thread around calls that may throw, since destroying a
+// joinable std::thread terminates the process.
+class OnExit {
+ public:
+  explicit OnExit(std::function<void()> f) : f_(std::move(f)) {}
+  ~OnExit() { f_(); }
+
+  OnExit(const OnExit&) = delete;
+  OnExit& operator=(const OnExit&) = delete;
+
+ private:
+  std::function<void()> f_;
+};
+
 }  // namespace threadutil
 
 #endif
@@ -0,0 +1,189 @@
+#include "timeline.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace timeline {
+
+namespace internal {
+std::atomic<bool> enabled{false};
+}  // namespace internal
+
+namespace {
+
+enum class Phase { Complete, Instant };
+
+struct Event {
+  const char* name;
+  Phase phase;
+  TimePoint start;
+  std::chrono::nanoseconds duration;
+  Arg args[kMaxArgs];
+  size_t arg_count;
+};
+
+// The events of a single thread. Only the owning thread records into it, so
+// its lock is only ever contended by WriteChromeTrace.
+struct Ring {
+  std::mutex mu;
+  unsigned int tid;
+  std::string name;
+  std::vector<Event> events;
+  // The total number of events recorded, of which the last
+  // min(recorded, kEventsPerThread) are kept.
+  size_t recorded = 0;
+};
+
+std::mutex rings_mu;
+// Every thread's Ring, kept after the thread exits so its events can still be
+// written.
+std::vector<std::shared_ptr<Ring>> rings;
+TimePoint start_time;
+
+Ring& ThreadRing() {
+  thread_local std::shared_ptr<Ring> ring = [] {
+    auto ring = std::make_shared<Ring>();
+    std::lock_guard<std::mutex> lock(rings_mu);
+    ring->tid = rings.size() + 1;
+    rings.push_back(ring);
+    return ring;
+  }();
+  return *ring;
+}
+
+void Append(const char* name, Phase phase, TimePoint start,
+            std::chrono::nanoseconds duration, const Arg* args,
+            size_t arg_count) {
+  Event event{name, phase, start, duration, {}, std::min(arg_count, kMaxArgs)};
+  std::copy(args, args + event.arg_count, event.args);
+
+  Ring& ring = ThreadRing();
+  std::lock_guard<std::mutex> lock(ring.mu);
+  if (ring.events.size() < kEventsPerThread) {
+    ring.events.push_back(event);
+  } else {
+    ring.events[ring.recorded % kEventsPerThread] = event;
+  }
+  ring.recorded++;
+}
+
+// Converts a time to microseconds since the trace started, as Chrome expects.
+double Micros(std::chrono::nanoseconds d) { return d.count() / 1e3; }
+
+// Writes a string as a JSON string, escaping as needed.
+void WriteString(std::ostream& o, const std::string& s) {
+  o << "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') o << '\\';
+    o << c;
+  }
+  o << "\"";
+}
+
+}  // namespace
+
+void Enable() {
+  std::lock_guard<std::mutex> lock(rings_mu);
+  if (!internal::enabled) {
+    start_time = std::chrono::steady_clock::now();
+    internal::enabled = true;
+  }
+}
+
+void NameThread(const std::string& name) {
+  if (!Enabled()) return;
+  Ring& ring = ThreadRing();
+  std::lock_guard<std::mutex> lock(ring.mu);
+  ring.name = name;
+}
+
+void Complete(const char* name, TimePoint start, TimePoint end,
+              std::initializer_list<Arg> args) {
+  if (!Enabled()) return;
+  Append(name, Phase::Complete, start, end - start, args.begin(), args.size());
+}
+
+void Instant(const char* name, TimePoint at, std::initializer_list<Arg> args) {
+  if (!Enabled()) return;
+  Append(name, Phase::Instant, at, std::chrono::nanoseconds{0}, args.begin(),
+         args.size());
+}
+
+Span::Span(const char* name, std::initializer_list<Arg> args)
+    : name_(name), enabled_(Enabled()), arg_count_(0) {
+  if (!enabled_) return;
+  for (auto const& arg : args) AddArg(arg.key, arg.value);
+  start_ = std::chrono::steady_clock::now();
+}
+
+Span::~Span() {
+  if (!enabled_) return;
+  auto end = std::chrono::steady_clock::now();
+  Append(name_, Phase::Complete, start_, end - start_, args_, arg_count_);
+}
+
+void Span::AddArg(const char* key, int64_t value) {
+  if (enabled_ && arg_count_ < kMaxArgs) {
+    args_[arg_count_++] = Arg{key, value};
+  }
+}
+
+void WriteChromeTrace(std::ostream& o) {
+  std::vector<std::shared_ptr<Ring>> all;
+  {
+    std::lock_guard<std::mutex> lock(rings_mu);
+    all = rings;
+  }
+
+  const int pid = getpid();
+  bool first = true;
+  auto begin = [&] {
+    o << (first ? "\n" : ",\n");
+    first = false;
+  };
+
+  // Write times to the nanosecond, restoring the stream's format afterwards.
+  std::ios format(nullptr);
+  format.copyfmt(o);
+  o << std::fixed << std::setprecision(3);
+
+  o << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+  for (auto const& ring : all) {
+    std::lock_guard<std::mutex> lock(ring->mu);
+    if (!ring->name.empty()) {
+      begin();
+      o << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << pid
+        << ", \"tid\": " << ring->tid << ", \"args\": {\"name\": ";
+      WriteString(o, ring->name);
+      o << "}}";
+    }
+    for (auto const& event : ring->events) {
+      begin();
+      o << "{\"name\": ";
+      WriteString(o, event.name);
+      o << ", \"ph\": \"" << (event.phase == Phase::Complete ? "X" : "i")
+        << "\", \"pid\": " << pid << ", \"tid\": " << ring->tid
+        << ", \"ts\": " << Micros(event.start - start_time);
+      if (event.phase == Phase::Complete) {
+        o << ", \"dur\": " << Micros(event.duration);
+      } else {
+        o << ", \"s\": \"t\"";
+      }
+      o << ", \"args\": {";
+      for (size_t i = 0; i < event.arg_count; ++i) {
+        if (i > 0) o << ", ";
+        o << "\"" << event.args[i].key << "\": " << event.args[i].value;
+      }
+      o << "}}";
+    }
+  }
+  o << "\n]}" << std::endl;
+  o.copyfmt(format);
+}
+
+}  // namespace timeline
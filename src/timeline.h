@@ -0,0 +1,85 @@
+#ifndef TIMELINE_H_
+#define TIMELINE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <initializer_list>
+#include <iostream>
+#include <string>
+
+// Records a timeline of what each thread spends its time on, such as rounds,
+// send attempts and sender joins, and writes it in the Chrome trace event
+// format so a run can be opened in a trace viewer (chrome://tracing or
+// Perfetto). Recording is off by default, in which case every call returns
+// after a single relaxed load.
+namespace timeline {
+
+typedef std::chrono::steady_clock::time_point TimePoint;
+
+// An integer argument attached to an event, shown when it is selected in the
+// viewer. Keys must be string literals.
+struct Arg {
+  const char* key;
+  int64_t value;
+};
+
+// The most arguments an event can carry. Extra arguments are dropped.
+const size_t kMaxArgs = 4;
+
+// The number of events each thread keeps. Once full, a thread's oldest events
+// are overwritten.
+const size_t kEventsPerThread = 1 << 14;
+
+namespace internal {
+extern std::atomic<bool> enabled;
+}  // namespace internal
+
+// Starts recording events. Timestamps in the written trace are relative to the
+// first call.
+void Enable();
+
+inline bool Enabled() {
+  return internal::enabled.load(std::memory_order_relaxed);
+}
+
+// Names the calling thread in the viewer.
+void NameThread(const std::string& name);
+
+// Records an event that spans from start to end on the calling thread. Names
+// must be string literals.
+void Complete(const char* name, TimePoint start, TimePoint end,
+              std::initializer_list<Arg> args = {});
+
+// Records an event at a single point in time on the calling thread.
+void Instant(const char* name, TimePoint at,
+             std::initializer_list<Arg> args = {});
+inline void Instant(const char* name, std::initializer_list<Arg> args = {}) {
+  if (Enabled()) Instant(name, std::chrono::steady_clock::now(), args);
+}
+
+// Records the lifetime of the Span as an event on the calling thread.
+class Span {
+ public:
+  Span(const char* name, std::initializer_list<Arg> args = {});
+  ~Span();
+
+  // Attaches another argument to the event, like the outcome of the work it
+  // spans.
+  void AddArg(const char* key, int64_t value);
+
+ private:
+  const char* name_;
+  bool enabled_;
+  TimePoint start_;
+  Arg args_[kMaxArgs];
+  size_t arg_count_;
+};
+
+// Writes every recorded event as a Chrome trace JSON object. Threads may keep
+// recording while this runs.
+void WriteChromeTrace(std::ostream& o);
+
+}  // namespace timeline
+
+#endif
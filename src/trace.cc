@@ -0,0 +1,100 @@
+#include "trace.h"
+
+#include <cstring>
+#include <stdexcept>
+
+namespace trace {
+
+namespace {
+
+const char kMagic[8] = {'B', 'Y', 'Z', 'T', 'R', 'A', 'C', 'E'};
+const uint32_t kVersion = 1;
+
+// The size of an entry's fixed fields: time, address, port and size.
+const size_t kEntryHeaderSize = 8 + 4 + 2 + 2;
+
+// Stores the low size bytes of v into buf, least significant first.
+void PutLittleEndian(char* buf, uint64_t v, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    buf[i] = (char)(v >> (8 * i));
+  }
+}
+
+// Loads size bytes from buf, least significant first.
+uint64_t GetLittleEndian(const char* buf, size_t size) {
+  uint64_t v = 0;
+  for (size_t i = 0; i < size; ++i) {
+    v |= (uint64_t)(unsigned char)buf[i] << (8 * i);
+  }
+  return v;
+}
+
+}  // namespace
+
+Writer::Writer(const std::string& path)
+    : file_(path, std::ios::binary | std::ios::trunc),
+      start_(std::chrono::steady_clock::now()) {
+  if (!file_) {
+    throw std::runtime_error("could not open trace file " + path);
+  }
+  char header[sizeof(kMagic) + 4];
+  std::memcpy(header, kMagic, sizeof(kMagic));
+  PutLittleEndian(header + sizeof(kMagic), kVersion, 4);
+  file_.write(header, sizeof(header));
+}
+
+void Writer::Append(const udp::SocketAddress& from, const char* buf,
+                    size_t n) {
+  const auto now = std::chrono::steady_clock::now();
+  const uint64_t time =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(now - start_)
+          .count();
+  auto sin = reinterpret_cast<const struct sockaddr_in*>(from.addr());
+
+  char header[kEntryHeaderSize];
+  PutLittleEndian(header, time, 8);
+  std::memcpy(header + 8, &sin->sin_addr.s_addr, 4);
+  std::memcpy(header + 12, &sin->sin_port, 2);
+  PutLittleEndian(header + 14, n, 2);
+  file_.write(header, sizeof(header));
+  file_.write(buf, n);
+}
+
+Reader::Reader(const std::string& path) : file_(path, std::ios::binary) {
+  if (!file_) {
+    throw std::runtime_error("could not open trace file " + path);
+  }
+  char header[sizeof(kMagic) + 4];
+  if (!file_.read(header, sizeof(header)) ||
+      std::memcmp(header, kMagic, sizeof(kMagic)) != 0) {
+    throw std::runtime_error(path + " is not a trace file");
+  }
+  if (GetLittleEndian(header + sizeof(kMagic), 4) != kVersion) {
+    throw std::runtime_error(path + " has an unsupported trace version");
+  }
+}
+
+std::experimental::optional<Record> Reader::Next() {
+  char header[kEntryHeaderSize];
+  file_.read(header, sizeof(header));
+  if (file_.gcount() == 0) {
+    return {};
+  }
+  if (!file_) {
+    throw std::runtime_error("trace file is truncated");
+  }
+
+  struct sockaddr_in sin = {};
+  sin.sin_family = AF_INET;
+  std::memcpy(&sin.sin_addr.s_addr, header + 8, 4);
+  std::memcpy(&sin.sin_port, header + 12, 2);
+  Record rec{std::chrono::nanoseconds{GetLittleEndian(header, 8)},
+             udp::SocketAddress(sin),
+             std::vector<char>(GetLittleEndian(header + 14, 2))};
+  if (!file_.read(rec.data.data(), rec.data.size())) {
+    throw std::runtime_error("trace file is truncated");
+  }
+  return rec;
+}
+
+}  // namespace trace
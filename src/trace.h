@@ -0,0 +1,59 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <chrono>
+#include <experimental/optional>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "socket_address.h"
+
+namespace trace {
+
+// A datagram received by a process, as stored in a trace.
+struct Record {
+  // The time the datagram was received, relative to the start of the
+  // recording.
+  std::chrono::nanoseconds time;
+  udp::SocketAddress from;
+  std::vector<char> data;
+};
+
+// Writes received datagrams to a trace file. A trace is the 8 byte magic
+// "BYZTRACE" followed by a 4 byte version and one entry per datagram: its
+// receive time in nanoseconds (8 bytes), the sender's IPv4 address and port (4
+// and 2 bytes, in network byte order), the datagram's size (2 bytes) and its
+// data. Other integers are little-endian. Timestamps come from the monotonic
+// steady_clock, and start when the Writer is created. Not thread-safe.
+class Writer {
+ public:
+  // Creates the trace file, throwing an exception if it cannot be opened.
+  Writer(const std::string& path);
+
+  // Appends a datagram received now.
+  void Append(const udp::SocketAddress& from, const char* buf, size_t n);
+
+ private:
+  std::ofstream file_;
+  const std::chrono::steady_clock::time_point start_;
+};
+
+// Reads the datagrams of a trace file in the order they were received.
+class Reader {
+ public:
+  // Opens the trace file, throwing an exception if it cannot be opened or is
+  // not a trace.
+  Reader(const std::string& path);
+
+  // Reads the next datagram. The return value is absent at the end of the
+  // trace. Throws an exception if the trace is truncated.
+  std::experimental::optional<Record> Next();
+
+ private:
+  std::ifstream file_;
+};
+
+}  // namespace trace
+
+#endif
@@ -0,0 +1,278 @@
+#include "transport.h"
+
+namespace transport {
+
+namespace {
+
+// Returns the histogram of ack round-trip times measured with the provided
+// clock: "kernel" between kernel timestamps, or "user" around the send and
+// the wakeup of SendWithAck.
+metrics::Histogram& AckRtt(const std::string& clock) {
+  return metrics::Default().GetHistogram(
+      "byzantine_ack_rtt_seconds",
+      "Time from sending a message to receiving its ack, by clock.",
+      {{"clock", clock}});
+}
+
+// Returns the histogram of the time from the kernel receiving a datagram of
+// the provided kind to the process handling it, which is the delay added by
+// scheduling and queueing in this process.
+metrics::Histogram& ReceiveDelay(const std::string& datagram) {
+  return metrics::Default().GetHistogram(
+      "byzantine_receive_delay_seconds",
+      "Time from the kernel receiving a datagram to its handling, by kind.",
+      {{"datagram", datagram}});
+}
+
+}  // namespace
+
+bool Server::SendWithAck(const Address& to, const char* buf, size_t size,
+                         uint32_t seq, unsigned int attempts,
+                         std::chrono::microseconds ack_timeout) {
+  const AckKey key{to, seq};
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    pending_acks_.insert(key);
+  }
+
+  static metrics::Counter& retransmissions = metrics::Default().GetCounter(
+      "byzantine_retransmissions_total",
+      "Datagrams resent by SendWithAck because no ack arrived in time.");
+  static metrics::Histogram& user_rtt = AckRtt("user");
+  static metrics::Histogram& kernel_rtt = AckRtt("kernel");
+  static metrics::Histogram& ack_delay = ReceiveDelay("ack");
+
+  bool acked = false;
+  bool noLimit = attempts == 0;
+  for (bool first = true; !acked && (noLimit || attempts > 0);
+       --attempts, first = false) {
+    // Send the message to the client.
+    if (!first) retransmissions.Add();
+    timeline::Span span("send attempt",
+                        {{"port", to.Port()}, {"seq", seq}, {"retry", !first}});
+    const auto sent = std::chrono::steady_clock::now();
+    const uint64_t id = Send(to, buf, size);
+
+    // Wait for the receive thread to hand us the ack. If the timeout passes,
+    // try sending the message again.
+    std::experimental::optional<KernelTime> ack_received;
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      acked = ack_cv_.wait_for(lock, ack_timeout, [this, &key] {
+        return received_acks_.count(key) > 0;
+      });
+      if (acked) ack_received = received_acks_[key];
+    }
+    span.AddArg("acked", acked);
+
+    // Only acks of first attempts are sampled, since the ack of a retry could
+    // be for any of the attempts (Karn's algorithm). The kernel timestamps
+    // are preferred when both ends of the round trip have one. A kernel RTT
+    // longer than the one measured around it means the transmit time was
+    // attributed to the wrong datagram, so it is discarded.
+    std::experimental::optional<std::chrono::microseconds> rtt;
+    bool kernel = false;
+    if (acked && first) {
+      rtt = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - sent);
+      user_rtt.Record(*rtt);
+      auto transmitted = TransmitTimeOf(id);
+      if (ack_received && transmitted && *transmitted <= *ack_received) {
+        auto k = std::chrono::duration_cast<std::chrono::microseconds>(
+            *ack_received - *transmitted);
+        if (k <= *rtt) {
+          rtt = k;
+          kernel = true;
+          kernel_rtt.Record(*ack_received - *transmitted);
+          ack_delay.Record(std::chrono::system_clock::now() - *ack_received);
+        }
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(links_mu_);
+    LinkStats& link = links_[to];
+    link.attempts++;
+    if (!first) link.retransmissions++;
+    if (rtt) {
+      SampleRtt(&link, *rtt);
+      if (kernel) link.kernel_rtt_samples++;
+    }
+  }
+
+  if (!acked) {
+    std::lock_guard<std::mutex> lock(links_mu_);
+    links_[to].unacked++;
+  }
+
+  std::lock_guard<std::mutex> lock(mu_);
+  pending_acks_.erase(key);
+  received_acks_.erase(key);
+  return acked;
+}
+
+void Server::Listen(OnReceiveFn rcv, OnTimeout timeout,
+                    std::chrono::microseconds tick) {
+  const auto wait = tick.count() > 0 ? tick : timeout_;
+  // While the server is running, wait for datagrams and
+  // call the provided closure with their data.
+  while (1) {
+    std::unique_lock<std::mutex> lock(mu_);
+    auto ready = [this] { return !datagrams_.empty() || receive_error_; };
+    bool received;
+    if (wait.count() > 0) {
+      received = datagram_cv_.wait_for(lock, wait, ready);
+    } else {
+      datagram_cv_.wait(lock, ready);
+      received = true;
+    }
+
+    if (!received) {
+      lock.unlock();
+      auto action = timeout();
+      switch (action) {
+        case ServerAction::Continue:
+          continue;
+        case ServerAction::Stop:
+          return;
+        default:
+          throw std::invalid_argument("unexpected ServerAction value");
+      }
+    }
+
+    if (receive_error_) {
+      std::rethrow_exception(receive_error_);
+    }
+
+    Datagram dgram = std::move(datagrams_.front());
+    datagrams_.pop_front();
+    lock.unlock();
+
+    if (dgram.received) {
+      static metrics::Histogram& delay = ReceiveDelay("message");
+      delay.Record(std::chrono::system_clock::now() - *dgram.received);
+    }
+
+    // Call the receive callback with the data received.
+    auto action = rcv(dgram.from, dgram.data.data(), dgram.data.size());
+    if (action == ServerAction::Stop) {
+      return;
+    }
+  }
+}
+
+void Server::Record(std::shared_ptr<trace::Writer> recorder) {
+  std::lock_guard<std::mutex> lock(record_mu_);
+  recorder_ = recorder;
+}
+
+Traffic Server::Received() const {
+  return Traffic{messages_in_, acks_in_, bytes_in_};
+}
+
+uint64_t Server::Send(const Address& to, const char* buf, size_t size) {
+  {
+    std::lock_guard<std::mutex> lock(links_mu_);
+    LinkStats& link = links_[to];
+    link.messages_out++;
+    link.bytes_out += size;
+  }
+  const uint64_t id = next_send_id_++;
+  Transmit(id, to, buf, size);
+  return id;
+}
+
+void Server::Transmitted(uint64_t id, KernelTime sent) {
+  std::lock_guard<std::mutex> lock(transmit_mu_);
+  transmit_times_[id % kTransmitTimes] = TransmitTime{id, sent};
+}
+
+std::experimental::optional<KernelTime> Server::TransmitTimeOf(uint64_t id) {
+  std::lock_guard<std::mutex> lock(transmit_mu_);
+  auto const& entry = transmit_times_[id % kTransmitTimes];
+  if (entry.id != id) {
+    return {};
+  }
+  return entry.sent;
+}
+
+void Server::NoteInvalid(const Address& from) {
+  std::lock_guard<std::mutex> lock(links_mu_);
+  links_[from].invalid++;
+}
+
+std::map<Address, LinkStats> Server::Links() const {
+  std::lock_guard<std::mutex> lock(links_mu_);
+  return links_;
+}
+
+void Server::SampleRtt(LinkStats* link, std::chrono::microseconds rtt) {
+  if (link->rtt_samples++ == 0) {
+    link->srtt = rtt;
+    link->rttvar = rtt / 2;
+    return;
+  }
+  auto deviation = link->srtt > rtt ? link->srtt - rtt : rtt - link->srtt;
+  link->rttvar = (3 * link->rttvar + deviation) / 4;
+  link->srtt = (7 * link->srtt + rtt) / 8;
+}
+
+void Server::Deliver(const Address& from, const char* buf, size_t n,
+                     std::experimental::optional<KernelTime> received) {
+  bytes_in_ += n;
+  {
+    std::lock_guard<std::mutex> lock(links_mu_);
+    LinkStats& link = links_[from];
+    link.messages_in++;
+    link.bytes_in += n;
+    link.last_heard = std::chrono::steady_clock::now();
+  }
+  {
+    std::lock_guard<std::mutex> lock(record_mu_);
+    if (recorder_) {
+      recorder_->Append(from, buf, n);
+    }
+  }
+
+  // Hand acknowledgements to the sender waiting on them. Acks that nobody is
+  // waiting on are duplicates or late, and are dropped.
+  auto seq = ack_decoder_(buf, n);
+  if (seq) {
+    acks_in_++;
+    std::lock_guard<std::mutex> lock(mu_);
+    AckKey key{from, *seq};
+    if (pending_acks_.count(key) > 0) {
+      timeline::Instant("ack", {{"port", from.Port()}, {"seq", *seq}});
+      received_acks_.emplace(key, received);
+      ack_cv_.notify_all();
+    }
+    return;
+  }
+
+  // Queue everything else for Listen.
+  messages_in_++;
+  std::lock_guard<std::mutex> lock(mu_);
+  if (datagrams_.size() >= kMaxQueuedDatagrams) {
+    return;
+  }
+  datagrams_.push_back(
+      Datagram{from, std::vector<char>(buf, buf + n), received});
+  datagram_cv_.notify_one();
+}
+
+void Server::Fail(std::exception_ptr err) {
+  std::lock_guard<std::mutex> lock(mu_);
+  receive_error_ = err;
+  datagram_cv_.notify_all();
+}
+
+void Client::Send(const char* buf, size_t size) const {
+  server_->Send(remote_address_, buf, size);
+}
+
+bool Client::SendWithAck(const char* buf, size_t size, uint32_t seq,
+                         unsigned int attempts) const {
+  return server_->SendWithAck(remote_address_, buf, size, seq, attempts,
+                              ack_timeout_);
+}
+
+}  // namespace transport
@@ -0,0 +1,274 @@
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <experimental/optional>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "metrics.h"
+#include "socket_address.h"
+#include "timeline.h"
+#include "trace.h"
+
+// The maximum size of a datagram.
+#define BUFSIZE 1024
+
+namespace transport {
+
+// Every process is identified by the address it listens on in the hostfile,
+// regardless of how datagrams physically reach it.
+typedef udp::SocketAddress Address;
+
+// Defines the methods of interacting with a running server.
+enum class ServerAction {
+  Continue,
+  Stop,
+};
+
+typedef std::function<ServerAction(const Address&, char*, size_t)>
+    OnReceiveFn;
+typedef std::function<ServerAction()> OnTimeout;
+
+// Decodes the sequence number of an acknowledgement. If the datagram is not an
+// acknowledgement, the return value will be absent.
+typedef std::function<std::experimental::optional<uint32_t>(const char*,
+                                                            size_t)>
+    AckDecoderFn;
+
+const auto kNoTimeout = std::chrono::microseconds{0};
+
+// A time at which the kernel saw a datagram leave or arrive, for transports
+// that support kernel timestamps (see udp::Server). The kernel stamps with the
+// realtime clock.
+typedef std::chrono::system_clock::time_point KernelTime;
+
+// The number of recent kernel transmit times a Server keeps.
+const size_t kTransmitTimes = 1024;
+
+// The interval at which a Server's receive thread checks if it should stop.
+const auto kReceivePollInterval = std::chrono::milliseconds{100};
+
+// The maximum number of received datagrams buffered before new ones are
+// dropped.
+const size_t kMaxQueuedDatagrams = 1 << 16;
+
+// Counts of the datagrams a Server has received.
+struct Traffic {
+  uint64_t messages;
+  uint64_t acks;
+  // Bytes of datagram payload, acknowledgements included.
+  uint64_t bytes;
+};
+
+// The quality of the link to a single peer, as seen by a Server.
+struct LinkStats {
+  // Datagrams and bytes in each direction, acknowledgements and
+  // retransmissions included.
+  uint64_t messages_out;
+  uint64_t bytes_out;
+  uint64_t messages_in;
+  uint64_t bytes_in;
+  // Sends made by SendWithAck, those of them that were retries, and the
+  // SendWithAck calls that gave up without an ack.
+  uint64_t attempts;
+  uint64_t retransmissions;
+  uint64_t unacked;
+  // Datagrams from the peer that its General rejected (see NoteInvalid).
+  uint64_t invalid;
+  // The smoothed round-trip time and its mean deviation, estimated as in TCP
+  // (RFC 6298) from acks of first attempts. Zero until the first sample.
+  std::chrono::microseconds srtt;
+  std::chrono::microseconds rttvar;
+  uint64_t rtt_samples;
+  // The samples measured between kernel timestamps, which exclude the time
+  // either process took to get around to sending or handling the datagrams.
+  // The rest were measured in user space.
+  uint64_t kernel_rtt_samples;
+  // When a datagram last arrived from the peer. The epoch if none has.
+  std::chrono::steady_clock::time_point last_heard;
+
+  // Returns the fraction of SendWithAck attempts that were not acknowledged
+  // in time, which estimates the loss rate of the link in both directions.
+  inline double LossRate() const {
+    return attempts > 0 ? (double)retransmissions / attempts : 0;
+  }
+};
+
+// The single endpoint through which a process sends and receives all of its
+// datagrams. Implementations move the datagrams (see udp::Server and
+// shm::Server) and hand every received one to Deliver from their receive
+// thread. Acknowledgements are demultiplexed by sender and sequence number to
+// the SendWithAck call waiting on them, and everything else is queued for
+// Listen.
+class Server {
+ public:
+  Server(AckDecoderFn ack_decoder, std::chrono::microseconds timeout)
+      : ack_decoder_(ack_decoder),
+        timeout_(timeout),
+        messages_in_(0),
+        acks_in_(0),
+        bytes_in_(0),
+        next_send_id_(1),
+        transmit_times_(kTransmitTimes) {}
+
+  virtual ~Server() = default;
+
+  // Sends the datagram to the remote address, and returns the id it was sent
+  // with.
+  uint64_t Send(const Address& to, const char* buf, size_t size);
+
+  // Sends the message to the remote address and waits for the
+  // acknowledgement carrying the provided sequence number. Will send up to the
+  // number of attempts provided, unless attempts = 0, in which case it will
+  // continue to send forever until an ack is seen. Returns whether the message
+  // was acknowledged.
+  bool SendWithAck(const Address& to, const char* buf, size_t size,
+                   uint32_t seq, unsigned int attempts,
+                   std::chrono::microseconds ack_timeout);
+
+  // Calls rcv with each datagram that is not an acknowledgement, or timeout if
+  // no datagram arrives within the Server's timeout, until either returns
+  // ServerAction::Stop. A positive tick replaces the Server's timeout, for
+  // callers that keep deadlines finer than it.
+  void Listen(OnReceiveFn rcv, OnTimeout timeout,
+              std::chrono::microseconds tick = std::chrono::microseconds{0});
+
+  // Records every datagram the Server receives from now on, acknowledgements
+  // included, to the trace.
+  void Record(std::shared_ptr<trace::Writer> recorder);
+
+  // Returns the counts of datagrams received so far.
+  Traffic Received() const;
+
+  // Records that a datagram from the peer was rejected as invalid.
+  void NoteInvalid(const Address& from);
+
+  // Returns the quality of the link to every peer that has been sent to or
+  // heard from.
+  std::map<Address, LinkStats> Links() const;
+
+ protected:
+  // Sends the datagram to the remote address. Implemented by each transport.
+  // Transports with kernel timestamps report when the datagram left through
+  // Transmitted, using the provided id.
+  virtual void Transmit(uint64_t id, const Address& to, const char* buf,
+                        size_t size) = 0;
+
+  // Records the kernel timestamp of the datagram sent with the id.
+  void Transmitted(uint64_t id, KernelTime sent);
+
+  // Hands a received datagram to the Server, along with its kernel timestamp
+  // if the transport has one. Called by the receive thread of
+  // implementations.
+  void Deliver(const Address& from, const char* buf, size_t n,
+               std::experimental::optional<KernelTime> received = {});
+
+  // Records a fatal receive error, which Listen rethrows on the caller's
+  // thread.
+  void Fail(std::exception_ptr err);
+
+ private:
+  // A datagram waiting to be handled by Listen.
+  struct Datagram {
+    Address from;
+    std::vector<char> data;
+    std::experimental::optional<KernelTime> received;
+  };
+  // Identifies an acknowledgement by its sender and sequence number.
+  typedef std::pair<Address, uint32_t> AckKey;
+
+  const AckDecoderFn ack_decoder_;
+  const std::chrono::microseconds timeout_;
+
+  std::mutex mu_;
+  std::condition_variable datagram_cv_;
+  std::condition_variable ack_cv_;
+  std::deque<Datagram> datagrams_;
+  // Acknowledgements that SendWithAck calls are waiting on, and those of them
+  // that have arrived with their kernel timestamps.
+  std::set<AckKey> pending_acks_;
+  std::map<AckKey, std::experimental::optional<KernelTime>> received_acks_;
+  // Set if the receive thread failed. Rethrown by Listen.
+  std::exception_ptr receive_error_;
+
+  std::atomic<uint64_t> messages_in_;
+  std::atomic<uint64_t> acks_in_;
+  std::atomic<uint64_t> bytes_in_;
+
+  // Guards the link table separately, since it is updated on every datagram.
+  mutable std::mutex links_mu_;
+  std::map<Address, LinkStats> links_;
+
+  // Adds an RTT sample to the estimate of the link, with links_mu_ held.
+  static void SampleRtt(LinkStats* link, std::chrono::microseconds rtt);
+
+  // The kernel transmit times of recent datagrams, indexed by id modulo
+  // kTransmitTimes. Entries are overwritten by later datagrams, so lookups
+  // check the id.
+  struct TransmitTime {
+    uint64_t id;
+    KernelTime sent;
+  };
+  std::atomic<uint64_t> next_send_id_;
+  std::mutex transmit_mu_;
+  std::vector<TransmitTime> transmit_times_;
+
+  // Returns the kernel transmit time of the datagram sent with the id, if it
+  // is known.
+  std::experimental::optional<KernelTime> TransmitTimeOf(uint64_t id);
+
+  // Guards the recorder separately so that writing the trace never delays
+  // senders waiting on mu_.
+  std::mutex record_mu_;
+  std::shared_ptr<trace::Writer> recorder_;
+};
+
+// Provides an interface to send messages to a remote process through the
+// current process's Server.
+class Client {
+ public:
+  Client(std::shared_ptr<Server> server, Address addr,
+         std::chrono::microseconds ack_timeout)
+      : server_(server),
+        remote_address_(addr),
+        ack_timeout_(ack_timeout),
+        next_seq_(0){};
+
+  // Sends the message to the remote server.
+  void Send(const char* buf, size_t size) const;
+
+  // Sends the message to the remote server and waits for an acknowledgement
+  // of the sequence number. Will send up to the number of attempts provided,
+  // unless attempts = 0, in which case it will continue to send forever until
+  // an ack is seen. Returns whether the message was acknowledged.
+  bool SendWithAck(const char* buf, size_t size, uint32_t seq,
+                   unsigned int attempts) const;
+
+  // Returns a sequence number for a new message to the remote server.
+  inline uint32_t NextSeq() const { return next_seq_++; };
+
+  // Returns the address of the remote server.
+  inline const Address& RemoteAddress() const { return remote_address_; };
+
+ private:
+  const std::shared_ptr<Server> server_;
+  const Address remote_address_;
+  const std::chrono::microseconds ack_timeout_;
+  mutable std::atomic<uint32_t> next_seq_;
+};
+
+typedef std::shared_ptr<const Client> ClientPtr;
+
+}  // namespace transport
+
+#endif
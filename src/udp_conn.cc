@@ -1,7 +1,42 @@
 #include "udp_conn.h"
 
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <poll.h>
+
 namespace udp {
 
+namespace {
+
+// The size of the buffer for a received datagram's control messages.
+const size_t kControlSize = 512;
+
+// Converts a kernel timestamp to a transport::KernelTime.
+transport::KernelTime ToKernelTime(const struct timespec &ts) {
+  return transport::KernelTime(std::chrono::duration_cast<
+                               std::chrono::system_clock::duration>(
+      std::chrono::seconds{ts.tv_sec} + std::chrono::nanoseconds{ts.tv_nsec}));
+}
+
+// Returns the software timestamp among the message's control messages, if it
+// has one.
+std::experimental::optional<transport::KernelTime> SoftwareTimestamp(
+    struct msghdr *msg) {
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SO_TIMESTAMPING) {
+      auto ts = reinterpret_cast<struct scm_timestamping*>(CMSG_DATA(cmsg));
+      if (ts->ts[0].tv_sec != 0 || ts->ts[0].tv_nsec != 0) {
+        return ToKernelTime(ts->ts[0]);
+      }
+    }
+  }
+  return {};
+}
+
+}  // namespace
+
 // Creates a UDP socket or throws an exception on error.
 Socket CreateSocket(const std::chrono::microseconds timeout) {
   // Create the socket.
@@ -9,12 +44,25 @@ Socket CreateSocket(const std::chrono::microseconds timeout) {
   if (sockfd < 0) {
     throw net::SocketException();
   }
+  // Closes the socket and throws, reporting the errno of the failed call.
+  auto fail = [sockfd] {
+    net::SocketException err;
+    close(sockfd);
+    throw err;
+  };
 
   // Resuse the port immediately after the socket is killed.
   int optval = 1;
   if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval,
                  sizeof(int))) {
-    throw net::SocketException();
+    fail();
+  }
+
+  // Buffer bursts of datagrams while the receive thread catches up.
+  optval = kReceiveBufferSize;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, (const void *)&optval,
+                 sizeof(int))) {
+    fail();
   }
 
   // Set socket timeout if provided.
@@ -27,7 +75,7 @@ Socket CreateSocket(const std::chrono::microseconds timeout) {
     timeval.tv_usec = (timeout - secs).count();
     if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeval,
                    sizeof(timeval))) {
-      throw net::SocketException();
+      fail();
     }
   }
 
@@ -38,130 +86,147 @@ inline bool IsErrnoTimeout() {
   return errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED;
 }
 
-SocketAddress::SocketAddress(net::Address addr) {
-  // Get the remote server's DNS entry.
-  struct hostent *server = gethostbyname(addr.hostname().c_str());
-  if (server == nullptr) {
-    throw net::HostNotFoundException(addr.hostname());
-  }
-
-  // Build the server's Internet address.
-  addr_.sin_family = AF_INET;
-  bcopy((char *)server->h_addr, (char *)&addr_.sin_addr.s_addr,
-        server->h_length);
-  addr_.sin_port = htons(addr.port());
+bool EnableTimestamping(Socket sockfd) {
+  // OPT_ID numbers the transmit timestamps in the order of the sends, and
+  // OPT_TSONLY leaves the sent datagram out of the error queue.
+  int flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE |
+              SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+              SOF_TIMESTAMPING_OPT_TSONLY;
+  return setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+                    sizeof(flags)) == 0;
 }
 
-std::string SocketAddress::Hostname() const {
-  struct hostent *hostp = gethostbyaddr((const char *)&addr_.sin_addr.s_addr,
-                                        sizeof(addr_.sin_addr.s_addr), AF_INET);
-  if (hostp == nullptr) {
-    throw net::HostNotFoundException("");
-  }
+Server::Server(unsigned short port, transport::AckDecoderFn ack_decoder,
+               std::chrono::microseconds timeout)
+    : transport::Server(ack_decoder, timeout),
+      sockfd_(CreateSocket(transport::kReceivePollInterval)),
+      timestamping_(EnableTimestamping(sockfd_)),
+      transmit_key_(0),
+      transmit_ids_(transport::kTransmitTimes),
+      stopped_(false) {
+  // Create a socket and associate the it with the port
+  struct sockaddr_in server_address = {};
+  server_address.sin_family = AF_INET;
+  server_address.sin_addr.s_addr = htonl(INADDR_ANY);
+  server_address.sin_port = htons(port);
 
-  std::string hostname(hostp->h_name);
-  if (hostname == "localhost") {
-    hostname = net::GetHostname();
+  if (bind(sockfd_, (struct sockaddr *)&server_address,
+           sizeof(server_address)) < 0) {
+    close(sockfd_);
+    throw net::BindException();
   }
-  return hostname;
+
+  receiver_ = std::thread([this] { Receive(); });
+};
+
+Server::~Server() {
+  stopped_ = true;
+  receiver_.join();
+  close(sockfd_);
 }
 
-unsigned short SocketAddress::Port() const { return ntohs(addr_.sin_port); }
+void Server::Transmit(uint64_t id, const SocketAddress &to, const char *buf,
+                      size_t size) {
+  if (!timestamping_) {
+    if (sendto(sockfd_, buf, size, 0, to.addr(), to.addr_len()) < 0) {
+      throw net::SendException();
+    }
+    return;
+  }
 
-void Client::Send(const char *buf, size_t size) const {
-  auto addr = remote_address_.addr();
-  auto addrlen = remote_address_.addr_len();
-  if (sendto(sockfd_, buf, size, 0, addr, addrlen) < 0) {
+  std::lock_guard<std::mutex> lock(transmit_mu_);
+  if (sendto(sockfd_, buf, size, 0, to.addr(), to.addr_len()) < 0) {
     throw net::SendException();
   }
+  const uint32_t key = transmit_key_++;
+  transmit_ids_[key % transport::kTransmitTimes] = {key, id};
 }
 
-void Client::SendWithAck(const char *buf, size_t size, unsigned int attempts,
-                         OnReceiveFn validAck) const {
-  bool noLimit = attempts == 0;
-  for (; noLimit || attempts > 0; --attempts) {
-    // Send the message to the client.
-    Send(buf, size);
-
-    // Create a zeroed out buffer to read the ack message into.
-    char ackbuf[BUFSIZE];
-    bzero(ackbuf, BUFSIZE);
-
-    // receive from the socket.
-    struct sockaddr_in clientaddr;
-    socklen_t clientlen = sizeof(clientaddr);
-    int n = recvfrom(sockfd_, ackbuf, BUFSIZE, 0,
-                     (struct sockaddr *)&clientaddr, &clientlen);
-
-    // Check for error cases. This is either a timeout or some kind of
-    // networking error. For timeouts, try sending the message again. For
-    // anything else, throw an exception.
-    if (n < 0) {
-      if (IsErrnoTimeout()) {
-        continue;
-      } else {
-        throw net::ReceiveException();
-      }
+void Server::Receive() {
+  while (!stopped_) {
+    // Wait for a datagram or a transmit timestamp. The timeout wakes us up
+    // periodically to check if the Server is being destroyed.
+    struct pollfd pfd = {};
+    pfd.fd = sockfd_;
+    pfd.events = POLLIN;
+    const auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+        transport::kReceivePollInterval);
+    if (poll(&pfd, 1, timeout.count()) <= 0) {
+      continue;
     }
 
-    // Make sure the ack was valid.
-    auto action = validAck(shared_from_this(), ackbuf, n);
-    if (action == ServerAction::Stop) {
+    // Read transmit timestamps first, so that they are known before the acks
+    // of their datagrams are handled. Errors that are not timestamps, like
+    // ICMP port unreachable, are cleared by the receive that follows.
+    if (pfd.revents & POLLERR) {
+      ReceiveTransmitTimes();
+    }
+    if (!ReceiveDatagram()) {
       return;
     }
   }
 }
 
-Server::Server(unsigned short port, std::chrono::microseconds timeout)
-    : sockfd_(CreateSocket(timeout)) {
-  // Create a socket and associate the it with the port
-  struct sockaddr_in server_address = {};
-  server_address.sin_family = AF_INET;
-  server_address.sin_addr.s_addr = htonl(INADDR_ANY);
-  server_address.sin_port = htons(port);
-
-  if (bind(sockfd_, (struct sockaddr *)&server_address,
-           sizeof(server_address)) < 0) {
-    throw net::BindException();
+bool Server::ReceiveDatagram() {
+  // Create a zeroed out buffer to read the message into.
+  char buf[BUFSIZE];
+  bzero(buf, BUFSIZE);
+  char control[kControlSize];
+
+  struct sockaddr_in clientaddr;
+  struct iovec iov = {buf, BUFSIZE};
+  struct msghdr msg = {};
+  msg.msg_name = &clientaddr;
+  msg.msg_namelen = sizeof(clientaddr);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  int n = recvmsg(sockfd_, &msg, MSG_DONTWAIT);
+  if (n < 0) {
+    if (IsErrnoTimeout() || errno == EINTR) {
+      return true;
+    }
+    // Hand the error to Listen, which rethrows it on the caller's thread.
+    Fail(std::make_exception_ptr(net::ReceiveException()));
+    return false;
   }
-};
+  Deliver(SocketAddress(clientaddr), buf, n, SoftwareTimestamp(&msg));
+  return true;
+}
 
-void Server::Listen(OnReceiveFn rcv, OnTimeout timeout) const {
-  // While the server is running, wait for datagrams and
-  // call the provided closure with their data.
-  while (1) {
-    // Create a zeroed out buffer to read the message into.
-    char buf[BUFSIZE];
-    bzero(buf, BUFSIZE);
-
-    // Receive from the socket.
-    struct sockaddr_in clientaddr;
-    socklen_t clientlen = sizeof(clientaddr);
-    int n = recvfrom(sockfd_, buf, BUFSIZE, 0, (struct sockaddr *)&clientaddr,
-                     &clientlen);
-    if (n < 0) {
-      if (IsErrnoTimeout()) {
-        auto action = timeout();
-        switch (action) {
-          case ServerAction::Continue:
-            continue;
-          case ServerAction::Stop:
-            return;
-          default:
-            throw std::invalid_argument("unexpected ServerAction value");
-        }
-      } else {
-        throw net::ReceiveException();
-      }
+void Server::ReceiveTransmitTimes() {
+  while (true) {
+    char control[kControlSize];
+    struct msghdr msg = {};
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sockfd_, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      return;
     }
 
-    // Call closure with new client.
-    auto client = std::make_shared<udp::Client>(clientaddr);
+    auto sent = SoftwareTimestamp(&msg);
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR) {
+        continue;
+      }
+      auto err = reinterpret_cast<struct sock_extended_err*>(CMSG_DATA(cmsg));
+      if (err->ee_errno != ENOMSG ||
+          err->ee_origin != SO_EE_ORIGIN_TIMESTAMPING || !sent) {
+        continue;
+      }
 
-    // Call the receive callback with the data received.
-    auto action = rcv(client, buf, n);
-    if (action == ServerAction::Stop) {
-      return;
+      uint64_t id = 0;
+      {
+        std::lock_guard<std::mutex> lock(transmit_mu_);
+        auto const &entry =
+            transmit_ids_[err->ee_data % transport::kTransmitTimes];
+        if (entry.first == err->ee_data) id = entry.second;
+      }
+      if (id != 0) {
+        Transmitted(id, *sent);
+      }
     }
   }
 }
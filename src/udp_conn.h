@@ -10,105 +10,85 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include <atomic>
 #include <chrono>
-#include <functional>
 #include <iostream>
-#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "log.h"
 #include "net.h"
 #include "net_exception.h"
-
-#define BUFSIZE 1024
+#include "socket_address.h"
+#include "transport.h"
 
 namespace udp {
 
 typedef int Socket;
 
+// The receive buffer requested for every socket. Concurrent agreement
+// instances arrive in bursts that overflow the default buffer whenever the
+// receive thread falls behind. The kernel caps it at net.core.rmem_max.
+const int kReceiveBufferSize = 4 << 20;
+
 // Creates a new socket with the provided timeout.
 Socket CreateSocket(const std::chrono::microseconds timeout);
 
 // Determines if the current error was a result of a timeout.
 inline bool IsErrnoTimeout();
 
-// Wraps a C sockaddr_in with a group of useful functionality.
-class SocketAddress {
+// Asks the kernel to timestamp every datagram the socket sends and receives
+// in software (SO_TIMESTAMPING), which works on any interface including
+// loopback. Returns whether the kernel supports it.
+bool EnableTimestamping(Socket sockfd);
+
+// Owns the single UDP socket of a process. All messages are sent from the
+// Server's bound port and all datagrams arrive on it, so peers can identify a
+// sender exactly by its address. A background thread receives every datagram
+// and hands it to the transport::Server for demultiplexing.
+//
+// When the kernel supports it, every datagram is timestamped by the kernel as
+// it leaves and arrives. Receive timestamps are delivered with each datagram,
+// and transmit timestamps are read from the socket's error queue and matched
+// to their datagram by the order of the sends.
+class Server : public transport::Server {
  public:
-  SocketAddress(struct sockaddr_in sockaddr) : addr_(sockaddr){};
-  SocketAddress(net::Address addr);
+  Server(unsigned short port, transport::AckDecoderFn ack_decoder,
+         std::chrono::microseconds timeout = transport::kNoTimeout);
 
-  std::string Hostname() const;
-  unsigned short Port() const;
-
-  inline const struct sockaddr* addr() const {
-    return (struct sockaddr*)&addr_;
-  };
-  inline socklen_t addr_len() const { return sizeof(addr_); };
+  ~Server();
 
  private:
-  struct sockaddr_in addr_;
-};
-
-class Client;
-typedef std::shared_ptr<const Client> ClientPtr;
-
-// Defines the methods of interacting with a running server.
-enum class ServerAction {
-  Continue,
-  Stop,
-};
-
-typedef std::function<ServerAction(ClientPtr, char*, size_t)> OnReceiveFn;
-typedef std::function<ServerAction()> OnTimeout;
-
-const auto kNoTimeout = std::chrono::microseconds{0};
-
-// Provides an interface to send UDP messages to a remote server.
-class Client : public std::enable_shared_from_this<Client> {
- public:
-  Client(net::Address addr, std::chrono::microseconds timeout = kNoTimeout)
-      : sockfd_(CreateSocket(timeout)), remote_address_(addr){};
-
-  Client(struct sockaddr_in sockaddr)
-      : sockfd_(CreateSocket(kNoTimeout)), remote_address_(sockaddr){};
-
-  ~Client() { close(sockfd_); };
+  // Sends the message to the remote address.
+  void Transmit(uint64_t id, const SocketAddress& to, const char* buf,
+                size_t size);
 
-  // Sends the message to the remote server.
-  void Send(const char* buf, size_t size) const;
-
-  // Sends the message to the remote server and waits for an acknowledgement.
-  // Will send up to the number of attempts provided, unless attempts = 0, in
-  // which case it will continue to send forever until an ack is seen.
-  void SendWithAck(const char* buf, size_t size, unsigned int attempts,
-                   OnReceiveFn validAck) const;
-
-  // Returns the address of the remote server.
-  inline net::Address RemoteAddress() const {
-    return net::Address(remote_address_.Hostname(), remote_address_.Port());
-  };
-  // Returns the hostname of the remote server.
-  inline std::string RemoteHostname() const {
-    return remote_address_.Hostname();
-  };
-
- private:
-  const Socket sockfd_;
-  const SocketAddress remote_address_;
-};
-
-// Listens for incoming UDP messages.
-class Server {
- public:
-  Server(unsigned short port, std::chrono::microseconds timeout = kNoTimeout);
-
-  ~Server() { close(sockfd_); };
-
-  void Listen(OnReceiveFn rcv, OnTimeout timeout) const;
-
- private:
   const Socket sockfd_;
+  const bool timestamping_;
+
+  // Serializes sends while timestamping, so that the kernel numbers them in
+  // the order they are recorded in transmit_ids_.
+  std::mutex transmit_mu_;
+  // The number of datagrams sent so far, which is the key the kernel gives
+  // the transmit timestamp of the next one.
+  uint32_t transmit_key_;
+  // The transport ids of recent datagrams, with their keys, indexed by key
+  // modulo transport::kTransmitTimes.
+  std::vector<std::pair<uint32_t, uint64_t>> transmit_ids_;
+
+  std::atomic<bool> stopped_;
+  std::thread receiver_;
+
+  // Receives datagrams until the Server is destroyed.
+  void Receive();
+  // Receives a datagram and hands it to Deliver. Returns false on a fatal
+  // error.
+  bool ReceiveDatagram();
+  // Reads the transmit timestamps waiting on the socket's error queue.
+  void ReceiveTransmitTimes();
 };
 
 }  // namespace udp